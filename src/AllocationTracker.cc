@@ -0,0 +1,129 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include "AllocationTracker.h"
+
+#ifdef MOTO_ALLOC_TRACKING
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <atomic>
+
+// glibc entry points the public malloc family forwards to.
+extern "C" void *__libc_malloc (size_t size);
+extern "C" void *__libc_calloc (size_t n, size_t size);
+extern "C" void *__libc_realloc (void *ptr, size_t size);
+extern "C" void *__libc_memalign (size_t alignment, size_t size);
+
+namespace {
+
+const unsigned long MAX_REPORTS = 8;
+const int MAX_FRAMES = 16;
+
+std::atomic <bool> armed (false);
+std::atomic <unsigned long> count (0);
+
+// backtrace () may allocate itself. Don't count what we do while reporting.
+__thread bool reporting = false;
+
+void report (size_t size)
+{
+        if (!armed.load (std::memory_order_relaxed) || reporting) {
+                return;
+        }
+
+        unsigned long n = count.fetch_add (1, std::memory_order_relaxed) + 1;
+
+        if (n > MAX_REPORTS) {
+                return;
+        }
+
+        reporting = true;
+
+        const char header[] = "allocation after warm-up, size : ";
+        char num[24];
+        int len = 0;
+
+        do {
+                num[sizeof (num) - 1 - len++] = '0' + size % 10;
+                size /= 10;
+        } while (size && len < int (sizeof (num)));
+
+        ssize_t r = write (STDERR_FILENO, header, sizeof (header) - 1);
+        r = write (STDERR_FILENO, num + sizeof (num) - len, len);
+        r = write (STDERR_FILENO, "\n", 1);
+        (void)r;
+
+        void *frames[MAX_FRAMES];
+        int depth = backtrace (frames, MAX_FRAMES);
+        backtrace_symbols_fd (frames, depth, STDERR_FILENO);
+        reporting = false;
+}
+
+} // namespace
+
+extern "C" void *malloc (size_t size)
+{
+        report (size);
+        return __libc_malloc (size);
+}
+
+extern "C" void *calloc (size_t n, size_t size)
+{
+        report (n * size);
+        return __libc_calloc (n, size);
+}
+
+extern "C" void *realloc (void *ptr, size_t size)
+{
+        report (size);
+        return __libc_realloc (ptr, size);
+}
+
+extern "C" int posix_memalign (void **ptr, size_t alignment, size_t size)
+{
+        report (size);
+
+        if (!(*ptr = __libc_memalign (alignment, size))) {
+                return ENOMEM;
+        }
+
+        return 0;
+}
+
+namespace allocation {
+
+void arm ()
+{
+        // Let backtrace () load whatever it loads lazily while we still allow it.
+        void *frames[MAX_FRAMES];
+        backtrace (frames, MAX_FRAMES);
+        armed = true;
+}
+
+void disarm () { armed = false; }
+unsigned long violations () { return count.load (std::memory_order_relaxed); }
+bool isTracking () { return true; }
+
+} // namespace allocation
+
+#else
+
+namespace allocation {
+
+void arm () {}
+void disarm () {}
+unsigned long violations () { return 0; }
+bool isTracking () { return false; }
+
+} // namespace allocation
+
+#endif
@@ -0,0 +1,36 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef ALLOCATIONTRACKER_H_
+#define ALLOCATIONTRACKER_H_
+
+/**
+ * Checks that the steady state pipeline does not touch the heap. Built with
+ * -DMOTO_ALLOC_TRACKING (cmake -DALLOC_TRACKING=ON) malloc, calloc, realloc,
+ * posix_memalign and everything built on top of them (operator new included) are
+ * hooked. After arm () every allocation, from any thread, is counted and the first
+ * few are reported to stderr with a backtrace. Without the define all of this
+ * compiles to nothing.
+ */
+namespace allocation {
+
+/// Call once warm-up is over (pools sized, files open, first segments rotated).
+void arm ();
+
+/// Call before tear-down, which is allowed to allocate.
+void disarm ();
+
+/// Allocations seen while armed.
+unsigned long violations ();
+
+/// True if built with MOTO_ALLOC_TRACKING.
+bool isTracking ();
+
+} // namespace allocation
+
+#endif /* ALLOCATIONTRACKER_H_ */
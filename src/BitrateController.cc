@@ -0,0 +1,79 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <algorithm>
+#include "BitrateController.h"
+
+BitrateController::BitrateController (unsigned int initial, unsigned int floor, unsigned int ceiling) :
+        bitrate (initial),
+        floor (floor),
+        ceiling (ceiling)
+{
+        bitrate = std::max (floor, std::min (bitrate, ceiling));
+}
+
+/*****************************************************************************/
+
+unsigned int BitrateController::update (unsigned int queueDepth, uint32_t p99Us, uint64_t droppedBytes)
+{
+        if (!isEnabled ()) {
+                return 0;
+        }
+
+        bool dropped = droppedBytes > lastDropped;
+        lastDropped = droppedBytes;
+
+        if (dropped || queueDepth >= HIGH_DEPTH || p99Us >= HIGH_LATENCY_US) {
+                healthyTicks = 0;
+                unsigned int b = std::max (floor, bitrate - bitrate / 100 * DECREASE_PERCENT);
+
+                if (b == bitrate) {
+                        return 0;
+                }
+
+                return bitrate = b;
+        }
+
+        if (queueDepth > LOW_DEPTH || p99Us > LOW_LATENCY_US) {
+                // Between the thresholds : hold.
+                healthyTicks = 0;
+                return 0;
+        }
+
+        if (++healthyTicks < UP_HOLD_TICKS || bitrate >= ceiling) {
+                return 0;
+        }
+
+        healthyTicks = 0;
+        return bitrate = std::min (ceiling, bitrate + STEP);
+}
+
+/*****************************************************************************/
+
+void BitrateController::pin (unsigned int b)
+{
+        if (!pinned) {
+                saved = bitrate;
+                pinned = true;
+        }
+
+        bitrate = b;
+}
+
+/*****************************************************************************/
+
+unsigned int BitrateController::release ()
+{
+        if (pinned) {
+                pinned = false;
+                bitrate = saved;
+        }
+
+        healthyTicks = 0;
+        return bitrate;
+}
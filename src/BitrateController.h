@@ -0,0 +1,67 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef BITRATECONTROLLER_H_
+#define BITRATECONTROLLER_H_
+
+#include <stdint.h>
+
+/**
+ * Decides the encoder bitrate from storage backpressure. Call update () once per TICK_MS
+ * with the state of the writer. When the card falls behind (queue filling up, slow
+ * writes or dropped data) the bitrate goes down by DECREASE_PERCENT at once; it goes
+ * back up by STEP only after the writer looked healthy for UP_HOLD_TICKS ticks in a row.
+ * The gap between the "congested" and "healthy" thresholds, plus the hold time, is
+ * the hysteresis which keeps the controller from oscillating.
+ */
+class BitrateController {
+public:
+
+        BitrateController (unsigned int initial, unsigned int floor, unsigned int ceiling);
+
+        /**
+         * @return the new bitrate if it should change, 0 otherwise.
+         */
+        unsigned int update (unsigned int queueDepth, uint32_t p99Us, uint64_t droppedBytes);
+
+        bool isEnabled () const { return floor < ceiling && !pinned; }
+        unsigned int getBitrate () const { return bitrate; }
+
+        /**
+         * Fixes the bitrate (e.g. for a parked bike) until release (). Adaptation is suspended
+         * meanwhile.
+         */
+        void pin (unsigned int b);
+
+        /**
+         * Ends pin (). Returns the bitrate from before pinning, to be applied right away.
+         */
+        unsigned int release ();
+
+        static const unsigned int TICK_MS = 1000;
+
+private:
+
+        static const unsigned int HIGH_DEPTH = 4;
+        static const unsigned int LOW_DEPTH = 1;
+        static const uint32_t HIGH_LATENCY_US = 250000;
+        static const uint32_t LOW_LATENCY_US = 50000;
+        static const unsigned int DECREASE_PERCENT = 25;
+        static const unsigned int STEP = 1000000;
+        static const unsigned int UP_HOLD_TICKS = 10;
+
+        unsigned int bitrate;
+        unsigned int floor;
+        unsigned int ceiling;
+        unsigned int saved = 0;
+        bool pinned = false;
+        unsigned int healthyTicks = 0;
+        uint64_t lastDropped = 0;
+};
+
+#endif /* BITRATECONTROLLER_H_ */
@@ -0,0 +1,237 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <cmath>
+#include <vector>
+#include <iostream>
+#include "Calibration.h"
+#include "Indices.h"
+
+namespace {
+
+// Factors found empirically. Engine temperature : equation found by my wife with excel.
+struct DefaultVelocity { static constexpr double at (double raw) { return raw * 0.4; } };
+struct DefaultRpm { static constexpr double at (double raw) { return raw; } };
+struct DefaultEngineTemp { static constexpr double at (double raw) { return 0.95515 * raw - 25.724; } };
+struct DefaultAirTemp { static constexpr double at (double raw) { return raw; } };
+
+template <typename F, typename Seq> struct DefaultLut;
+template <typename F, unsigned int... I> struct DefaultLut <F, Indices <I...>> {
+        static constexpr Calibration::Lut TABLE = {{ float (F::at (I))... }};
+};
+
+template <typename F, unsigned int... I>
+constexpr Calibration::Lut DefaultLut <F, Indices <I...>>::TABLE;
+
+template <typename F, typename Seq> struct DefaultCurve;
+template <typename F, unsigned int... I> struct DefaultCurve <F, Indices <I...>> {
+        static const unsigned int STEP = 1 << Calibration::Curve::SHIFT;
+        static constexpr Calibration::Curve TABLE = {{ { float (F::at (I * STEP)), float ((F::at ((I + 1) * STEP) - F::at (I * STEP)) / STEP) }... }};
+};
+
+template <typename F, unsigned int... I>
+constexpr Calibration::Curve DefaultCurve <F, Indices <I...>>::TABLE;
+
+template <typename F> using LutOf = DefaultLut <F, typename MakeIndices <Calibration::Lut::SIZE>::Type>;
+template <typename F> using CurveOf = DefaultCurve <F, typename MakeIndices <(Calibration::Curve::SIZE >> Calibration::Curve::SHIFT)>::Type>;
+
+struct Point {
+        double raw;
+        double value;
+};
+
+typedef std::vector <Point> Points;
+
+/// Polyline through p (at least 2 points, ascending raw), extended by its first and last segment.
+double interpolate (Points const &p, double raw)
+{
+        size_t i = 1;
+
+        while (i < p.size () - 1 && p[i].raw < raw) {
+                ++i;
+        }
+
+        Point const &a = p[i - 1];
+        Point const &b = p[i];
+        return a.value + (b.value - a.value) * (raw - a.raw) / (b.raw - a.raw);
+}
+
+void fill (Calibration::Lut &lut, Points const &p)
+{
+        for (uint32_t r = 0; r < Calibration::Lut::SIZE; ++r) {
+                lut.value[r] = float (interpolate (p, r));
+        }
+}
+
+/// Points inside a segment are approximated by the line between its ends.
+void fill (Calibration::Curve &curve, Points const &p)
+{
+        const unsigned int step = 1 << Calibration::Curve::SHIFT;
+
+        for (unsigned int i = 0; i < (Calibration::Curve::SIZE >> Calibration::Curve::SHIFT); ++i) {
+                double begin = interpolate (p, i * step);
+                double end = interpolate (p, (i + 1) * step);
+                curve.segment[i].base = float (begin);
+                curve.segment[i].slope = float ((end - begin) / step);
+        }
+}
+
+enum Channel { VELOCITY, RPM, ENGINE_TEMP, AIR_TEMP, CHANNELS };
+
+const char *const CHANNEL_NAMES[CHANNELS] = { "velocity", "rpm", "engine_temp", "air_temp" };
+const uint32_t CHANNEL_SIZES[CHANNELS] = { Calibration::Curve::SIZE, Calibration::Curve::SIZE, Calibration::Lut::SIZE, Calibration::Lut::SIZE };
+
+} // namespace
+
+/*****************************************************************************/
+
+uint32_t Calibration::Lut::raw (float v) const
+{
+        uint32_t best = 0;
+
+        for (uint32_t r = 1; r < SIZE; ++r) {
+                if (fabsf (value[r] - v) < fabsf (value[best] - v)) {
+                        best = r;
+                }
+        }
+
+        return best;
+}
+
+/*****************************************************************************/
+
+uint32_t Calibration::Curve::raw (float v) const
+{
+        const uint32_t step = 1 << SHIFT;
+        uint32_t best = 0;
+        float bestError = fabsf (segment[0].base - v);
+
+        for (uint32_t i = 0; i < (SIZE >> SHIFT); ++i) {
+                Segment const &s = segment[i];
+                float t = (s.slope != 0) ? roundf ((v - s.base) / s.slope) : 0;
+                uint32_t offset = (t <= 0) ? 0 : (t >= step - 1) ? step - 1 : uint32_t (t);
+                float error = fabsf (s.base + s.slope * offset - v);
+
+                if (error < bestError) {
+                        bestError = error;
+                        best = i * step + offset;
+                }
+        }
+
+        return best;
+}
+
+/*****************************************************************************/
+
+Calibration::Calibration () :
+        velocity (CurveOf <DefaultVelocity>::TABLE),
+        rpm (CurveOf <DefaultRpm>::TABLE),
+        engineTemp (LutOf <DefaultEngineTemp>::TABLE),
+        airTemp (LutOf <DefaultAirTemp>::TABLE)
+{
+}
+
+/*****************************************************************************/
+
+bool Calibration::load (const char *path)
+{
+        FILE *file = fopen (path, "r");
+
+        if (!file) {
+                std::cerr << "Calibration::load : unable to open " << path << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        Points points[CHANNELS];
+        char line[256];
+        unsigned int number = 0;
+        const char *error = nullptr;
+
+        while (!error && fgets (line, sizeof (line), file)) {
+                ++number;
+
+                if (char *comment = strchr (line, '#')) {
+                        *comment = '\0';
+                }
+
+                char name[32];
+                char trailing;
+                Point p;
+                int n = sscanf (line, "%31s %lf %lf %c", name, &p.raw, &p.value, &trailing);
+
+                if (n <= 0) {
+                        continue;
+                }
+
+                if (n != 3) {
+                        error = "expected : channel raw value";
+                        break;
+                }
+
+                int c = 0;
+
+                while (c < CHANNELS && strcmp (name, CHANNEL_NAMES[c]) != 0) {
+                        ++c;
+                }
+
+                if (c == CHANNELS) {
+                        error = "unknown channel";
+                }
+                else if (p.raw < 0 || p.raw >= CHANNEL_SIZES[c] || !std::isfinite (p.value)) {
+                        error = "value out of range";
+                }
+                else if (!points[c].empty () && p.raw <= points[c].back ().raw) {
+                        error = "raw values of a channel have to ascend";
+                }
+                else {
+                        points[c].push_back (p);
+                }
+        }
+
+        fclose (file);
+
+        for (int c = 0; !error && c < CHANNELS; ++c) {
+                if (points[c].size () == 1) {
+                        error = "a channel needs at least two points";
+                        number = 0;
+                }
+        }
+
+        if (error) {
+                std::cerr << "Calibration::load : " << path;
+
+                if (number) {
+                        std::cerr << ":" << number;
+                }
+
+                std::cerr << " : " << error << std::endl;
+                return false;
+        }
+
+        if (!points[VELOCITY].empty ()) {
+                fill (velocity, points[VELOCITY]);
+        }
+
+        if (!points[RPM].empty ()) {
+                fill (rpm, points[RPM]);
+        }
+
+        if (!points[ENGINE_TEMP].empty ()) {
+                fill (engineTemp, points[ENGINE_TEMP]);
+        }
+
+        if (!points[AIR_TEMP].empty ()) {
+                fill (airTemp, points[AIR_TEMP]);
+        }
+
+        return true;
+}
@@ -0,0 +1,79 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef CALIBRATION_H_
+#define CALIBRATION_H_
+
+#include <stdint.h>
+
+/**
+ * Raw shield readings -> physical units, one table per channel. 8 bit channels map through
+ * a 256 entry LUT, 16 bit ones through a piecewise linear curve with equal segments, so the
+ * decoder does a lookup (and one multiply-add) per field and never evaluates a formula.
+ *
+ * The defaults are the factors we used to have in the decoder, tabulated at compile time.
+ * A per-bike file loaded at startup replaces any of them, so a different sensor, or a proper
+ * NTC curve instead of a straight line, needs no recompile. See load () for the format.
+ */
+class Calibration {
+public:
+
+        /// 8 bit channel, one entry per raw value.
+        struct Lut {
+                static const uint32_t SIZE = 256;
+
+                float value[SIZE];
+
+                float operator() (uint32_t raw) const { return value[raw]; }
+
+                /// Raw value closest to v (encoding, tests). Linear search.
+                uint32_t raw (float v) const;
+        };
+
+        /// 16 bit channel, linear within each run of 2^SHIFT raw values.
+        struct Curve {
+                static const uint32_t SIZE = 65536;
+                static const unsigned int SHIFT = 8;
+
+                struct Segment {
+                        float base;  // Value at the first raw value of the segment.
+                        float slope; // Per raw unit.
+                };
+
+                Segment segment[SIZE >> SHIFT];
+
+                float operator() (uint32_t raw) const
+                {
+                        Segment const &s = segment[raw >> SHIFT];
+                        return s.base + s.slope * (raw & ((1 << SHIFT) - 1));
+                }
+
+                /// Raw value closest to v (encoding, tests).
+                uint32_t raw (float v) const;
+        };
+
+        /// Compile time defaults.
+        Calibration ();
+
+        /**
+         * Reads a calibration file. One point per line : channel name, raw value, physical
+         * value. '#' starts a comment. Points of a channel go in ascending raw order, at least
+         * two of them ; the table is the polyline through them, extended linearly past the
+         * first and the last one. Channels : velocity (km/h), rpm, engine_temp and air_temp
+         * (Celsius). Channels missing from the file keep their tables. Nothing changes if the
+         * file has an error, which is reported on stderr.
+         */
+        bool load (const char *path);
+
+        Curve velocity;
+        Curve rpm;
+        Lut engineTemp;
+        Lut airTemp;
+};
+
+#endif /* CALIBRATION_H_ */
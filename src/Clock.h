@@ -0,0 +1,56 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Microseconds from CLOCK_MONOTONIC. All the telemetry timestamps use this clock.
+ */
+inline uint64_t monotonicUs ()
+{
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return uint64_t (ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Nanoseconds from CLOCK_MONOTONIC, for timing short pieces of code.
+ */
+inline uint64_t monotonicNs ()
+{
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return uint64_t (ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Microseconds since the kernel booted (includes suspend). Used for the time from power-on
+ * to the first frame.
+ */
+inline uint64_t bootTimeUs ()
+{
+        struct timespec ts;
+        clock_gettime (CLOCK_BOOTTIME, &ts);
+        return uint64_t (ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Wall clock microseconds since the epoch. Only for humans (manifest), never for measuring time.
+ */
+inline int64_t wallClockUs ()
+{
+        struct timespec ts;
+        clock_gettime (CLOCK_REALTIME, &ts);
+        return int64_t (ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif /* CLOCK_H_ */
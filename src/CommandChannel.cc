@@ -0,0 +1,145 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <inttypes.h>
+#include "CommandChannel.h"
+#include "Shield.h"
+#include "EventLoop.h"
+#include "TelemetryLog.h"
+#include "Clock.h"
+
+CommandChannel::CommandChannel (Shield &shield, EventLoop &loop, TelemetryLog &log) : shield (shield), loop (loop), log (log)
+{
+        shield.onAck ([this] (uint8_t sequence, uint8_t status) { onAck (sequence, status); });
+
+        // Armed only while something waits for an ack.
+        timer = loop.addTimer (0, false, [this] (uint32_t) { check (); });
+}
+
+/*****************************************************************************/
+
+bool CommandChannel::send (protocol::Command command, uint16_t argument)
+{
+        if (shield.getVersion () != 2 || pendingNum >= MAX_PENDING) {
+                return false;
+        }
+
+        for (Pending &p : pending) {
+                if (p.used) {
+                        continue;
+                }
+
+                p.used = true;
+                p.sequence = nextSequence++;
+                p.command = command;
+                p.argument = argument;
+                p.tries = 0;
+                p.firstSent = monotonicUs ();
+
+                if (pendingNum++ == 0) {
+                        loop.setTimer (timer, ACK_TIMEOUT_MS, true);
+                }
+
+                ++sent;
+                return transmit (p, p.firstSent);
+        }
+
+        return false;
+}
+
+/*****************************************************************************/
+
+bool CommandChannel::transmit (Pending &p, uint64_t now)
+{
+        uint16_t argument = p.argument;
+
+        if (p.command == protocol::SYNC_TICK) {
+                // Computed per try, a retransmission must not carry a stale time.
+                argument = uint16_t (now / protocol::TICK_US);
+        }
+
+        uint8_t data[protocol::COMMAND_SIZE];
+        protocol::encodeCommand (p.sequence, p.command, argument, data);
+        p.lastSent = now;
+        ++p.tries;
+        return shield.send (data, sizeof (data));
+}
+
+/*****************************************************************************/
+
+void CommandChannel::release (Pending &p)
+{
+        p.used = false;
+
+        if (--pendingNum == 0) {
+                loop.setTimer (timer, 0, false);
+        }
+}
+
+/*****************************************************************************/
+
+void CommandChannel::onAck (uint8_t sequence, uint8_t status)
+{
+        for (Pending &p : pending) {
+                if (!p.used || p.sequence != sequence) {
+                        continue;
+                }
+
+                uint64_t now = monotonicUs ();
+                roundTrip.add (uint32_t (now - p.firstSent));
+
+                if (status == protocol::ACK_OK) {
+                        ++acked;
+                }
+                else {
+                        ++rejected;
+                        log.event ("COMMAND rejected cmd=%u arg=%u status=%u", p.command, p.argument, status);
+                }
+
+                release (p);
+                return;
+        }
+
+        // Ack of a command which timed out already, or a duplicate after a retransmission.
+}
+
+/*****************************************************************************/
+
+void CommandChannel::check ()
+{
+        uint64_t now = monotonicUs ();
+        shield.flush ();
+
+        for (Pending &p : pending) {
+                if (!p.used || now - p.lastSent < ACK_TIMEOUT_MS * 1000) {
+                        continue;
+                }
+
+                if (p.tries >= MAX_TRIES) {
+                        ++failed;
+                        log.event ("COMMAND failed cmd=%u arg=%u tries=%u", p.command, p.argument, p.tries);
+                        release (p);
+                        continue;
+                }
+
+                ++retries;
+                transmit (p, now);
+        }
+}
+
+/*****************************************************************************/
+
+void CommandChannel::print (FILE *f) const
+{
+        if (!sent) {
+                return;
+        }
+
+        fprintf (f, "shield commands : %" PRIu64 " sent, %" PRIu64 " acked, %" PRIu64 " rejected, %" PRIu64 " failed, %" PRIu64 " retries\n", sent, acked, rejected, failed, retries);
+        roundTrip.print (f, "shield command round trip");
+}
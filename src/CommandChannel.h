@@ -0,0 +1,87 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef COMMANDCHANNEL_H_
+#define COMMANDCHANNEL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "Protocol.h"
+#include "Stats.h"
+
+class Shield;
+class EventLoop;
+class TelemetryLog;
+
+/**
+ * Commands to the AVR (see protocol::Command), over the same UART the telemetry comes in.
+ * Every command carries a sequence number and stays pending until the AVR acks it. Without
+ * an ack within ACK_TIMEOUT_MS it is sent again, MAX_TRIES times in total, after which the
+ * failure goes to the telemetry log. Runs in the event loop thread; writes never block the
+ * reader (see Shield::send).
+ *
+ * v1 firmware does not listen, so nothing is sent unless the shield speaks v2.
+ */
+class CommandChannel {
+public:
+
+        CommandChannel (Shield &shield, EventLoop &loop, TelemetryLog &log);
+
+        /// False if the command could not even be queued (v1 shield, too many pending).
+        bool send (protocol::Command command, uint16_t argument);
+
+        bool setRate (unsigned int hz) { return send (protocol::SET_RATE, hz); }
+        bool setFields (uint16_t mask) { return send (protocol::SET_FIELDS, mask); }
+        bool snapshot () { return send (protocol::SNAPSHOT, 0); }
+
+        /// Sets the AVR tick to our clock (in ticks, modulo the wrap), so both count alike.
+        bool syncTick () { return send (protocol::SYNC_TICK, 0); }
+
+        void print (FILE *f) const;
+
+        static const unsigned int ACK_TIMEOUT_MS = 50;
+        static const unsigned int MAX_TRIES = 4;
+
+private:
+
+        struct Pending {
+                bool used = false;
+                uint8_t sequence = 0;
+                protocol::Command command = protocol::SNAPSHOT;
+                uint16_t argument = 0;
+                uint64_t firstSent = 0;
+                uint64_t lastSent = 0;
+                unsigned int tries = 0;
+        };
+
+        bool transmit (Pending &p, uint64_t now);
+        void onAck (uint8_t sequence, uint8_t status);
+        void check ();
+        void release (Pending &p);
+
+private:
+
+        static const unsigned int MAX_PENDING = 8;
+
+        Shield &shield;
+        EventLoop &loop;
+        TelemetryLog &log;
+        int timer = -1;
+        uint8_t nextSequence = 0;
+        unsigned int pendingNum = 0;
+        Pending pending[MAX_PENDING];
+
+        uint64_t sent = 0;
+        uint64_t acked = 0;
+        uint64_t rejected = 0;
+        uint64_t failed = 0;
+        uint64_t retries = 0;
+        LatencyStats roundTrip;
+};
+
+#endif /* COMMANDCHANNEL_H_ */
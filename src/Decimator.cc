@@ -0,0 +1,181 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "Decimator.h"
+#include "Clock.h"
+
+static const int32_t Q = 256; // Q8 samples.
+
+bool Decimator::push (Frame const &in, Frame &out)
+{
+        uint64_t start = (++pushes % COST_SAMPLING == 0) ? monotonicNs () : 0;
+
+        // Input rate. Gaps (link down, first frame) don't count.
+        if (lastInput && in.sampleTime > lastInput && in.sampleTime - lastInput < 1000000) {
+                int64_t d = in.sampleTime - lastInput;
+                periodUs = (periodUs) ? periodUs + (d - int64_t (periodUs)) / 16 : d;
+        }
+
+        lastInput = in.sampleTime;
+
+        if (outputHz && periodUs) {
+                double ratio = 1e6 / periodUs / outputHz;
+                unsigned int m = (ratio < 1.5) ? 1 : (ratio > MAX_FACTOR) ? MAX_FACTOR : unsigned (ratio + 0.5);
+
+                // Hysteresis, so a rate right between two factors doesn't make us switch back and forth.
+                if (m != factor && fabs (ratio - factor) >= 0.75) {
+                        configure (m);
+                }
+        }
+
+        if (factor == 1) {
+                out = in;
+                return true;
+        }
+
+        int32_t x[LANES] = { int32_t (in.velocity * Q), int32_t (in.rpm * Q), int32_t (in.engineTemp * Q), int32_t (in.airTemp * Q) };
+        int32_t y[LANES];
+        bool ready = filter (x, y);
+
+        if (ready && warmup) {
+                // Filters still filling up with the samples from after configure ().
+                --warmup;
+                ready = false;
+        }
+
+        if (ready) {
+                out = in;
+                out.velocity = float (y[0]) / Q;
+                out.rpm = float (y[1]) / Q;
+                out.engineTemp = float (y[2]) / Q;
+                out.airTemp = float (y[3]) / Q;
+                out.sampleTime -= delaySamples * periodUs;
+        }
+
+        if (start) {
+                costNs.add (uint32_t (monotonicNs () - start));
+        }
+
+        return ready;
+}
+
+/*****************************************************************************/
+
+void Decimator::configure (unsigned int m)
+{
+        factor = m;
+        firStage = (m % 2 == 0);
+        cicFactor = (firStage) ? m / 2 : m;
+        cicGain = int64_t (cicFactor) * cicFactor * cicFactor;
+        cicPhase = firPhase = linePos = 0;
+        delaySamples = ORDER * (cicFactor - 1) / 2 + ((firStage) ? Fir::CENTER * cicFactor : 0);
+
+        /*
+         * Nothing comes out until the filters are full. That is also longer than the group
+         * delay, so the first output, moved back by it, is still newer than the last one
+         * before the switch : time never goes backwards.
+         */
+        warmup = std::max ((firStage) ? (ORDER + TAPS) / 2 + 1 : ORDER, delaySamples / m + 1);
+        memset (integrator, 0, sizeof (integrator));
+        memset (comb, 0, sizeof (comb));
+        memset (line, 0, sizeof (line));
+}
+
+/*****************************************************************************/
+
+bool Decimator::filter (int32_t const *x, int32_t *y)
+{
+        // CIC integrators, at the input rate. Unsigned : the registers wrap, and the combs undo it.
+        for (unsigned int l = 0; l < LANES; ++l) {
+                integrator[0][l] += uint64_t (int64_t (x[l]));
+        }
+
+        for (unsigned int k = 1; k < ORDER; ++k) {
+                for (unsigned int l = 0; l < LANES; ++l) {
+                        integrator[k][l] += integrator[k - 1][l];
+                }
+        }
+
+        if (++cicPhase < cicFactor) {
+                return false;
+        }
+
+        cicPhase = 0;
+
+        // Combs, at the CIC output rate.
+        uint64_t v[LANES];
+
+        for (unsigned int l = 0; l < LANES; ++l) {
+                v[l] = integrator[ORDER - 1][l];
+        }
+
+        for (unsigned int k = 0; k < ORDER; ++k) {
+                for (unsigned int l = 0; l < LANES; ++l) {
+                        uint64_t t = v[l];
+                        v[l] = t - comb[k][l];
+                        comb[k][l] = t;
+                }
+        }
+
+        int32_t c[LANES];
+
+        for (unsigned int l = 0; l < LANES; ++l) {
+                c[l] = int32_t (int64_t (v[l]) / cicGain);
+        }
+
+        if (!firStage) {
+                memcpy (y, c, sizeof (c));
+                return true;
+        }
+
+        // Half-band FIR, one output for every 2 CIC outputs.
+        linePos = (linePos + 1) % TAPS;
+        memcpy (line[linePos], c, sizeof (c));
+        memcpy (line[linePos + TAPS], c, sizeof (c));
+
+        if (++firPhase < 2) {
+                return false;
+        }
+
+        firPhase = 0;
+        int64_t acc[LANES] = { 0 };
+        int32_t const (*window)[LANES] = line + linePos + 1; // Oldest first.
+
+        for (unsigned int i = 0; i < TAPS; ++i) {
+                int32_t h = Fir::COEFFICIENTS::DATA[i];
+
+                if (!h) {
+                        continue;
+                }
+
+                for (unsigned int l = 0; l < LANES; ++l) {
+                        acc[l] += int64_t (h) * window[i][l];
+                }
+        }
+
+        for (unsigned int l = 0; l < LANES; ++l) {
+                y[l] = int32_t ((acc[l] + (1 << 14)) >> 15);
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+void Decimator::print (FILE *f) const
+{
+        if (!outputHz) {
+                return;
+        }
+
+        fprintf (f, "decimator : %u Hz out, factor %u, input period %u us, cost per sample p50 %u ns, p99 %u ns, max %u ns\n",
+                 outputHz, factor, unsigned (periodUs), costNs.percentile (0.5), costNs.percentile (0.99), costNs.max ());
+}
@@ -0,0 +1,150 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef DECIMATOR_H_
+#define DECIMATOR_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "Frame.h"
+#include "Indices.h"
+#include "Stats.h"
+
+namespace dsp {
+
+static constexpr double PI = 3.14159265358979323846;
+
+/// Taylor series for |x| <= PI. Compile time only (std::sin is not constexpr).
+constexpr double sinTerms (double x2, double term, unsigned int n, double sum)
+{
+        return (n > 30) ? sum : sinTerms (x2, -term * x2 / ((2 * n) * (2 * n + 1)), n + 1, sum + term);
+}
+
+constexpr double sin (double x) { return (x > PI) ? -sin (x - PI) : (x < -PI) ? -sin (x + PI) : sinTerms (x * x, x, 1, 0); }
+constexpr double cos (double x) { return sin (x + PI / 2); }
+
+/**
+ * Half-band low pass FIR (cut-off at a quarter of the input rate) : windowed sinc, Hamming
+ * window. Every other tap except the centre one is 0, which is what makes decimating by 2
+ * with it cheap. Coefficients are Q15, computed at compile time, normalized to unity DC gain.
+ */
+template <unsigned int Taps>
+struct HalfBand {
+
+        static_assert (Taps % 4 == 3, "Half-band filter length is 4k + 3");
+
+        static const unsigned int CENTER = Taps / 2;
+
+        static constexpr double ideal (int m)
+        {
+                return (m == 0) ? 0.5 : (m % 2 == 0) ? 0.0 : sin (PI * ((m < 0) ? -m : m) / 2) / (PI * m) * ((m < 0) ? -1 : 1);
+        }
+
+        static constexpr double tap (unsigned int i)
+        {
+                return ideal (int (i) - int (CENTER)) * (0.54 - 0.46 * cos (2 * PI * i / (Taps - 1)));
+        }
+
+        static constexpr double sum (unsigned int i) { return (i == Taps) ? 0 : tap (i) + sum (i + 1); }
+
+        static constexpr int32_t rounded (unsigned int i) { return int32_t (tap (i) / sum (0) * 32768 + ((tap (i) < 0) ? -0.5 : 0.5)); }
+        static constexpr int32_t sides (unsigned int i) { return (i == Taps) ? 0 : ((i == CENTER) ? 0 : rounded (i)) + sides (i + 1); }
+
+        /// The centre tap takes the rounding errors, so the DC gain is exactly 1.
+        static constexpr int32_t q15 (unsigned int i) { return (i == CENTER) ? 32768 - sides (0) : rounded (i); }
+
+        template <typename Seq> struct Table;
+        template <unsigned int... I> struct Table <Indices <I...>> {
+                static constexpr int32_t DATA[Taps] = { q15 (I)... };
+        };
+
+        typedef Table <typename MakeIndices <Taps>::Type> COEFFICIENTS;
+};
+
+template <unsigned int Taps>
+template <unsigned int... I>
+constexpr int32_t HalfBand <Taps>::Table <Indices <I...>>::DATA[Taps];
+
+} // namespace dsp
+
+/**
+ * Brings high rate shield data (500 Hz - 1 kHz, protocol v2) down to outputHz before it is
+ * queued and logged. The continuous channels (velocity, rpm, temperatures) go through
+ *
+ *   CIC (order 3, decimation R) -> half-band FIR (decimation 2)   for even factors M = 2R,
+ *   CIC (order 3, decimation M)                                   for odd ones,
+ *
+ * in fixed point (Q8 samples, 64 bit CIC registers, Q15 FIR). Flags and sequence numbers are
+ * taken from the newest input. The factor follows the measured input rate, so the parked
+ * rate, or a v1 shield slower than outputHz (factor 1, pass through), need no setup.
+ * Output timestamps are moved back by the group delay of the filters. After the factor
+ * changes, nothing comes out until the filters have filled up again.
+ *
+ * The channels are processed as one fixed-width lane array, a loop the compiler vectorizes
+ * where the CPU has SIMD (NEON on ARMv7 builds); on the ARMv6 Pi 1 it runs scalar.
+ * Runs in the event loop thread.
+ */
+class Decimator {
+public:
+
+        /// outputHz == 0 : pass everything through.
+        Decimator (unsigned int outputHz) : outputHz (outputHz) {}
+
+        /**
+         * @return true if an output frame is ready in out.
+         */
+        bool push (Frame const &in, Frame &out);
+
+        unsigned int getFactor () const { return factor; }
+
+        /// Nanoseconds of filtering per input sample (every COST_SAMPLING-th one is measured).
+        LatencyStats const &cost () const { return costNs; }
+
+        void print (FILE *f) const;
+
+private:
+
+        static const unsigned int LANES = 4;
+        static const unsigned int ORDER = 3;
+        static const unsigned int TAPS = 15;
+        static const unsigned int MAX_FACTOR = 64;
+        static const unsigned int COST_SAMPLING = 16;
+
+        typedef dsp::HalfBand <TAPS> Fir;
+
+        void configure (unsigned int m);
+        bool filter (int32_t const *x, int32_t *y);
+
+private:
+
+        unsigned int outputHz;
+        unsigned int factor = 1;
+        unsigned int cicFactor = 1;
+        bool firStage = false;
+        uint64_t lastInput = 0;
+        uint64_t periodUs = 0; // Of the input, smoothed.
+        unsigned int delaySamples = 0; // Group delay of the filters, in input samples.
+        unsigned int pushes = 0;
+
+        unsigned int warmup = 0; // Outputs held back while the filters fill up.
+
+        // CIC
+        uint64_t integrator[ORDER][LANES];
+        uint64_t comb[ORDER][LANES];
+        unsigned int cicPhase = 0;
+        int64_t cicGain = 1;
+
+        // FIR : delay line of the last TAPS CIC outputs, twice over so it reads linearly.
+        int32_t line[2 * TAPS][LANES];
+        unsigned int linePos = 0;
+        unsigned int firPhase = 0;
+
+        LatencyStats costNs;
+};
+
+#endif /* DECIMATOR_H_ */
@@ -0,0 +1,153 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <inttypes.h>
+#include <algorithm>
+#include "DerivedMetrics.h"
+#include "TelemetryLog.h"
+
+static const double KMH = 1 / 3.6; // m/s
+static const double G = 9.80665;   // m/s^2
+
+void DerivedMetrics::Slope::add (unsigned int i, double sign)
+{
+        double t = int64_t (time[i] - origin) / 1e6;
+        double y = value[i];
+        st += sign * t;
+        sy += sign * y;
+        stt += sign * t * t;
+        sty += sign * t * y;
+}
+
+/*****************************************************************************/
+
+void DerivedMetrics::Slope::recentre (uint64_t t)
+{
+        origin = t;
+        st = sy = stt = sty = 0;
+
+        for (unsigned int k = 0; k < size; ++k) {
+                add ((head + WINDOW - 1 - k) % WINDOW, 1);
+        }
+}
+
+/*****************************************************************************/
+
+void DerivedMetrics::Slope::push (uint64_t t, double y)
+{
+        // Once per WINDOW_US of samples, so O(WINDOW) over that many pushes.
+        if (!size || t - origin > WINDOW_US) {
+                recentre (t);
+        }
+
+        if (size == WINDOW) {
+                add ((head + WINDOW - size) % WINDOW, -1);
+                --size;
+        }
+
+        time[head] = t;
+        value[head] = y;
+        add (head, 1);
+        head = (head + 1) % WINDOW;
+        ++size;
+
+        // Drop what fell out of the time window, the newest sample always stays.
+        while (size > 1) {
+                unsigned int oldest = (head + WINDOW - size) % WINDOW;
+
+                if (t - time[oldest] <= WINDOW_US) {
+                        break;
+                }
+
+                add (oldest, -1);
+                --size;
+        }
+}
+
+/*****************************************************************************/
+
+double DerivedMetrics::Slope::get () const
+{
+        if (size < 2) {
+                return 0;
+        }
+
+        double d = size * stt - st * st;
+        return (d > 0) ? (size * sty - st * sy) / d : 0;
+}
+
+/*****************************************************************************/
+
+void DerivedMetrics::update (Frame &f)
+{
+        double v = f.velocity * KMH;
+
+        if (lastTime && (f.sampleTime <= lastTime || f.sampleTime - lastTime > MAX_GAP_US)) {
+                // Gap or clock step : nothing to integrate over, slopes start again.
+                velocity.clear ();
+                acceleration.clear ();
+        }
+        else if (lastTime) {
+                uint64_t dt = f.sampleTime - lastTime;
+                double mean = (v + lastVelocity) / 2;
+                distance += mean * dt / 1e6;
+                unsigned int band = std::min (unsigned (std::max (mean, 0.0) / KMH) / SPEED_STEP, SPEED_BANDS - 1);
+                bandUs[band] += dt;
+        }
+
+        lastTime = f.sampleTime;
+        lastVelocity = v;
+
+        velocity.push (f.sampleTime, v);
+        double a = velocity.get ();
+        acceleration.push (f.sampleTime, a);
+
+        f.acceleration = float (a);
+        f.jerk = float (acceleration.get ());
+        f.distance = float (distance);
+        f.braking = (f.frontBrake || f.rearBrake) ? float (std::max (-a, 0.0) / G) : 0;
+
+        maxVelocity = std::max (maxVelocity, f.velocity);
+        maxAcceleration = std::max (maxAcceleration, f.acceleration);
+        maxBraking = std::max (maxBraking, f.braking);
+}
+
+/*****************************************************************************/
+
+void DerivedMetrics::print (FILE *f) const
+{
+        fprintf (f, "trip : %.3f km, max %.1f km/h, max acceleration %.2f m/s2, max braking %.2f g\n", distance / 1000, maxVelocity, maxAcceleration, maxBraking);
+
+        for (unsigned int i = 0; i < SPEED_BANDS; ++i) {
+                if (!bandUs[i]) {
+                        continue;
+                }
+
+                if (i == SPEED_BANDS - 1) {
+                        fprintf (f, "trip : %u+ km/h %.1f s\n", i * SPEED_STEP, bandUs[i] / 1e6);
+                }
+                else {
+                        fprintf (f, "trip : %u-%u km/h %.1f s\n", i * SPEED_STEP, (i + 1) * SPEED_STEP, bandUs[i] / 1e6);
+                }
+        }
+}
+
+/*****************************************************************************/
+
+void DerivedMetrics::report (TelemetryLog &log) const
+{
+        char bands[SPEED_BANDS * 22];
+        size_t n = 0;
+
+        // Seconds per band, comma separated, band i starts at i * SPEED_STEP km/h.
+        for (unsigned int i = 0; i < SPEED_BANDS && n < sizeof (bands); ++i) {
+                n += snprintf (bands + n, sizeof (bands) - n, "%s%" PRIu64, (i) ? "," : "", bandUs[i] / 1000000);
+        }
+
+        log.event ("TRIP distance=%.0fm vmax=%.1f amax=%.2f brakemax=%.2f step=%u bands=%s", distance, maxVelocity, maxAcceleration, maxBraking, SPEED_STEP, bands);
+}
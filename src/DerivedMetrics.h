@@ -0,0 +1,106 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef DERIVEDMETRICS_H_
+#define DERIVEDMETRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "Frame.h"
+
+class TelemetryLog;
+
+/**
+ * Channels computed from the shield samples as they arrive, so nobody has to differentiate
+ * or integrate whole ride files afterwards. Fills the derived fields of every frame :
+ *
+ * - acceleration : least squares slope of the velocity over the last WINDOW_US, using the
+ *   real sample times, so jitter and single noisy samples barely move it. Lags by half the
+ *   window. There is room for the whole window up to MAX_RATE_HZ (the fastest shield rate,
+ *   undecimated), above that it gets shorter.
+ * - jerk : the same slope, taken over the accelerations.
+ * - distance : trapezoidal integral of the velocity since the start.
+ * - braking : deceleration in g while a brake is on. Longitudinal only, we have no lean angle.
+ *
+ * Plus totals for the end of the ride : time spent in each SPEED_STEP km/h band and the
+ * peak values. The cost per sample is constant : the slopes keep running sums, recomputed
+ * from the window once per WINDOW_US to shed rounding errors. A gap in the data longer than
+ * MAX_GAP_US (link down) is not integrated over and restarts the slopes.
+ *
+ * Runs in the event loop thread, on the frames which go to the queue (after decimation).
+ */
+class DerivedMetrics {
+public:
+
+        void update (Frame &f);
+
+        /// Metres since the start.
+        double getDistance () const { return distance; }
+
+        void print (FILE *f) const;
+
+        /// Totals as a TRIP event.
+        void report (TelemetryLog &log) const;
+
+private:
+
+        static const uint64_t WINDOW_US = 250000;
+        static const unsigned int MAX_RATE_HZ = 1000;
+        static const unsigned int WINDOW = WINDOW_US * MAX_RATE_HZ / 1000000 + 1;
+        static const uint64_t MAX_GAP_US = 1000000;
+        static const unsigned int SPEED_STEP = 10;
+        static const unsigned int SPEED_BANDS = 20; // The last one is open ended.
+
+        /**
+         * Samples (time, value) of the last WINDOW_US, newest last, and the sums of the least
+         * squares fit over them : added on push, subtracted on eviction. Times are seconds from
+         * origin, which is moved to the newest sample (and the sums recomputed) once it is more
+         * than WINDOW_US behind, so they stay small and exact enough.
+         */
+        class Slope {
+        public:
+
+                void push (uint64_t t, double y);
+                void clear () { size = 0; }
+
+                /// Per second. 0 until there are two samples.
+                double get () const;
+
+        private:
+
+                void add (unsigned int i, double sign);
+                void recentre (uint64_t t);
+
+        private:
+
+                uint64_t time[WINDOW];
+                double value[WINDOW];
+                unsigned int head = 0; // Next to write.
+                unsigned int size = 0;
+
+                uint64_t origin = 0;
+                double st = 0;  // Sum of t
+                double sy = 0;  // Sum of y
+                double stt = 0; // Sum of t^2
+                double sty = 0; // Sum of t * y
+        };
+
+private:
+
+        Slope velocity; // m/s
+        Slope acceleration;
+        uint64_t lastTime = 0;
+        double lastVelocity = 0;
+        double distance = 0;
+        uint64_t bandUs[SPEED_BANDS] = {};
+        float maxVelocity = 0;
+        float maxAcceleration = 0;
+        float maxBraking = 0;
+};
+
+#endif /* DERIVEDMETRICS_H_ */
@@ -0,0 +1,300 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <iostream>
+#include "EventLoop.h"
+#include "Clock.h"
+
+static void signalSet (sigset_t *set)
+{
+        sigemptyset (set);
+        sigaddset (set, SIGINT);
+        sigaddset (set, SIGTERM);
+}
+
+/*****************************************************************************/
+
+Notifier::Notifier () : efd (eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+        if (efd < 0) {
+                std::cerr << "Notifier::Notifier : eventfd failed : " << strerror (errno) << std::endl;
+        }
+}
+
+/*****************************************************************************/
+
+Notifier::~Notifier ()
+{
+        if (efd >= 0) {
+                close (efd);
+        }
+}
+
+/*****************************************************************************/
+
+void Notifier::notify ()
+{
+        uint64_t one = 1;
+        ssize_t r = write (efd, &one, sizeof (one));
+        (void)r; // Counter saturated means the loop is awake anyway.
+}
+
+/*****************************************************************************/
+
+EventLoop::EventLoop () : epfd (epoll_create1 (EPOLL_CLOEXEC))
+{
+        if (epfd < 0) {
+                std::cerr << "EventLoop::EventLoop : epoll_create1 failed : " << strerror (errno) << std::endl;
+        }
+}
+
+/*****************************************************************************/
+
+EventLoop::~EventLoop ()
+{
+        for (int i = 0; i < sourcesNum; ++i) {
+                if (sources[i].owned) {
+                        close (sources[i].fd);
+                }
+        }
+
+        if (epfd >= 0) {
+                close (epfd);
+        }
+}
+
+/*****************************************************************************/
+
+int EventLoop::add (int fd, Type type, bool owned, uint32_t events, Handler const &handler)
+{
+        if ((fd < 0 && type != FD) || sourcesNum >= MAX_SOURCES) {
+                std::cerr << "EventLoop::add : can't watch fd " << fd << std::endl;
+
+                if (owned && fd >= 0) {
+                        close (fd);
+                }
+
+                return -1;
+        }
+
+        Source &s = sources[sourcesNum];
+        s.fd = -1;
+        s.type = type;
+        s.owned = owned;
+        s.events = events;
+        s.handler = handler;
+
+        if (!rewatch (sourcesNum, fd)) {
+                if (owned) {
+                        close (fd);
+                }
+
+                return -1;
+        }
+
+        return sourcesNum++;
+}
+
+/*****************************************************************************/
+
+bool EventLoop::rewatch (int id, int fd)
+{
+        Source &s = sources[id];
+
+        if (s.fd >= 0 && epoll_ctl (epfd, EPOLL_CTL_DEL, s.fd, nullptr) < 0) {
+                std::cerr << "EventLoop::rewatch : epoll_ctl (DEL) failed : " << strerror (errno) << std::endl;
+        }
+
+        s.fd = fd;
+
+        if (fd < 0) {
+                return true;
+        }
+
+        struct epoll_event ev;
+        memset (&ev, 0, sizeof (ev));
+        ev.events = s.events;
+        ev.data.ptr = &s;
+
+        if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                std::cerr << "EventLoop::rewatch : epoll_ctl failed : " << strerror (errno) << std::endl;
+                s.fd = -1;
+                return false;
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+int EventLoop::watch (int fd, uint32_t events, Handler const &handler)
+{
+        return add (fd, FD, false, events, handler);
+}
+
+/*****************************************************************************/
+
+int EventLoop::watch (Notifier const &notifier, Handler const &handler)
+{
+        return add (notifier.fd (), NOTIFIER, false, EPOLLIN, handler);
+}
+
+/*****************************************************************************/
+
+static bool armTimer (int fd, unsigned int intervalMs, bool periodic)
+{
+        struct itimerspec spec;
+        memset (&spec, 0, sizeof (spec));
+        spec.it_value.tv_sec = intervalMs / 1000;
+        spec.it_value.tv_nsec = (intervalMs % 1000) * 1000000;
+
+        if (periodic) {
+                spec.it_interval = spec.it_value;
+        }
+
+        if (timerfd_settime (fd, 0, &spec, nullptr) < 0) {
+                std::cerr << "EventLoop : timerfd_settime failed : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+int EventLoop::addTimer (unsigned int intervalMs, bool periodic, Handler const &handler)
+{
+        int fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        if (fd < 0) {
+                std::cerr << "EventLoop::addTimer : timerfd_create failed : " << strerror (errno) << std::endl;
+                return -1;
+        }
+
+        if (!armTimer (fd, intervalMs, periodic)) {
+                close (fd);
+                return -1;
+        }
+
+        return add (fd, TIMER, true, EPOLLIN, handler);
+}
+
+/*****************************************************************************/
+
+bool EventLoop::setTimer (int id, unsigned int intervalMs, bool periodic)
+{
+        return id >= 0 && id < sourcesNum && sources[id].type == TIMER && armTimer (sources[id].fd, intervalMs, periodic);
+}
+
+/*****************************************************************************/
+
+void EventLoop::blockSignals ()
+{
+        sigset_t set;
+        signalSet (&set);
+        pthread_sigmask (SIG_BLOCK, &set, nullptr);
+}
+
+/*****************************************************************************/
+
+bool EventLoop::addSignals (Handler const &handler)
+{
+        sigset_t set;
+        signalSet (&set);
+        int fd = signalfd (-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+
+        if (fd < 0) {
+                std::cerr << "EventLoop::addSignals : signalfd failed : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        return add (fd, SIGNAL, true, EPOLLIN, handler) >= 0;
+}
+
+/*****************************************************************************/
+
+void EventLoop::dispatch (Source &s, uint32_t events)
+{
+        switch (s.type) {
+        case TIMER:
+        case NOTIFIER: {
+                uint64_t n = 0;
+
+                if (read (s.fd, &n, sizeof (n)) == sizeof (n)) {
+                        s.handler (uint32_t (n));
+                }
+
+                break;
+        }
+
+        case SIGNAL: {
+                struct signalfd_siginfo info;
+
+                while (read (s.fd, &info, sizeof (info)) == sizeof (info)) {
+                        s.handler (info.ssi_signo);
+                }
+
+                break;
+        }
+
+        default:
+                s.handler (events);
+                break;
+        }
+}
+
+/*****************************************************************************/
+
+void EventLoop::run ()
+{
+        runFor (-1);
+}
+
+/*****************************************************************************/
+
+bool EventLoop::runFor (int timeoutMs)
+{
+        uint64_t deadline = (timeoutMs < 0) ? 0 : monotonicUs () + uint64_t (timeoutMs) * 1000;
+        struct epoll_event events[MAX_EVENTS];
+        running = true;
+
+        while (running) {
+                int wait = -1;
+
+                if (deadline) {
+                        uint64_t now = monotonicUs ();
+
+                        if (now >= deadline) {
+                                return false;
+                        }
+
+                        wait = int ((deadline - now + 999) / 1000);
+                }
+
+                int n = epoll_wait (epfd, events, MAX_EVENTS, wait);
+
+                if (n < 0 && errno != EINTR) {
+                        std::cerr << "EventLoop::run : epoll_wait failed : " << strerror (errno) << std::endl;
+                        return false;
+                }
+
+                for (int i = 0; i < n && running; ++i) {
+                        dispatch (*static_cast <Source *> (events[i].data.ptr), events[i].events);
+                }
+        }
+
+        return true;
+}
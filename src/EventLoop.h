@@ -0,0 +1,127 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef EVENTLOOP_H_
+#define EVENTLOOP_H_
+
+#include <stdint.h>
+#include <signal.h>
+#include <functional>
+
+/**
+ * eventfd wrapper. notify () may be called from any thread (MMAL callbacks included)
+ * and wakes the EventLoop which watches it.
+ */
+class Notifier {
+public:
+
+        Notifier ();
+        ~Notifier ();
+
+        void notify ();
+        int fd () const { return efd; }
+
+private:
+
+        Notifier (Notifier const &) = delete;
+        Notifier &operator= (Notifier const &) = delete;
+
+private:
+
+        int efd;
+};
+
+/**
+ * Single threaded epoll loop the main thread runs. Sources are plain fds, timerfds,
+ * signalfd and Notifiers. Timer, signal and notifier fds are drained by the loop itself,
+ * handlers get the number of expirations, the signal number or the epoll events
+ * respectively. All the sources are registered at startup, dispatching does not allocate.
+ */
+class EventLoop {
+public:
+
+        typedef std::function <void (uint32_t)> Handler;
+
+        EventLoop ();
+        ~EventLoop ();
+
+        /**
+         * @return id of the source for rewatch (), -1 on failure. fd may be -1 : the source
+         * stays dormant until rewatch () gives it a descriptor.
+         */
+        int watch (int fd, uint32_t events, Handler const &handler);
+        int watch (Notifier const &notifier, Handler const &handler);
+
+        /**
+         * Moves a source to a new descriptor (e.g. a reopened device), keeping its handler.
+         * The old descriptor must still be open : call rewatch (id, -1) before closing it,
+         * its number may be reused by the time of the next call. fd == -1 makes the source
+         * dormant.
+         */
+        bool rewatch (int id, int fd);
+
+        /**
+         * @param intervalMs period of the timer or, if !periodic, delay of a one-shot. 0 adds
+         * a disarmed timer, for setTimer ().
+         * @return id of the source for setTimer (), -1 on failure.
+         */
+        int addTimer (unsigned int intervalMs, bool periodic, Handler const &handler);
+
+        /// Re-arms (or with intervalMs == 0 disarms) a timer from addTimer ().
+        bool setTimer (int id, unsigned int intervalMs, bool periodic);
+
+        /**
+         * Delivers the signals from blockSignals () through a signalfd.
+         */
+        bool addSignals (Handler const &handler);
+
+        /**
+         * Blocks SIGINT and SIGTERM in the calling thread and every thread it creates later.
+         * Call first thing in main, before any thread (ours or MMAL's) exists.
+         */
+        static void blockSignals ();
+
+        /// Dispatches events until stop ().
+        void run ();
+
+        /// Dispatches events until stop () or until timeoutMs elapses. Returns false on timeout.
+        bool runFor (int timeoutMs);
+
+        /// Makes run () return after the current handler. Only from the loop thread.
+        void stop () { running = false; }
+
+private:
+
+        EventLoop (EventLoop const &) = delete;
+        EventLoop &operator= (EventLoop const &) = delete;
+
+        enum Type { FD, TIMER, NOTIFIER, SIGNAL };
+
+        struct Source {
+                int fd = -1;
+                Type type = FD;
+                bool owned = false;
+                uint32_t events = 0;
+                Handler handler;
+        };
+
+        int add (int fd, Type type, bool owned, uint32_t events, Handler const &handler);
+        void dispatch (Source &s, uint32_t events);
+
+private:
+
+        static const int MAX_SOURCES = 16;
+        static const int MAX_EVENTS = 8;
+
+        int epfd;
+        bool running = false;
+        int sourcesNum = 0;
+        Source sources[MAX_SOURCES];
+};
+
+#endif /* EVENTLOOP_H_ */
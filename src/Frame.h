@@ -0,0 +1,44 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <stdint.h>
+#include <ostream>
+
+/**
+ * Data frame from AVR shield.
+ */
+struct Frame {
+        uint64_t timestamp = 0; // Reception time, monotonicUs ().
+        uint64_t sampleTime = 0; // When the AVR took the sample, same clock. Reception time for v1.
+        uint8_t version = 1; // Protocol.
+        uint8_t sequence = 0; // v2 only.
+        uint16_t tick = 0; // v2 only, AVR timer at the sample.
+        float velocity = 0;
+        float rpm = 0;
+        float engineTemp = 0;
+        float airTemp = 0;
+        // Derived on the Pi, see DerivedMetrics.
+        float acceleration = 0; // m/s^2
+        float jerk = 0; // m/s^3
+        float distance = 0; // m since the start.
+        float braking = 0; // g, while a brake is on.
+        uint8_t gear = 0; // Estimated, see GearEstimator. 0 : none or unknown.
+        float motion = 0; // Scene motion of the latest encoded frame (-mv), see MotionAnalyzer. Logged as M records.
+        bool frontBrake = false;
+        bool rearBrake = false;
+        bool leftTurn = false;
+        bool rightTurn = false;
+        bool parkingLight = false;
+};
+
+extern std::ostream &operator<< (std::ostream &o, Frame const &f);
+
+#endif /* FRAME_H_ */
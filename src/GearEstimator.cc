@@ -0,0 +1,153 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <math.h>
+#include "GearEstimator.h"
+
+constexpr float GearEstimator::MIN_VELOCITY;
+constexpr float GearEstimator::MIN_RPM;
+constexpr double GearEstimator::TOLERANCE;
+
+void GearEstimator::update (Frame &f)
+{
+        uint64_t dt = (lastTime && f.sampleTime > lastTime && f.sampleTime - lastTime < MAX_GAP_US) ? f.sampleTime - lastTime : 0;
+        lastTime = f.sampleTime;
+
+        if (f.velocity < MIN_VELOCITY || f.rpm < MIN_RPM) {
+                steadySince = 0;
+                engaged = -1;
+                f.gear = 0;
+                return;
+        }
+
+        double x = log (f.rpm / f.velocity);
+
+        if (!steadySince || !dt || fabs (x - steadyRatio) > TOLERANCE) {
+                steadyRatio = x;
+                steadySince = f.sampleTime;
+        }
+        else {
+                steadyRatio += (x - steadyRatio) / 8;
+        }
+
+        int c = match (x);
+
+        if (f.sampleTime - steadySince >= HOLD_US) {
+                if (c < 0 && used < MAX_GEARS) {
+                        c = used++;
+                        clusters[c] = Cluster ();
+                        clusters[c].center = x;
+                }
+                else if (c < 0) {
+                        // All taken : recycle the least used cluster which never got confirmed.
+                        for (unsigned int i = 0; i < used; ++i) {
+                                if (clusters[i].steadyUs < CONFIRM_US && (c < 0 || clusters[i].steadyUs < clusters[c].steadyUs)) {
+                                        c = i;
+                                }
+                        }
+
+                        if (c >= 0) {
+                                clusters[c] = Cluster ();
+                                clusters[c].center = x;
+                        }
+                }
+
+                if (c >= 0) {
+                        clusters[c].center += (x - clusters[c].center) / (1 << LEARN_SHIFT);
+                        clusters[c].steadyUs += dt;
+                        c = merge (c);
+                }
+
+                engaged = c;
+        }
+        else if (c != engaged) {
+                // Not steady (yet) and away from the gear we were in.
+                engaged = -1;
+        }
+
+        f.gear = (engaged >= 0) ? gearOf (engaged) : 0;
+}
+
+/*****************************************************************************/
+
+int GearEstimator::merge (int c)
+{
+        for (unsigned int i = 0; i < used; ++i) {
+                Cluster &o = clusters[i];
+
+                if (int (i) == c || fabs (o.center - clusters[c].center) > TOLERANCE / 2) {
+                        continue;
+                }
+
+                // Two clusters drifted onto the same gear : one of them goes.
+                Cluster &k = clusters[c];
+                double total = double (k.steadyUs) + o.steadyUs;
+                k.center = (total > 0) ? (k.center * k.steadyUs + o.center * o.steadyUs) / total : k.center;
+                k.steadyUs += o.steadyUs;
+                clusters[i] = clusters[--used];
+
+                if (c == int (used)) {
+                        c = i;
+                }
+
+                break;
+        }
+
+        return c;
+}
+
+/*****************************************************************************/
+
+int GearEstimator::match (double x) const
+{
+        int best = -1;
+
+        for (unsigned int i = 0; i < used; ++i) {
+                double d = fabs (x - clusters[i].center);
+
+                if (d <= TOLERANCE && (best < 0 || d < fabs (x - clusters[best].center))) {
+                        best = i;
+                }
+        }
+
+        return best;
+}
+
+/*****************************************************************************/
+
+unsigned int GearEstimator::gearOf (int cluster) const
+{
+        Cluster const &c = clusters[cluster];
+
+        if (c.steadyUs < CONFIRM_US) {
+                return 0;
+        }
+
+        unsigned int gear = 1;
+
+        for (unsigned int i = 0; i < used; ++i) {
+                if (clusters[i].steadyUs >= CONFIRM_US && clusters[i].center > c.center) {
+                        ++gear;
+                }
+        }
+
+        return gear;
+}
+
+/*****************************************************************************/
+
+void GearEstimator::print (FILE *f) const
+{
+        for (unsigned int g = 1; g <= MAX_GEARS; ++g) {
+                for (unsigned int i = 0; i < used; ++i) {
+                        if (gearOf (i) == g) {
+                                fprintf (f, "gear %u : %.1f rpm per km/h, %.1f s steady\n", g, exp (clusters[i].center), clusters[i].steadyUs / 1e6);
+                        }
+                }
+        }
+}
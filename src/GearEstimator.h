@@ -0,0 +1,71 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef GEARESTIMATOR_H_
+#define GEARESTIMATOR_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "Frame.h"
+
+/**
+ * Tells the engaged gear from the rpm / velocity ratio, which is constant for a gear, with
+ * no setup : the ratios are clustered online. Works on log (rpm / velocity), so TOLERANCE is
+ * relative and the same for every gear.
+ *
+ * A ratio counts once it held steady (within TOLERANCE) for HOLD_US : shifting, clutch-in,
+ * neutral and wheelspin make it wander and give gear 0, and so do standstill and idle. A
+ * steady ratio matching no cluster starts a new one (the least used unconfirmed one is
+ * recycled when all MAX_GEARS are taken), a matching one pulls its cluster towards it.
+ * Clusters seen steady for CONFIRM_US get gear numbers : highest ratio is 1st. Until every
+ * gear was used in the ride, numbers may be off by the gears not seen yet.
+ *
+ * Runs in the event loop thread, see DerivedMetrics.
+ */
+class GearEstimator {
+public:
+
+        static const unsigned int MAX_GEARS = 6;
+
+        /// Sets f.gear.
+        void update (Frame &f);
+
+        void print (FILE *f) const;
+
+private:
+
+        struct Cluster {
+                double center = 0; // log (rpm / velocity)
+                uint64_t steadyUs = 0;
+        };
+
+        int match (double x) const;
+
+        /// Merges clusters too close to c into it. Returns the index of c afterwards.
+        int merge (int c);
+        unsigned int gearOf (int cluster) const;
+
+private:
+
+        static constexpr float MIN_VELOCITY = 5; // km/h
+        static constexpr float MIN_RPM = 1000;
+        static constexpr double TOLERANCE = 0.04;
+        static const uint64_t HOLD_US = 300000;
+        static const uint64_t CONFIRM_US = 3000000;
+        static const uint64_t MAX_GAP_US = 1000000;
+        static const unsigned int LEARN_SHIFT = 6; // Center moves by 1/64 of the error.
+
+        Cluster clusters[MAX_GEARS];
+        unsigned int used = 0;
+        int engaged = -1;
+        double steadyRatio = 0;
+        uint64_t steadySince = 0;
+        uint64_t lastTime = 0;
+};
+
+#endif /* GEARESTIMATOR_H_ */
@@ -0,0 +1,20 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef INDICES_H_
+#define INDICES_H_
+
+/**
+ * 0, 1, ... N-1 as a template parameter pack (std::index_sequence is C++14). Used to fill
+ * constexpr tables : { f (I)... }.
+ */
+template <unsigned int... I> struct Indices {};
+template <unsigned int N, unsigned int... I> struct MakeIndices : MakeIndices <N - 1, N - 1, I...> {};
+template <unsigned int... I> struct MakeIndices <0, I...> { typedef Indices <I...> Type; };
+
+#endif /* INDICES_H_ */
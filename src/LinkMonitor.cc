@@ -0,0 +1,188 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include <algorithm>
+#include "LinkMonitor.h"
+#include "EventLoop.h"
+#include "TelemetryLog.h"
+#include "Clock.h"
+
+/// Tried in this order, starting from the one the port was opened with.
+static const unsigned int RATES[] = { 38400, 57600, 115200, 230400, 460800, 500000, 921600, 1000000, 19200, 9600 };
+static const unsigned int RATES_NUM = sizeof (RATES) / sizeof (RATES[0]);
+
+LinkMonitor::LinkMonitor (Shield &shield, EventLoop &loop, TelemetryLog &log, unsigned int timeoutMs, Sink const &sink) :
+        shield (shield),
+        loop (loop),
+        log (log),
+        sink (sink),
+        timeoutUs (uint64_t (timeoutMs) * 1000)
+{
+        source = loop.watch (shield.fd (), EPOLLIN, [this] (uint32_t) { onReadable (); });
+        shield.onClose ([this] { this->loop.rewatch (source, -1); });
+
+        if (!timeoutMs) {
+                state = UP;
+                return;
+        }
+
+        for (unsigned int i = 0; i < RATES_NUM; ++i) {
+                if (RATES[i] == shield.getBaud ()) {
+                        rate = i;
+                }
+        }
+
+        since = probeSince = monotonicUs ();
+        confirmErrors = shield.getStats ().checksumErrors;
+
+        // A few checks per timeout, so a dead link is noticed at most timeoutMs / 4 late.
+        loop.addTimer (std::max (timeoutMs / 4, 10U), true, [this] (uint32_t) { check (); });
+}
+
+/*****************************************************************************/
+
+void LinkMonitor::onReadable ()
+{
+        Frame frame;
+
+        while (shield.read (frame)) {
+                if (state == UP) {
+                        bool first = !lastFrame;
+                        lastFrame = frame.timestamp;
+                        sink (frame);
+
+                        // Unsupervised, the link is up from the start, but the protocol version is
+                        // only known from the first frame on : that is when the handler runs.
+                        if (first && !timeoutUs && upHandler) {
+                                upHandler ();
+                        }
+
+                        continue;
+                }
+
+                uint64_t errors = shield.getStats ().checksumErrors;
+
+                if (errors != confirmErrors) {
+                        confirmErrors = errors;
+                        confirmed = 0;
+                }
+
+                if (++confirmed >= CONFIRM_FRAMES) {
+                        up (frame.timestamp);
+                        sink (frame);
+                }
+        }
+}
+
+/*****************************************************************************/
+
+void LinkMonitor::check ()
+{
+        uint64_t now = monotonicUs ();
+
+        if (state == UP) {
+                if (!shield.isOpen ()) {
+                        down ("closed", now);
+                }
+                else if (now - lastFrame >= timeoutUs) {
+                        down ("timeout", now);
+                }
+        }
+        else if (!shield.isOpen () || now - probeSince >= timeoutUs) {
+                probe (now);
+        }
+}
+
+/*****************************************************************************/
+
+void LinkMonitor::up (uint64_t now)
+{
+        log.event ("LINK up baud=%u v%d down=%" PRIu64 "ms probes=%u", shield.getBaud (), shield.getVersion (), (now - since) / 1000, probes);
+        state = UP;
+        since = lastFrame = now;
+        probes = 0;
+        atUp = shield.getStats ();
+
+        if (upHandler) {
+                upHandler ();
+        }
+}
+
+/*****************************************************************************/
+
+void LinkMonitor::down (const char *reason, uint64_t now)
+{
+        LinkStats const &s = shield.getStats ();
+        uint64_t duration = now - since;
+        uint64_t frames = s.frames - atUp.frames;
+
+        log.event ("LINK down %s baud=%u up=%" PRIu64 "ms fps=%.1f crc=%" PRIu64 " discarded=%" PRIu64 " lost=%" PRIu64,
+                   reason,
+                   shield.getBaud (),
+                   duration / 1000,
+                   (duration) ? frames * 1e6 / duration : 0.0,
+                   s.checksumErrors - atUp.checksumErrors,
+                   s.discardedBytes - atUp.discardedBytes,
+                   s.lostFrames - atUp.lostFrames);
+
+        state = DOWN;
+        since = now;
+        probe (now);
+}
+
+/*****************************************************************************/
+
+void LinkMonitor::probe (uint64_t now)
+{
+        // First the same rate (the AVR may have just reset), then the others. A rate counts
+        // as tried only if the port was open for it.
+        if (!shield.isOpen () || probes++ == 0) {
+                if (shield.reopen ()) {
+                        loop.rewatch (source, shield.fd ());
+                }
+        }
+        else {
+                rate = (rate + 1) % RATES_NUM;
+                shield.setBaud (RATES[rate]);
+        }
+
+        probeSince = now;
+        confirmed = 0;
+        confirmErrors = shield.getStats ().checksumErrors;
+}
+
+/*****************************************************************************/
+
+void LinkMonitor::report ()
+{
+        log.event ("LINK %s baud=%u v%d", (state == UP) ? "up" : "down", shield.getBaud (), shield.getVersion ());
+}
+
+/*****************************************************************************/
+
+void LinkMonitor::print (FILE *f) const
+{
+        LinkStats const &s = shield.getStats ();
+        fprintf (f, "shield link : %s, baud %u, protocol v%d, %" PRIu64 " bytes, %" PRIu64 " frames, %" PRIu64 " checksum errors, %" PRIu64 " bytes discarded, %" PRIu64 " frames lost\n",
+                 (state == UP) ? "up" : "down",
+                 shield.getBaud (),
+                 shield.getVersion (),
+                 s.bytes,
+                 s.frames,
+                 s.checksumErrors,
+                 s.discardedBytes,
+                 s.lostFrames);
+
+        LatencyStats const &r = shield.getResyncBytes ();
+
+        if (r.count ()) {
+                fprintf (f, "shield resync : %u times, bytes skipped p50 %u, p99 %u, max %u\n", unsigned (r.count ()), r.percentile (0.5), r.percentile (0.99), r.max ());
+        }
+}
@@ -0,0 +1,88 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef LINKMONITOR_H_
+#define LINKMONITOR_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <functional>
+#include "Shield.h"
+
+class EventLoop;
+class TelemetryLog;
+
+/**
+ * Reads the shield in the event loop and supervises the serial link. The link is UP while
+ * valid frames keep coming; after timeoutMs without one (or when the port closes itself
+ * after an error) it goes DOWN and the port is reopened at once. If that does not bring
+ * frames back within another timeoutMs, the standard baud rates are tried in turn, each
+ * for timeoutMs, until one of them gives CONFIRM_FRAMES valid frames in a row. While the
+ * port itself cannot be opened (adapter unplugged) it is retried at the same rate : there
+ * is nothing to search before it opens.
+ *
+ * Frames are passed on to the sink only while the link is UP, so whatever arrives at a
+ * wrong baud rate and happens to pass the checksum never reaches the log. Transitions
+ * are logged as LINK events together with the frame rate, checksum failures and bytes
+ * discarded during resync of the period that ended.
+ */
+class LinkMonitor {
+public:
+
+        typedef std::function <void (Frame const &)> Sink;
+
+        /// timeoutMs == 0 disables the supervision : every frame goes to the sink.
+        LinkMonitor (Shield &shield, EventLoop &loop, TelemetryLog &log, unsigned int timeoutMs, Sink const &sink);
+        ~LinkMonitor () { shield.onClose (nullptr); }
+
+        bool isUp () const { return state == UP; }
+
+        /**
+         * Called each time the link comes up, e.g. to configure a (possibly reset) AVR.
+         * Without supervision : once, on the first frame.
+         */
+        void onUp (std::function <void ()> const &handler) { upHandler = handler; }
+
+        /// Logs the current state. For the log opened after the link came up.
+        void report ();
+        void print (FILE *f) const;
+
+        static const unsigned int CONFIRM_FRAMES = 3;
+
+private:
+
+        void onReadable ();
+        void check ();
+        void up (uint64_t now);
+        void down (const char *reason, uint64_t now);
+        void probe (uint64_t now);
+
+private:
+
+        enum State { UP, DOWN };
+
+        Shield &shield;
+        EventLoop &loop;
+        TelemetryLog &log;
+        Sink sink;
+        std::function <void ()> upHandler;
+        int source = -1;
+        uint64_t timeoutUs;
+
+        State state = DOWN;
+        uint64_t lastFrame = 0;
+        uint64_t since = 0;           // Of the current state.
+        uint64_t probeSince = 0;
+        unsigned int probes = 0;
+        unsigned int confirmed = 0;
+        uint64_t confirmErrors = 0;   // Checksum errors when the confirmation started.
+        unsigned int rate = 0;        // Index into the baud rate table.
+        LinkStats atUp;               // Counters when the link came up.
+};
+
+#endif /* LINKMONITOR_H_ */
@@ -0,0 +1,99 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <iostream>
+#include "LiveStream.h"
+#include "Clock.h"
+
+bool LiveStream::start (std::string const &rideDir, const char *shmName)
+{
+        dir = rideDir + "/live";
+
+        if (mkdir (dir.c_str (), 0755) < 0 && errno != EEXIST) {
+                std::cerr << "LiveStream::start : unable to create " << dir << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        if (shmName && !shared.open (shmName, SHARED_CAPACITY)) {
+                return false;
+        }
+
+        started = true;
+        return true;
+}
+
+/*****************************************************************************/
+
+void LiveStream::stop ()
+{
+        closeSegment ();
+        shared.close ();
+        started = false;
+}
+
+/*****************************************************************************/
+
+void LiveStream::openSegment ()
+{
+        closeSegment ();
+
+        // Called from the encoder callback, so no std::string here.
+        char path[PATH_MAX];
+        snprintf (path, sizeof (path), "%s/%05u.h264", dir.c_str (), nextSegment++);
+
+        if (!(segmentOpen = writer->open (path))) {
+                ++failures;
+                return;
+        }
+
+        segmentStart = monotonicUs ();
+}
+
+/*****************************************************************************/
+
+void LiveStream::closeSegment ()
+{
+        if (segmentOpen) {
+                writer->close ();
+                segmentOpen = false;
+        }
+}
+
+/*****************************************************************************/
+
+void LiveStream::write (uint8_t const *data, size_t length, bool config)
+{
+        if (!started || !length) {
+                return;
+        }
+
+        if (config && (!segmentOpen || monotonicUs () - segmentStart >= SEGMENT_US)) {
+                openSegment ();
+        }
+
+        // A writer which drops can start again at the stream headers.
+        if (segmentOpen && !writer->write (data, length, config)) {
+                ++failures;
+                closeSegment ();
+        }
+
+        shared.write (data, length, config);
+        bytes += length;
+}
+
+/*****************************************************************************/
+
+void LiveStream::print (FILE *f) const
+{
+        fprintf (f, "live : %u segments, %llu bytes, %u failed writes, %llu bytes dropped\n", nextSegment, (unsigned long long)bytes, failures,
+                 (unsigned long long)writer->getDropped ());
+}
@@ -0,0 +1,71 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef LIVESTREAM_H_
+#define LIVESTREAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include "SegmentWriter.h"
+#include "SharedStream.h"
+
+/**
+ * The second, low resolution and low bitrate H.264 stream (-live) : quick review and live
+ * view without the full resolution archive.
+ *
+ * Segments of their own, in <ride>/live/00000.h264 and on, cut every SEGMENT_US at the
+ * stream headers the encoder repeats in front of every key frame, so each of them plays
+ * on its own. Nothing goes to the manifest : the archive is what counts, this is a
+ * convenience copy. Also published in shared memory (SharedStream), if given a name.
+ *
+ * A failing write closes the segment (and is counted), the next key frame tries a new
+ * one : the archive is never stopped because of this stream. Live encoder callback thread
+ * only, apart from start () and stop (), so give it a writer with a thread of its own
+ * ("direct") : a synchronous one would stall that callback whenever the card is busy.
+ */
+class LiveStream {
+public:
+
+        LiveStream (SegmentWriter *writer) : writer (writer) {}
+        ~LiveStream () { stop (); }
+
+        /// shmName NULL : no shared memory.
+        bool start (std::string const &rideDir, const char *shmName);
+        void stop ();
+
+        /// Encoder output. config : SPS / PPS, a key frame follows.
+        void write (uint8_t const *data, size_t length, bool config);
+
+        void print (FILE *f) const;
+
+        static const uint64_t SEGMENT_US = 60000000;
+        static const size_t SHARED_CAPACITY = 4 << 20;
+
+private:
+
+        LiveStream (LiveStream const &) = delete;
+        LiveStream &operator= (LiveStream const &) = delete;
+
+        void openSegment ();
+        void closeSegment ();
+
+private:
+
+        SegmentWriter *writer;
+        SharedStream shared;
+        std::string dir;
+        bool started = false;
+        bool segmentOpen = false;
+        unsigned int nextSegment = 0;
+        uint64_t segmentStart = 0;
+        uint64_t bytes = 0;
+        unsigned int failures = 0;
+};
+
+#endif /* LIVESTREAM_H_ */
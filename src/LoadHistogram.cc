@@ -0,0 +1,297 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <iostream>
+#include "LoadHistogram.h"
+
+namespace {
+
+/// printf into a stack buffer, write (2) when it fills up.
+class Output {
+public:
+
+        Output (int fd) : fd (fd) {}
+
+        void print (const char *format, ...) __attribute__ ((format (printf, 2, 3)))
+        {
+                if (sizeof (buffer) - used < LINE) {
+                        flush ();
+                }
+
+                va_list args;
+                va_start (args, format);
+                int n = vsnprintf (buffer + used, sizeof (buffer) - used, format, args);
+                va_end (args);
+
+                if (n > 0) {
+                        used += std::min (size_t (n), sizeof (buffer) - used - 1);
+                }
+        }
+
+        bool flush ()
+        {
+                size_t done = 0;
+
+                while (ok && done < used) {
+                        ssize_t n = ::write (fd, buffer + done, used - done);
+
+                        if (n <= 0) {
+                                ok = false;
+                        }
+                        else {
+                                done += n;
+                        }
+                }
+
+                used = 0;
+                return ok;
+        }
+
+private:
+
+        static const size_t LINE = 256;
+
+        int fd;
+        bool ok = true;
+        size_t used = 0;
+        char buffer[4096];
+};
+
+} // namespace
+
+/*****************************************************************************/
+
+LoadHistogram::LoadHistogram ()
+{
+        thread = std::thread (&LoadHistogram::run, this);
+}
+
+/*****************************************************************************/
+
+LoadHistogram::~LoadHistogram ()
+{
+        {
+                std::lock_guard <std::mutex> lock (mutex);
+                running = false;
+        }
+
+        wakeup.notify_one ();
+        thread.join ();
+}
+
+/*****************************************************************************/
+
+bool LoadHistogram::setPath (std::string const &p)
+{
+        if (p.size () + 5 > sizeof (path)) {
+                return false;
+        }
+
+        strcpy (path, p.c_str ());
+        strcpy (temporary, p.c_str ());
+        strcat (temporary, ".tmp");
+        strcpy (directory, p.c_str ());
+        char *slash = strrchr (directory, '/');
+
+        if (!slash) {
+                strcpy (directory, ".");
+        }
+        else if (slash == directory) {
+                directory[1] = '\0'; // In the root directory.
+        }
+        else {
+                *slash = '\0';
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+unsigned int LoadHistogram::band (double ratio)
+{
+        double b = log (ratio / RATIO_MIN) / log (RATIO_STEP);
+        return (b <= 0) ? 0 : std::min (unsigned (b), RATIO_BANDS - 1);
+}
+
+/*****************************************************************************/
+
+double LoadHistogram::bandStart (unsigned int b)
+{
+        return RATIO_MIN * pow (RATIO_STEP, b);
+}
+
+/*****************************************************************************/
+
+void LoadHistogram::add (Frame const &f)
+{
+        if (lastTime && f.sampleTime > lastTime && f.sampleTime - lastTime < MAX_GAP_US) {
+                uint64_t dt = f.sampleTime - lastTime;
+                unsigned int r = std::min (unsigned (std::max (f.rpm, 0.0f)) / RPM_STEP, RPM_BINS - 1);
+                unsigned int s = std::min (unsigned (std::max (f.velocity, 0.0f)) / SPEED_STEP, SPEED_BINS - 1);
+                counts.cellUs[r][s] += dt;
+
+                if (f.gear) {
+                        counts.bandUs[band (f.rpm / f.velocity)] += dt;
+                }
+                else {
+                        counts.neutralUs += dt;
+                }
+        }
+
+        lastTime = f.sampleTime;
+
+        // GearEstimator gives a gear only for a steady ratio, at a non zero velocity.
+        if (f.gear) {
+                double ratio = f.rpm / f.velocity;
+
+                if (lastRatio && (ratio > lastRatio * SHIFT_RATIO || ratio * SHIFT_RATIO < lastRatio)) {
+                        ++counts.shifts[band (lastRatio)][band (ratio)];
+                }
+
+                lastRatio = ratio;
+        }
+}
+
+/*****************************************************************************/
+
+void LoadHistogram::requestSave ()
+{
+        {
+                std::lock_guard <std::mutex> lock (mutex);
+                requested = counts;
+                pending = true;
+        }
+
+        wakeup.notify_one ();
+}
+
+/*****************************************************************************/
+
+bool LoadHistogram::save ()
+{
+        return write (counts);
+}
+
+/*****************************************************************************/
+
+void LoadHistogram::run ()
+{
+        // Created by a realtime thread, it would be one too. The card may take its time here.
+        struct sched_param param;
+        memset (&param, 0, sizeof (param));
+        pthread_setschedparam (pthread_self (), SCHED_OTHER, &param);
+
+        while (true) {
+                {
+                        std::unique_lock <std::mutex> lock (mutex);
+                        wakeup.wait (lock, [this] { return pending || !running; });
+
+                        if (!running) {
+                                return;
+                        }
+
+                        saving = requested;
+                        pending = false;
+                }
+
+                write (saving);
+        }
+}
+
+/*****************************************************************************/
+
+bool LoadHistogram::write (Counts const &c)
+{
+        std::lock_guard <std::mutex> lock (fileMutex);
+
+        if (!*path) {
+                return false;
+        }
+
+        int fd = ::open (temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0) {
+                std::cerr << "LoadHistogram::write : unable to open " << temporary << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        Output out (fd);
+
+        // Seconds per cell : one row per RPM_STEP, one column per SPEED_STEP. Last row and column are open ended.
+        out.print ("rpm\\kmh");
+
+        for (unsigned int s = 0; s < SPEED_BINS; ++s) {
+                out.print (",%u", s * SPEED_STEP);
+        }
+
+        out.print ("\n");
+
+        for (unsigned int r = 0; r < RPM_BINS; ++r) {
+                out.print ("%u", r * RPM_STEP);
+
+                for (unsigned int s = 0; s < SPEED_BINS; ++s) {
+                        out.print (",%.2f", c.cellUs[r][s] / 1e6);
+                }
+
+                out.print ("\n");
+        }
+
+        // Seconds per gear, by the start of its ratio band (rpm per km/h), bands with time
+        // only. "none" : neutral, clutch-in, standstill or unknown.
+        out.print ("\nratio,seconds\nnone,%.2f\n", c.neutralUs / 1e6);
+
+        for (unsigned int b = 0; b < RATIO_BANDS; ++b) {
+                if (c.bandUs[b]) {
+                        out.print ("%.1f,%.2f\n", bandStart (b), c.bandUs[b] / 1e6);
+                }
+        }
+
+        // Shifts between two ratio bands, the pairs which happened only.
+        out.print ("\nfrom,to,shifts\n");
+
+        for (unsigned int from = 0; from < RATIO_BANDS; ++from) {
+                for (unsigned int to = 0; to < RATIO_BANDS; ++to) {
+                        if (c.shifts[from][to]) {
+                                out.print ("%.1f,%.1f,%u\n", bandStart (from), bandStart (to), c.shifts[from][to]);
+                        }
+                }
+        }
+
+        bool ok = out.flush () && ::fsync (fd) == 0;
+        ::close (fd);
+
+        if (!ok || ::rename (temporary, path) < 0) {
+                std::cerr << "LoadHistogram::write : unable to write " << path << " : " << strerror (errno) << std::endl;
+                ::unlink (temporary);
+                return false;
+        }
+
+        // The rename itself is durable only once the directory is.
+        int dir = ::open (directory, O_RDONLY | O_DIRECTORY);
+
+        if (dir < 0 || ::fsync (dir) < 0) {
+                std::cerr << "LoadHistogram::write : unable to sync " << directory << " : " << strerror (errno) << std::endl;
+        }
+
+        if (dir >= 0) {
+                ::close (dir);
+        }
+
+        return true;
+}
@@ -0,0 +1,103 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef LOADHISTOGRAM_H_
+#define LOADHISTOGRAM_H_
+
+#include <stdint.h>
+#include <limits.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Frame.h"
+
+/**
+ * Time spent in each RPM x speed cell during a ride, plus time per gear and a count of
+ * the shifts between every two gears (neutral and clutch-in excluded). Kept as the samples
+ * come and saved into the ride directory every now and then, so summing a season up means
+ * reading one small file per ride instead of the raw logs.
+ *
+ * Gears are kept by their rpm / velocity ratio, in RATIO_STEP wide (relative) bands from
+ * RATIO_MIN, not by the gear numbers of GearEstimator : those change when it re-clusters,
+ * the ratio of a gear does not. A shift is a change of the engaged ratio by more than
+ * SHIFT_RATIO.
+ *
+ * Event loop thread : add () with the ingest, requestSave () from a timer. That only copies
+ * the counts : a thread of its own (SCHED_OTHER, whatever the creating thread runs at)
+ * writes a temporary file, syncs it and renames it, so a slow card never holds up the
+ * shield reads, and a power cut leaves the old or the new file, never a torn one. save ()
+ * does the same synchronously, for the end of the ride. The file is CSV, see write () for
+ * the sections.
+ */
+class LoadHistogram {
+public:
+
+        static const unsigned int RPM_STEP = 500;
+        static const unsigned int RPM_BINS = 32;
+        static const unsigned int SPEED_STEP = 10; // km/h
+        static const unsigned int SPEED_BINS = 25;
+        static constexpr double RATIO_MIN = 20; // rpm per km/h, top gear of a fast bike.
+        static constexpr double RATIO_STEP = 1.05;
+        static const unsigned int RATIO_BANDS = 56; // Up to ~300 rpm per km/h, the last one is open ended.
+        static constexpr double SHIFT_RATIO = 1.08; // Twice GearEstimator's tolerance.
+
+        LoadHistogram ();
+        ~LoadHistogram ();
+
+        /// Where the file goes. Call before the first save () or requestSave ().
+        bool setPath (std::string const &path);
+
+        void add (Frame const &f);
+
+        /// Hands a copy of the counts to the saver thread. A copy still waiting is replaced.
+        void requestSave ();
+
+        /// Writes the counts now, in the calling thread.
+        bool save ();
+
+private:
+
+        LoadHistogram (LoadHistogram const &) = delete;
+        LoadHistogram &operator= (LoadHistogram const &) = delete;
+
+        struct Counts {
+                uint64_t cellUs[RPM_BINS][SPEED_BINS] = {};
+                uint64_t neutralUs = 0; // No gear engaged (neutral, clutch-in, standstill, unknown).
+                uint64_t bandUs[RATIO_BANDS] = {};
+                uint32_t shifts[RATIO_BANDS][RATIO_BANDS] = {};
+        };
+
+        static const uint64_t MAX_GAP_US = 1000000;
+
+        static unsigned int band (double ratio);
+        static double bandStart (unsigned int b);
+
+        void run ();
+        bool write (Counts const &c);
+
+private:
+
+        Counts counts;            // Event loop thread.
+        uint64_t lastTime = 0;
+        double lastRatio = 0;     // Last engaged one.
+        char path[PATH_MAX] = "";
+        char temporary[PATH_MAX] = "";
+        char directory[PATH_MAX] = "";
+
+        Counts requested;         // Under mutex.
+        bool pending = false;     // Under mutex.
+        bool running = true;      // Under mutex.
+        Counts saving;            // Saver thread.
+        std::mutex mutex;
+        std::mutex fileMutex;     // One write () at a time : the saver thread and save ().
+        std::condition_variable wakeup;
+        std::thread thread;
+};
+
+#endif /* LOADHISTOGRAM_H_ */
@@ -0,0 +1,135 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "MotionAnalyzer.h"
+
+MotionAnalyzer::MotionAnalyzer (unsigned int width, unsigned int height)
+{
+        used = std::min ((width + 15) / 16, MAX_COLUMNS - 1);
+        columns = used + 1;
+        rows = (height + 15) / 16;
+
+        for (unsigned int i = 0; i < 4; ++i) {
+                bounds[i] = i * used / 3;
+        }
+}
+
+/*****************************************************************************/
+
+bool MotionAnalyzer::analyze (uint8_t const *data, size_t length, int64_t pts)
+{
+        if (length < size_t (columns) * rows * 4 || !rows) {
+                ++rejected;
+                return false;
+        }
+
+        uint32_t regionSum[Motion::REGIONS] = {};
+        uint32_t histogram[Motion::DIRECTIONS] = {};
+        uint64_t total = 0;
+        unsigned int moving = 0;
+
+        for (unsigned int r = 0; r < rows; ++r) {
+                int8_t const *mb = reinterpret_cast <int8_t const *> (data + size_t (r) * columns * 4);
+
+                // x, y, 16 bit SAD per macroblock : a stride 4 load, then plain reductions.
+                for (unsigned int c = 0; c < used; ++c) {
+                        int x = mb[c * 4];
+                        int y = mb[c * 4 + 1];
+                        squared[c] = x * x + y * y;
+                }
+
+                unsigned int region = (r * 3 / rows) * 3;
+
+                for (unsigned int g = 0; g < 3; ++g) {
+                        uint32_t sum = 0;
+
+                        for (unsigned int c = bounds[g]; c < bounds[g + 1]; ++c) {
+                                sum += squared[c];
+                        }
+
+                        regionSum[region + g] += sum;
+                        total += sum;
+                }
+
+                unsigned int rowMoving = 0;
+
+                for (unsigned int c = 0; c < used; ++c) {
+                        rowMoving += (squared[c] >= MOVING_SQUARED);
+                }
+
+                if (!rowMoving) {
+                        continue;
+                }
+
+                moving += rowMoving;
+
+                // Directions of the moving ones. y of the vectors grows downwards.
+                for (unsigned int c = 0; c < used; ++c) {
+                        if (squared[c] < MOVING_SQUARED) {
+                                continue;
+                        }
+
+                        int x = mb[c * 4];
+                        int y = -mb[c * 4 + 1];
+                        int ax = abs (x), ay = abs (y);
+                        unsigned int sector;
+
+                        // 5 / 12 is tan (22.5 degrees) within 1%.
+                        if (ay * 12 <= ax * 5) {
+                                sector = (x > 0) ? 0 : 4;
+                        }
+                        else if (ax * 12 <= ay * 5) {
+                                sector = (y > 0) ? 2 : 6;
+                        }
+                        else if (x > 0) {
+                                sector = (y > 0) ? 1 : 7;
+                        }
+                        else {
+                                sector = (y > 0) ? 3 : 5;
+                        }
+
+                        ++histogram[sector];
+                }
+        }
+
+        unsigned int blocks = used * rows;
+        result.pts = pts;
+        result.magnitude = sqrtf (float (total) / blocks);
+        result.moving = float (moving) / blocks;
+        result.direction = 0;
+
+        for (unsigned int d = 0; d < Motion::DIRECTIONS; ++d) {
+                result.histogram[d] = std::min (histogram[d], uint32_t (UINT16_MAX));
+
+                if (histogram[d] > histogram[result.direction]) {
+                        result.direction = d;
+                }
+        }
+
+        for (unsigned int g = 0; g < Motion::REGIONS; ++g) {
+                unsigned int regionRows = ((g / 3 + 1) * rows + 2) / 3 - ((g / 3) * rows + 2) / 3;
+                unsigned int regionBlocks = regionRows * (bounds[g % 3 + 1] - bounds[g % 3]);
+                result.regions[g] = (regionBlocks) ? sqrtf (float (regionSum[g]) / regionBlocks) : 0;
+        }
+
+        ++frames;
+        magnitudeSum += result.magnitude;
+        maxMagnitude = std::max (maxMagnitude, result.magnitude);
+        return true;
+}
+
+/*****************************************************************************/
+
+void MotionAnalyzer::print (FILE *f) const
+{
+        fprintf (f, "motion : %u frames, mean magnitude %.2f, max %.2f, %u vector buffers of a wrong size\n",
+                 frames, (frames) ? magnitudeSum / frames : 0.0, maxMagnitude, rejected);
+}
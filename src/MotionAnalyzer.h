@@ -0,0 +1,78 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef MOTIONANALYZER_H_
+#define MOTIONANALYZER_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Scene motion of one encoded frame, from the encoder motion vectors. Lengths are in the
+ * units of the vectors, RMS over the macroblocks they cover.
+ */
+struct Motion {
+
+        static const unsigned int DIRECTIONS = 8; // Of the vectors. 0 : right, then counter-clockwise every 45 degrees.
+        static const unsigned int REGIONS = 9;    // 3 x 3, row major from the top left.
+
+        int64_t pts = 0;
+        float magnitude = 0;
+        float moving = 0;           // Fraction of the macroblocks which moved.
+        uint8_t direction = 0;      // Most common one of the moving macroblocks.
+        uint16_t histogram[DIRECTIONS] = {};
+        float regions[REGIONS] = {};
+};
+
+/**
+ * Turns the inline motion vectors of the encoder (-mv) into a Motion per frame : a cheap
+ * motion signal computed by the GPU, to put next to the speed and to use in rules.
+ *
+ * The encoder sends the vectors in buffers of their own (MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO),
+ * one per frame : for every macroblock, row by row, signed 8 bit x and y and a 16 bit SAD,
+ * with one column more than the picture has. Intra frames have none, so they give 0.
+ *
+ * All the sums are integer and done in one pass over the buffer, in loops simple enough
+ * for the compiler to vectorize where the target has SIMD. No allocations past the
+ * constructor. Runs in the encoder callback thread.
+ */
+class MotionAnalyzer {
+public:
+
+        MotionAnalyzer (unsigned int width, unsigned int height);
+
+        /// False if the buffer doesn't have the size expected for the frame size.
+        bool analyze (uint8_t const *data, size_t length, int64_t pts);
+
+        Motion const &last () const { return result; }
+
+        void print (FILE *f) const;
+
+private:
+
+        /// Squared length from which a macroblock counts as moving.
+        static const unsigned int MOVING_SQUARED = 4;
+        static const unsigned int MAX_COLUMNS = 256;
+
+        unsigned int columns; // In the buffer, the extra one included.
+        unsigned int rows;
+        unsigned int used;    // Columns which are a part of the picture.
+        unsigned int bounds[4]; // Columns where the regions begin, and the end.
+
+        /// Squared lengths of the row being summed up.
+        uint16_t squared[MAX_COLUMNS];
+
+        Motion result;
+        unsigned int frames = 0;
+        unsigned int rejected = 0;
+        double magnitudeSum = 0;
+        float maxMagnitude = 0;
+};
+
+#endif /* MOTIONANALYZER_H_ */
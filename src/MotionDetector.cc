@@ -0,0 +1,210 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "MotionDetector.h"
+#include "Clock.h"
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+MotionDetector::MotionDetector (unsigned int frameWidth, unsigned int frameHeight, unsigned int stride, std::vector <Zone> const &zones)
+    : width (frameWidth), height (frameHeight), pitch ((width + 15) & ~15U), stride (stride)
+{
+        // Padding stays 0 in both the picture and the background, so it never changes.
+        current.assign (pitch * height, 0);
+        background.assign (pitch * height, 0);
+        changed.assign (pitch * height, 0);
+
+        for (Zone const &z : zones) {
+                Rect r;
+                r.x0 = std::min (z.x, 100U) * width / 100;
+                r.y0 = std::min (z.y, 100U) * height / 100;
+                r.x1 = std::min (z.x + z.width, 100U) * width / 100;
+                r.y1 = std::min (z.y + z.height, 100U) * height / 100;
+
+                if (r.x1 > r.x0 && r.y1 > r.y0) {
+                        rects.push_back (r);
+                }
+        }
+
+        if (rects.empty ()) {
+                rects.push_back ({ 0, 0, width, height });
+        }
+}
+
+/*****************************************************************************/
+
+bool MotionDetector::parseZones (const char *spec, std::vector <Zone> *zones)
+{
+        zones->clear ();
+
+        while (*spec) {
+                Zone z;
+                int n;
+
+                if (sscanf (spec, "%u,%u,%u,%u%n", &z.x, &z.y, &z.width, &z.height, &n) != 4 || !z.width || !z.height ||
+                    z.x + z.width > 100 || z.y + z.height > 100) {
+                        return false;
+                }
+
+                zones->push_back (z);
+                spec += n;
+
+                if (*spec == ';') {
+                        ++spec;
+                }
+                else if (*spec) {
+                        return false;
+                }
+        }
+
+        return !zones->empty ();
+}
+
+/*****************************************************************************/
+
+void MotionDetector::load (uint8_t const *luma)
+{
+        for (unsigned int y = 0; y < height; ++y) {
+                memcpy (&current[y * pitch], luma + y * stride, width);
+        }
+}
+
+/*****************************************************************************/
+
+void MotionDetector::difference (uint8_t const *current, uint16_t *background, uint8_t *changed, unsigned int n)
+{
+        unsigned int i = 0;
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+        uint8x16_t threshold = vdupq_n_u8 (DIFFERENCE);
+
+        for (; i + 16 <= n; i += 16) {
+                uint8x16_t c = vld1q_u8 (current + i);
+                uint16x8_t low = vld1q_u16 (background + i);
+                uint16x8_t high = vld1q_u16 (background + i + 8);
+                uint8x16_t b = vcombine_u8 (vshrn_n_u16 (low, 8), vshrn_n_u16 (high, 8));
+
+                vst1q_u8 (changed + i, vshrq_n_u8 (vcgtq_u8 (vabdq_u8 (c, b), threshold), 7));
+
+                low = vaddq_u16 (vsubq_u16 (low, vshrq_n_u16 (low, LEARN)), vshll_n_u8 (vget_low_u8 (c), 8 - LEARN));
+                high = vaddq_u16 (vsubq_u16 (high, vshrq_n_u16 (high, LEARN)), vshll_n_u8 (vget_high_u8 (c), 8 - LEARN));
+                vst1q_u16 (background + i, low);
+                vst1q_u16 (background + i + 8, high);
+        }
+#endif
+
+        // Same as above : the background settles at current << 8.
+        for (; i < n; ++i) {
+                unsigned int b = background[i];
+                changed[i] = abs (int (current[i]) - int (b >> 8)) > DIFFERENCE;
+                background[i] = b - (b >> LEARN) + (current[i] << (8 - LEARN));
+        }
+}
+
+/*****************************************************************************/
+
+bool MotionDetector::process (uint8_t const *luma, uint64_t now)
+{
+        if (lastFrame && now - lastFrame < INTERVAL_US) {
+                return false;
+        }
+
+        uint64_t start = monotonicUs ();
+
+        // First frame after a pause : the scene is not the one we learnt.
+        if (!lastFrame || now - lastFrame > RELEARN_US) {
+                learnt = 0;
+                confirmed = 0;
+        }
+
+        lastFrame = now;
+        ++frames;
+        load (luma);
+
+        if (!learnt) {
+                for (size_t i = 0; i < current.size (); ++i) {
+                        background[i] = current[i] << 8;
+                }
+        }
+
+        for (unsigned int y = 0; y < height; ++y) {
+                difference (&current[y * pitch], &background[y * pitch], &changed[y * pitch], pitch);
+        }
+
+        bool motion = false;
+
+        if (learnt < WARMUP) {
+                ++learnt;
+        }
+        else {
+                unsigned int total = 0;
+
+                for (uint8_t c : changed) {
+                        total += c;
+                }
+
+                bool any = false;
+
+                if (total > LIGHTING_FRACTION * width * height) {
+                        // Learnt slowly, the new light would look like motion in parts of the
+                        // picture for a while : the background starts again from the next frame.
+                        ++lightChanges;
+                        learnt = 0;
+                }
+                else {
+                        for (Rect const &r : rects) {
+                                unsigned int count = 0;
+
+                                for (unsigned int y = r.y0; y < r.y1; ++y) {
+                                        uint8_t const *row = &changed[y * pitch];
+
+                                        for (unsigned int x = r.x0; x < r.x1; ++x) {
+                                                count += row[x];
+                                        }
+                                }
+
+                                any = any || count > ZONE_FRACTION * (r.x1 - r.x0) * (r.y1 - r.y0);
+                        }
+                }
+
+                confirmed = (any) ? confirmed + 1 : 0;
+                motion = confirmed >= CONFIRM;
+        }
+
+        if (motion) {
+                if (!isActive (now)) {
+                        ++triggers;
+                }
+
+                lastMotion.store (now, std::memory_order_release);
+        }
+
+        costUs.add (monotonicUs () - start);
+        return motion;
+}
+
+/*****************************************************************************/
+
+bool MotionDetector::isActive (uint64_t now) const
+{
+        uint64_t last = lastMotion.load (std::memory_order_acquire);
+        return last && (now < last || now - last < POST_ROLL_US);
+}
+
+/*****************************************************************************/
+
+void MotionDetector::print (FILE *f) const
+{
+        fprintf (f, "surveillance : %u frames of %ux%u, %u motion events, %u lighting changes\n", frames, width, height, triggers, lightChanges);
+        costUs.print (f, "surveillance detector");
+}
@@ -0,0 +1,114 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef MOTIONDETECTOR_H_
+#define MOTIONDETECTOR_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <vector>
+#include "Stats.h"
+
+/**
+ * Something moving around the parked bike (-surveil) : frame differencing against a
+ * background model, on the Y plane of the camera preview port. MotionAnalyzer is the
+ * other motion, the one of the encoder vectors while riding.
+ *
+ * The preview port is small (the ISP scales it down, see main.cc), so its Y plane is used
+ * as it is : each pixel is compared with the background, kept in 8.8 fixed point and
+ * following the picture with a time constant of 2^LEARN frames. A pixel changed if it is
+ * more than DIFFERENCE luma levels away from the background. Motion is when the changed
+ * fraction of any zone is above ZONE_FRACTION in CONFIRM frames in a row, except when
+ * more than LIGHTING_FRACTION of the whole picture changed (clouds, street lights, the
+ * headlights of a car passing by) : then the background starts again from the picture,
+ * with WARMUP frames without detection.
+ *
+ * process () is rate limited to one frame per INTERVAL_US, and starts learning from
+ * scratch after a pause (the bike was moving). The per pixel kernel is NEON where the
+ * compiler targets it and plain C++ elsewhere, with the same results. What it costs goes
+ * into cost (). No allocations after the constructor.
+ *
+ * process () runs in the preview port callback, isActive () may be called from any thread.
+ */
+class MotionDetector {
+public:
+
+        /// Rectangle in percent of the frame.
+        struct Zone {
+                unsigned int x, y, width, height;
+        };
+
+        /**
+         * Frames of width x height (already scaled down), stride bytes per line of the Y
+         * plane. No zones : the whole picture is one.
+         */
+        MotionDetector (unsigned int width, unsigned int height, unsigned int stride, std::vector <Zone> const &zones);
+
+        /// "x,y,w,h;x,y,w,h..." in percent.
+        static bool parseZones (const char *spec, std::vector <Zone> *zones);
+
+        /**
+         * Y plane of a frame taken at monotonic time now.
+         * @return true when the frame confirmed motion.
+         */
+        bool process (uint8_t const *luma, uint64_t now);
+
+        /// Motion during the last POST_ROLL_US.
+        bool isActive (uint64_t now) const;
+
+        LatencyStats const &cost () const { return costUs; }
+        void print (FILE *f) const;
+
+        static const uint64_t INTERVAL_US = 250000;
+        static const uint64_t POST_ROLL_US = 10000000;
+
+private:
+
+        struct Rect {
+                unsigned int x0, y0, x1, y1; // Scaled pixels, [x0, x1) x [y0, y1).
+        };
+
+        /// Copies the Y plane, so lines are pitch apart and the padding stays 0.
+        void load (uint8_t const *luma);
+
+        /// Marks the changed pixels of n and moves the background towards them.
+        static void difference (uint8_t const *current, uint16_t *background, uint8_t *changed, unsigned int n);
+
+private:
+
+        static const unsigned int LEARN = 5;
+        static const uint8_t DIFFERENCE = 25;
+        static constexpr float ZONE_FRACTION = 0.02;
+        static constexpr float LIGHTING_FRACTION = 0.5;
+        static const unsigned int CONFIRM = 2;
+        static const unsigned int WARMUP = 4;
+        static const uint64_t RELEARN_US = 5000000;
+
+        unsigned int width;
+        unsigned int height;
+        unsigned int pitch;  // Multiple of 16.
+        unsigned int stride; // Of the Y plane.
+
+        std::vector <Rect> rects;
+        std::vector <uint8_t> current;
+        std::vector <uint16_t> background;
+        std::vector <uint8_t> changed;
+
+        uint64_t lastFrame = 0;
+        unsigned int learnt = 0;   // Frames since the background was reset, up to WARMUP.
+        unsigned int confirmed = 0;
+        std::atomic <uint64_t> lastMotion {0};
+
+        unsigned int frames = 0;
+        unsigned int triggers = 0;
+        unsigned int lightChanges = 0;
+        LatencyStats costUs;
+};
+
+#endif /* MOTIONDETECTOR_H_ */
@@ -0,0 +1,279 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "Overlay.h"
+#include "Clock.h"
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+/// 5x7, one byte per row, bit 4 is the leftmost pixel.
+struct Glyph {
+        char c;
+        uint8_t rows[7];
+};
+
+const Glyph FONT[] = {
+        { ' ', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+        { '0', { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e } },
+        { '1', { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e } },
+        { '2', { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f } },
+        { '3', { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e } },
+        { '4', { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 } },
+        { '5', { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e } },
+        { '6', { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e } },
+        { '7', { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 } },
+        { '8', { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e } },
+        { '9', { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c } },
+        { '-', { 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 } },
+        { '/', { 0x01, 0x01, 0x02, 0x04, 0x08, 0x10, 0x10 } },
+        { 'k', { 0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12 } },
+        { 'm', { 0x00, 0x00, 0x1a, 0x15, 0x15, 0x15, 0x15 } },
+        { 'h', { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11 } },
+        { 'r', { 0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10 } },
+        { 'p', { 0x00, 0x00, 0x1e, 0x11, 0x1e, 0x10, 0x10 } },
+        { 'A', { 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 } },
+        { 'B', { 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e } },
+        { 'E', { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f } },
+        { 'G', { 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f } },
+        { 'P', { 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 } },
+        { '<', { 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 } },
+        { '>', { 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 } },
+};
+
+const unsigned int GLYPHS = sizeof (FONT) / sizeof (FONT[0]);
+
+/// Index in FONT, space for the characters it doesn't have.
+unsigned int glyphOf (char c)
+{
+        for (unsigned int i = 0; i < GLYPHS; ++i) {
+                if (FONT[i].c == c) {
+                        return i;
+                }
+        }
+
+        return 0;
+}
+
+struct Yuv {
+        uint8_t y, u, v;
+};
+
+/// BT.601, video range.
+const Yuv BLACK = { 16, 128, 128 };
+const Yuv PALETTE[] = {
+        { 235, 128, 128 }, // WHITE
+        { 178, 35, 170 },  // AMBER
+        { 81, 90, 240 },   // RED
+};
+
+// Bit fields of the packed values.
+const unsigned int SPEED_SHIFT = 0;   // 10 bits, km/h
+const unsigned int RPM_SHIFT = 10;    // 17 bits
+const unsigned int ENGINE_SHIFT = 27; // 11 bits, degrees + TEMP_OFFSET
+const unsigned int AIR_SHIFT = 38;    // 11 bits, degrees + TEMP_OFFSET
+const unsigned int GEAR_SHIFT = 49;   // 3 bits
+const unsigned int LEFT_BIT = 52;
+const unsigned int RIGHT_BIT = 53;
+const unsigned int BRAKE_BIT = 54;
+const unsigned int PARKING_BIT = 55;
+const int TEMP_OFFSET = 99;
+
+uint64_t field (float value, int min, int max)
+{
+        return uint64_t (std::min (std::max (int (lrintf (value)), min), max) - min);
+}
+
+} // namespace
+
+/*****************************************************************************/
+
+Overlay::Overlay (unsigned int width, unsigned int height, unsigned int stride, unsigned int rows)
+    : scale (std::max (height / 240, 2U)), stride (stride), rows (rows), values (0)
+{
+        // Both cell sizes are even for any scale, so cells never split a chroma sample.
+        while (scale > 1 && COLUMNS * 6 * scale > width) {
+                --scale;
+        }
+
+        cellWidth = 6 * scale;
+        cellHeight = 10 * scale;
+        unsigned int margin = (2 * scale) & ~1U;
+        columns = std::min <unsigned int> (unsigned (COLUMNS), (width - std::min (width, 2 * margin)) / cellWidth);
+        stripWidth = columns * cellWidth;
+        left = margin;
+        top = (height - std::min (height, cellHeight + margin)) & ~1U;
+
+        // One column between the glyphs, one row above and two below.
+        atlas.assign (GLYPHS * cellWidth * cellHeight, 0);
+
+        for (unsigned int g = 0; g < GLYPHS; ++g) {
+                uint8_t *cell = &atlas[g * cellWidth * cellHeight];
+
+                for (unsigned int y = 0; y < 7 * scale; ++y) {
+                        for (unsigned int x = 0; x < 5 * scale; ++x) {
+                                cell[(y + scale) * cellWidth + x] = (FONT[g].rows[y / scale] >> (4 - x / scale)) & 1;
+                        }
+                }
+        }
+
+        keepY.assign (stripWidth * cellHeight, 255);
+        colourY.assign (stripWidth * cellHeight, 0);
+        keepC.assign (stripWidth * cellHeight / 4, 255);
+        colourU.assign (stripWidth * cellHeight / 4, 0);
+        colourV.assign (stripWidth * cellHeight / 4, 0);
+
+        // Nothing shown yet : the first apply () renders every cell.
+        memset (shown, 0, sizeof (shown));
+        memset (shownColours, 0, sizeof (shownColours));
+}
+
+/*****************************************************************************/
+
+uint64_t Overlay::pack (Frame const &f)
+{
+        return field (f.velocity, 0, 999) << SPEED_SHIFT
+                | field (f.rpm, 0, 99999) << RPM_SHIFT
+                | field (f.engineTemp, -TEMP_OFFSET, 999) << ENGINE_SHIFT
+                | field (f.airTemp, -TEMP_OFFSET, 999) << AIR_SHIFT
+                | uint64_t (std::min (f.gear, uint8_t (7))) << GEAR_SHIFT
+                | uint64_t (f.leftTurn) << LEFT_BIT
+                | uint64_t (f.rightTurn) << RIGHT_BIT
+                | uint64_t (f.frontBrake || f.rearBrake) << BRAKE_BIT
+                | uint64_t (f.parkingLight) << PARKING_BIT;
+}
+
+/*****************************************************************************/
+
+void Overlay::setFrame (Frame const &f) { values.store (pack (f), std::memory_order_relaxed); }
+
+/*****************************************************************************/
+
+void Overlay::compose (uint64_t v, char *text, uint8_t *colours) const
+{
+        unsigned int gear = (v >> GEAR_SHIFT) & 0x7;
+        char buffer[COLUMNS + 8]; // pack () clamped the fields, the margin is for the compiler.
+
+        snprintf (buffer, sizeof (buffer), "%3u km/h %5u rpm E%3d A%3d G%c %c%c %c %c",
+                  unsigned ((v >> SPEED_SHIFT) & 0x3ff),
+                  unsigned ((v >> RPM_SHIFT) & 0x1ffff),
+                  int ((v >> ENGINE_SHIFT) & 0x7ff) - TEMP_OFFSET,
+                  int ((v >> AIR_SHIFT) & 0x7ff) - TEMP_OFFSET,
+                  (gear) ? char ('0' + gear) : '-',
+                  ((v >> LEFT_BIT) & 1) ? '<' : ' ',
+                  ((v >> RIGHT_BIT) & 1) ? '>' : ' ',
+                  ((v >> BRAKE_BIT) & 1) ? 'B' : ' ',
+                  ((v >> PARKING_BIT) & 1) ? 'P' : ' ');
+
+        memcpy (text, buffer, COLUMNS);
+
+        for (unsigned int i = 0; i < COLUMNS; ++i) {
+                colours[i] = (text[i] == '<' || text[i] == '>') ? AMBER : (text[i] == 'B') ? RED : WHITE;
+        }
+}
+
+/*****************************************************************************/
+
+void Overlay::renderCell (unsigned int column, char c, Colour colour)
+{
+        uint8_t const *glyph = &atlas[glyphOf (c) * cellWidth * cellHeight];
+        Yuv const &ink = PALETTE[colour];
+        unsigned int x0 = column * cellWidth;
+
+        // Glyph pixels are opaque, the rest is the box.
+        for (unsigned int y = 0; y < cellHeight; y += 2) {
+                for (unsigned int x = 0; x < cellWidth; x += 2) {
+                        unsigned int alphas = 0, u = 0, v = 0;
+
+                        for (unsigned int dy = 0; dy < 2; ++dy) {
+                                for (unsigned int dx = 0; dx < 2; ++dx) {
+                                        bool on = glyph[(y + dy) * cellWidth + x + dx];
+                                        unsigned int a = (on) ? 255 : BOX_ALPHA;
+                                        Yuv const &p = (on) ? ink : BLACK;
+                                        size_t i = (y + dy) * stripWidth + x0 + x + dx;
+
+                                        keepY[i] = 255 - a;
+                                        colourY[i] = (p.y * a + 127) / 255;
+                                        alphas += a;
+                                        u += p.u * a;
+                                        v += p.v * a;
+                                }
+                        }
+
+                        size_t i = (y / 2) * (stripWidth / 2) + (x0 + x) / 2;
+                        keepC[i] = 255 - (alphas + 2) / 4;
+                        colourU[i] = (u + 510) / 1020;
+                        colourV[i] = (v + 510) / 1020;
+                }
+        }
+}
+
+/*****************************************************************************/
+
+void Overlay::blend (uint8_t *dst, uint8_t const *keep, uint8_t const *colour, unsigned int n)
+{
+        unsigned int i = 0;
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+        for (; i + 16 <= n; i += 16) {
+                uint8x16_t d = vld1q_u8 (dst + i);
+                uint8x16_t k = vld1q_u8 (keep + i);
+                uint8x8_t low = vrshrn_n_u16 (vmull_u8 (vget_low_u8 (d), vget_low_u8 (k)), 8);
+                uint8x8_t high = vrshrn_n_u16 (vmull_u8 (vget_high_u8 (d), vget_high_u8 (k)), 8);
+                vst1q_u8 (dst + i, vqaddq_u8 (vcombine_u8 (low, high), vld1q_u8 (colour + i)));
+        }
+#endif
+
+        // Same rounding and saturation as above.
+        for (; i < n; ++i) {
+                unsigned int out = ((dst[i] * keep[i] + 128) >> 8) + colour[i];
+                dst[i] = (out > 255) ? 255 : out;
+        }
+}
+
+/*****************************************************************************/
+
+void Overlay::apply (uint8_t *frame)
+{
+        uint64_t start = monotonicUs ();
+        char text[COLUMNS];
+        uint8_t colours[COLUMNS];
+
+        compose (values.load (std::memory_order_relaxed), text, colours);
+
+        for (unsigned int c = 0; c < columns; ++c) {
+                if (text[c] != shown[c] || colours[c] != shownColours[c]) {
+                        renderCell (c, text[c], Colour (colours[c]));
+                        shown[c] = text[c];
+                        shownColours[c] = colours[c];
+                }
+        }
+
+        for (unsigned int y = 0; y < cellHeight; ++y) {
+                size_t i = y * stripWidth;
+                blend (frame + (top + y) * stride + left, &keepY[i], &colourY[i], stripWidth);
+        }
+
+        uint8_t *u = frame + stride * rows;
+        uint8_t *v = u + (stride / 2) * (rows / 2);
+
+        for (unsigned int y = 0; y < cellHeight / 2; ++y) {
+                size_t offset = (top / 2 + y) * (stride / 2) + left / 2;
+                size_t i = y * (stripWidth / 2);
+                blend (u + offset, &keepC[i], &colourU[i], stripWidth / 2);
+                blend (v + offset, &keepC[i], &colourV[i], stripWidth / 2);
+        }
+
+        costUs.add (monotonicUs () - start);
+}
@@ -0,0 +1,104 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef OVERLAY_H_
+#define OVERLAY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "Frame.h"
+#include "Stats.h"
+
+/**
+ * Burns a line of telemetry into the bottom left corner of I420 frames :
+ *
+ *   " 87 km/h  6450 rpm E 92 A 21 G4 <  B P"
+ *
+ * speed, rpm, engine and air temperature, gear, indicators, brake and parking light, white
+ * on a semi-transparent black box, indicators amber and the brake red.
+ *
+ * The 5x7 font is scaled (S = height / 240, at least 2) into an atlas once. The line lives
+ * in a layer : per pixel how much of the frame is kept and the premultiplied colour added,
+ * for Y and for the 2x2 subsampled U and V. Only the cells whose character or colour
+ * changed are rendered into the layer again. The frame is new every time, so the layer is
+ * blended into it every time, but only the strip under it is touched :
+ *
+ *   out = ((in * keep + 128) >> 8) + colour
+ *
+ * with NEON where the compiler targets it (16 pixels at a time) and in plain C++ elsewhere
+ * (ARMv6 Pi 1). apply () takes a bare buffer, so it runs on synthetic frames on the host
+ * as well; the time it takes goes into cost ().
+ *
+ * setFrame () is called from the encoder callback thread, apply () from the camera video
+ * callback. The values pass through one atomic word. No allocations after the constructor.
+ */
+class Overlay {
+public:
+
+        /**
+         * Frames of width x height pixels, in I420 buffers with stride bytes per luma line
+         * and rows luma lines (U and V : half of both, right after).
+         */
+        Overlay (unsigned int width, unsigned int height, unsigned int stride, unsigned int rows);
+
+        /// Latest values to show. Any thread.
+        void setFrame (Frame const &f);
+
+        /// Blends the line into an I420 frame in place.
+        void apply (uint8_t *frame);
+
+        LatencyStats const &cost () const { return costUs; }
+
+        static const unsigned int COLUMNS = 38;
+
+private:
+
+        enum Colour : uint8_t { WHITE, AMBER, RED, COLOURS };
+
+        /// Packs / unpacks the values shown, so they fit one atomic.
+        static uint64_t pack (Frame const &f);
+        void compose (uint64_t values, char *text, uint8_t *colours) const;
+
+        void renderCell (unsigned int column, char c, Colour colour);
+
+        static void blend (uint8_t *dst, uint8_t const *keep, uint8_t const *colour, unsigned int n);
+
+private:
+
+        static const uint8_t BOX_ALPHA = 150;
+
+        unsigned int scale;
+        unsigned int cellWidth;
+        unsigned int cellHeight;
+        unsigned int columns; // Which fit the frame.
+        unsigned int left; // Of the strip, even.
+        unsigned int top;
+        unsigned int stripWidth;
+        unsigned int stride;
+        unsigned int rows;
+
+        /// 1 where a glyph covers the pixel, cellWidth x cellHeight per glyph.
+        std::vector <uint8_t> atlas;
+
+        // Layer, stripWidth x cellHeight for Y, a quarter of it for U and V.
+        std::vector <uint8_t> keepY;
+        std::vector <uint8_t> colourY;
+        std::vector <uint8_t> keepC;
+        std::vector <uint8_t> colourU;
+        std::vector <uint8_t> colourV;
+
+        char shown[COLUMNS];
+        uint8_t shownColours[COLUMNS];
+
+        std::atomic <uint64_t> values;
+        LatencyStats costUs;
+};
+
+#endif /* OVERLAY_H_ */
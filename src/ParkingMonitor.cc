@@ -0,0 +1,72 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <sys/resource.h>
+#include <inttypes.h>
+#include "ParkingMonitor.h"
+#include "TelemetryLog.h"
+#include "Clock.h"
+
+static uint64_t cpuTimeUs ()
+{
+        struct rusage ru;
+        getrusage (RUSAGE_SELF, &ru);
+        return uint64_t (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/*****************************************************************************/
+
+bool ParkingMonitor::update (Frame const &f)
+{
+        if (!parkDelayUs) {
+                return false;
+        }
+
+        if (f.velocity > 0 || f.rpm > 0) {
+                stillSince = 0;
+                return state.exchange (MOVING, std::memory_order_acq_rel) != MOVING;
+        }
+
+        if (!stillSince) {
+                stillSince = f.timestamp;
+        }
+        else if (f.timestamp - stillSince >= parkDelayUs) {
+                return state.exchange (PARKED, std::memory_order_acq_rel) != PARKED;
+        }
+
+        return false;
+}
+
+/*****************************************************************************/
+
+void ParkingMonitor::beginPhase (State s, uint64_t bytesWritten, unsigned int fullBitrate, TelemetryLog &log)
+{
+        uint64_t now = monotonicUs ();
+        uint64_t cpu = cpuTimeUs ();
+
+        if (phaseStart) {
+                uint64_t duration = now - phaseStart;
+                uint64_t bytes = bytesWritten - phaseBytes;
+                uint64_t cpuUs = cpu - phaseCpuUs;
+                double hours = duration / 3600e6;
+                double fullBytes = double (fullBitrate) / 8 * duration / 1e6;
+
+                log.event ("PHASE %s duration=%" PRIu64 "ms bytes=%" PRIu64 " cpu=%.1f%% bytes/h=%.0f saved/h=%.0f",
+                           (s == PARKED) ? "MOVING" : "PARKED",
+                           duration / 1000,
+                           bytes,
+                           (duration) ? 100.0 * cpuUs / duration : 0.0,
+                           (hours > 0) ? bytes / hours : 0.0,
+                           (hours > 0) ? (fullBytes - bytes) / hours : 0.0);
+        }
+
+        log.event ("%s", (s == PARKED) ? "PARKED" : "MOVING");
+        phaseStart = now;
+        phaseBytes = bytesWritten;
+        phaseCpuUs = cpu;
+}
@@ -0,0 +1,61 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef PARKINGMONITOR_H_
+#define PARKINGMONITOR_H_
+
+#include <stdint.h>
+#include <atomic>
+#include "Shield.h"
+
+class TelemetryLog;
+
+/**
+ * Tells whether the bike is parked. Fed with every shield frame (encoder callback thread),
+ * read by the main loop which switches the recording profile when woken up by a change. The bike is PARKED after
+ * both velocity and rpm sat at zero for parkDelayUs, and MOVING again on the very first
+ * frame with either of them above zero.
+ *
+ * It also measures what the parked profile buys us : for each phase, time, bytes written
+ * and CPU time of the whole process are reported to the telemetry log when the phase ends.
+ * Power has to be measured externally, it is not visible from here.
+ */
+class ParkingMonitor {
+public:
+
+        enum State { MOVING, PARKED };
+
+        /// parkDelayUs == 0 disables the monitor (always MOVING).
+        ParkingMonitor (uint64_t parkDelayUs) : parkDelayUs (parkDelayUs), state (MOVING) {}
+
+        /// @return true if the state has just changed.
+        bool update (Frame const &f);
+        State getState () const { return State (state.load (std::memory_order_acquire)); }
+
+        /**
+         * Closes the measurement of the previous phase and starts a new one. Call when the
+         * profile for the new state has been applied.
+         *
+         * @param bytesWritten total bytes written by the session so far.
+         * @param fullBitrate bitrate of the normal profile, bits/s, to compute the savings.
+         */
+        void beginPhase (State s, uint64_t bytesWritten, unsigned int fullBitrate, TelemetryLog &log);
+
+private:
+
+        uint64_t parkDelayUs;
+        uint64_t stillSince = 0;
+        std::atomic <int> state;
+
+        // Main thread side.
+        uint64_t phaseStart = 0;
+        uint64_t phaseBytes = 0;
+        uint64_t phaseCpuUs = 0;
+};
+
+#endif /* PARKINGMONITOR_H_ */
@@ -0,0 +1,91 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "PreEventRing.h"
+
+PreEventRing::PreEventRing (size_t capacity) : data (capacity) {}
+
+/*****************************************************************************/
+
+void PreEventRing::addHeaders (uint8_t const *d, size_t length)
+{
+        if (headersComplete) {
+                headersLength = 0;
+                headersComplete = false;
+        }
+
+        if (headersLength + length <= MAX_HEADERS) {
+                memcpy (headers + headersLength, d, length);
+                headersLength += length;
+        }
+}
+
+/*****************************************************************************/
+
+void PreEventRing::pop ()
+{
+        bytes -= records[head].length;
+        head = (head + 1) % MAX_RECORDS;
+
+        if (!--count) {
+                head = tail = 0;
+        }
+}
+
+/*****************************************************************************/
+
+void PreEventRing::push (uint8_t const *d, size_t length, int64_t pts, bool keyframe)
+{
+        bool start = keyframe && !lastKeyframe;
+        lastKeyframe = keyframe;
+        headersComplete = true;
+
+        if (!length || length > data.size ()) {
+                return;
+        }
+
+        // Nothing to decode from until the first key frame.
+        if (!count && !start) {
+                return;
+        }
+
+        size_t at = tail;
+
+        if (at + length > data.size ()) {
+                // Records between the tail and the end of the buffer are the oldest ones.
+                while (count && records[head].offset >= tail) {
+                        pop ();
+                }
+
+                at = 0;
+        }
+
+        while (count && records[head].offset < at + length && records[head].offset + records[head].length > at) {
+                pop ();
+        }
+
+        if (count == MAX_RECORDS) {
+                pop ();
+        }
+
+        // Whatever is left starts with a key frame, or is dropped.
+        while (count && !records[head].start) {
+                pop ();
+        }
+
+        if (!count && !start) {
+                return;
+        }
+
+        memcpy (&data[at], d, length);
+        records[(head + count) % MAX_RECORDS] = { at, length, pts, keyframe, start };
+        ++count;
+        tail = at + length;
+        bytes += length;
+}
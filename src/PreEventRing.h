@@ -0,0 +1,97 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef PREEVENTRING_H_
+#define PREEVENTRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * The last seconds of encoder output, kept in memory while nothing happens around the
+ * parked bike (-surveil), so a recording started by MotionDetector shows what came before
+ * the motion too.
+ *
+ * Buffers are copied into one preallocated byte ring, the oldest ones dropped when it is
+ * full. The ring always begins with the first buffer of a key frame, so drain () output
+ * decodes from its first byte : it starts with the stream headers (SPS / PPS, sent by
+ * the encoder once, at the start), which are kept aside for that.
+ *
+ * No allocations after the constructor. Encoder callback thread only.
+ */
+class PreEventRing {
+public:
+
+        PreEventRing (size_t capacity);
+
+        /// Encoder buffers flagged CONFIG.
+        void addHeaders (uint8_t const *data, size_t length);
+
+        void push (uint8_t const *data, size_t length, int64_t pts, bool keyframe);
+
+        bool empty () const { return !count; }
+        size_t size () const { return bytes; }
+
+        /**
+         * Hands the headers to header (data, length), then every buffer, oldest first, to
+         * write (data, length, pts, keyframe), and empties the ring. Stops at the first
+         * call returning false, and returns false then.
+         */
+        template <typename Header, typename Write> bool drain (Header header, Write write);
+
+private:
+
+        struct Record {
+                size_t offset;
+                size_t length;
+                int64_t pts;
+                bool keyframe;
+                bool start; // First buffer of a key frame.
+        };
+
+        void pop ();
+
+private:
+
+        static const size_t MAX_RECORDS = 4096;
+        static const size_t MAX_HEADERS = 256;
+
+        std::vector <uint8_t> data;
+        Record records[MAX_RECORDS];
+        size_t head = 0;  // Oldest record.
+        size_t count = 0;
+        size_t tail = 0;  // Byte offset after the newest record.
+        size_t bytes = 0; // In the records.
+        bool lastKeyframe = false;
+
+        uint8_t headers[MAX_HEADERS];
+        size_t headersLength = 0;
+        bool headersComplete = false; // The next ones replace them.
+};
+
+/*****************************************************************************/
+
+template <typename Header, typename Write> bool PreEventRing::drain (Header header, Write write)
+{
+        bool ok = !headersLength || header (headers, headersLength);
+
+        while (ok && count) {
+                Record const &r = records[head];
+                ok = write (&data[r.offset], r.length, r.pts, r.keyframe);
+                pop ();
+        }
+
+        count = 0;
+        head = 0;
+        tail = 0;
+        bytes = 0;
+        return ok;
+}
+
+#endif /* PREEVENTRING_H_ */
@@ -0,0 +1,392 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stdint.h>
+#include <math.h>
+#include <ratio>
+#include "Frame.h"
+#include "Indices.h"
+#include "Calibration.h"
+
+/**
+ * Shield frame layouts, described once as a list of fields. The decoder and the encoder of
+ * every protocol version are generated from the same list, so they can't disagree, and the
+ * layout is checked at compile time (fields inside the frame, no two fields on the same bits).
+ * Everything is inline : a decoder is a straight line of loads, shifts and multiplies.
+ *
+ * Bytes is anything indexable with [] : uint8_t *, or the boost::circular_buffer of the parser.
+ * Physical values come from the tables of a Calibration, passed to decode () and encode ().
+ */
+namespace protocol {
+
+/**
+ * Unsigned integer, Width bytes at Offset.
+ */
+template <unsigned int Offset, unsigned int Width, bool BigEndian>
+struct Integer {
+
+        static_assert (Width >= 1 && Width <= 4, "Field width is 1 to 4 bytes");
+
+        static const unsigned int BIT_BEGIN = Offset * 8;
+        static const unsigned int BIT_END = (Offset + Width) * 8;
+        static const uint32_t RAW_MAX = uint32_t (uint64_t (1) << (Width * 8)) - 1;
+
+        template <typename Bytes> static uint32_t raw (Bytes const &d)
+        {
+                uint32_t r = 0;
+
+                for (unsigned int i = 0; i < Width; ++i) {
+                        r |= uint32_t (d[Offset + i]) << (8 * ((BigEndian) ? Width - 1 - i : i));
+                }
+
+                return r;
+        }
+
+        template <typename Bytes> static void store (uint32_t r, Bytes &d)
+        {
+                for (unsigned int i = 0; i < Width; ++i) {
+                        d[Offset + i] = uint8_t (r >> (8 * ((BigEndian) ? Width - 1 - i : i)));
+                }
+        }
+};
+
+/**
+ * Unsigned integer, Width bytes at Offset, stored in Member as raw * Scale + Bias.
+ */
+template <typename T, T Frame::*Member, unsigned int Offset, unsigned int Width = 1,
+          typename Scale = std::ratio <1>, typename Bias = std::ratio <0>, bool BigEndian = true>
+struct Field : Integer <Offset, Width, BigEndian> {
+
+        typedef Integer <Offset, Width, BigEndian> Base;
+        using Base::RAW_MAX;
+
+        template <typename Bytes> static void decode (Bytes const &d, Frame &f, Calibration const &)
+        {
+                f.*Member = convert (Base::raw (d), std::integral_constant <bool, IDENTITY> ());
+        }
+
+        template <typename Bytes> static void encode (Frame const &f, Bytes &d, Calibration const &)
+        {
+                Base::store (unconvert (f.*Member, std::integral_constant <bool, IDENTITY> ()), d);
+        }
+
+private:
+
+        static const bool IDENTITY = Scale::num == Scale::den && Bias::num == 0;
+
+        static T convert (uint32_t r, std::true_type) { return T (r); }
+        static T convert (uint32_t r, std::false_type)
+        {
+                return T (r * (float (Scale::num) / Scale::den) + float (Bias::num) / Bias::den);
+        }
+
+        static uint32_t unconvert (T v, std::true_type) { return uint32_t (v); }
+        static uint32_t unconvert (T v, std::false_type)
+        {
+                float r = roundf ((v - float (Bias::num) / Bias::den) / (float (Scale::num) / Scale::den));
+                return (r <= 0) ? 0 : (r >= RAW_MAX) ? RAW_MAX : uint32_t (r);
+        }
+};
+
+/**
+ * Unsigned integer, Width bytes at Offset, mapped to Member by the Channel table of the
+ * calibration (Calibration::Lut or Calibration::Curve). The raw value is multiplied by
+ * RawScale first, for fields sent in coarser units than the table expects.
+ */
+template <float Frame::*Member, unsigned int Offset, unsigned int Width,
+          typename Table, Table Calibration::*Channel, unsigned int RawScale = 1, bool BigEndian = true>
+struct Calibrated : Integer <Offset, Width, BigEndian> {
+
+        typedef Integer <Offset, Width, BigEndian> Base;
+        using Base::RAW_MAX;
+
+        static_assert (uint64_t (RAW_MAX) * RawScale < Table::SIZE, "Raw values of the field exceed the calibration table");
+
+        template <typename Bytes> static void decode (Bytes const &d, Frame &f, Calibration const &c)
+        {
+                f.*Member = (c.*Channel) (Base::raw (d) * RawScale);
+        }
+
+        template <typename Bytes> static void encode (Frame const &f, Bytes &d, Calibration const &c)
+        {
+                uint32_t r = ((c.*Channel).raw (f.*Member) + RawScale / 2) / RawScale;
+                Base::store ((r >= RAW_MAX) ? RAW_MAX : r, d);
+        }
+};
+
+/**
+ * One bit of the byte at Offset.
+ */
+template <bool Frame::*Member, unsigned int Offset, unsigned int Bit>
+struct Flag {
+
+        static_assert (Bit < 8, "Flag bit is 0 to 7");
+
+        static const unsigned int BIT_BEGIN = Offset * 8 + Bit;
+        static const unsigned int BIT_END = BIT_BEGIN + 1;
+
+        template <typename Bytes> static void decode (Bytes const &d, Frame &f, Calibration const &) { f.*Member = (d[Offset] >> Bit) & 1; }
+
+        template <typename Bytes> static void encode (Frame const &f, Bytes &d, Calibration const &)
+        {
+                d[Offset] = uint8_t ((d[Offset] & ~(1 << Bit)) | (uint8_t (f.*Member) << Bit));
+        }
+};
+
+/**
+ * Sum of the bytes, modulo 256. Weak : a window shifted by one byte passes it easily.
+ */
+struct Sum8 {
+        typedef uint8_t Value;
+
+        static Value update (Value sum, uint8_t b) { return Value (sum + b); }
+
+        /// Value over the last Length bytes, from the one over the previous Length bytes.
+        template <unsigned int Length> static Value roll (Value sum, uint8_t in, uint8_t out) { return Value (sum + in - out); }
+
+        template <typename Bytes> static Value compute (Bytes const &d, unsigned int begin, unsigned int end)
+        {
+                Value sum = 0;
+
+                for (unsigned int i = begin; i < end; ++i) {
+                        sum = update (sum, d[i]);
+                }
+
+                return sum;
+        }
+};
+
+/*--------------------------------------------------------------------------*/
+
+/**
+ * CRC, MSB first, init 0, no final xor, T wide (uint8_t or uint16_t), one table lookup per byte.
+ * Both tables are generated at compile time.
+ *
+ * With init 0, leading zero bytes don't change the CRC, and the CRC is linear. So the CRC of
+ * a window which lost its first byte x is the CRC of the longer window xor CRC (x, 0...0).
+ * OUT tables hold the latter, which makes rolling the CRC along a stream O(1) per byte.
+ */
+template <typename T, T Poly>
+struct Crc {
+        typedef T Value;
+
+        static const unsigned int SHIFT = sizeof (T) * 8 - 8;
+
+        static constexpr T bits (T c, int k)
+        {
+                return (k == 0) ? c : bits (T ((c >> (sizeof (T) * 8 - 1)) ? (c << 1) ^ Poly : c << 1), k - 1);
+        }
+
+        /// Compile time version of update ().
+        static constexpr T step (T c, uint8_t b) { return T ((c << 8) ^ bits (T (T ((c >> SHIFT) ^ b) << SHIFT), 8)); }
+
+        static constexpr T zeros (T c, unsigned int n) { return (n == 0) ? c : zeros (step (c, 0), n - 1); }
+
+        template <typename Seq> struct Table;
+        template <unsigned int... I> struct Table <Indices <I...>> {
+                static constexpr T DATA[256] = { bits (T (T (I) << SHIFT), 8)... };
+        };
+
+        template <unsigned int Length, typename Seq> struct OutTable;
+        template <unsigned int Length, unsigned int... I> struct OutTable <Length, Indices <I...>> {
+                static constexpr T DATA[256] = { zeros (step (0, uint8_t (I)), Length)... };
+        };
+
+        typedef Table <typename MakeIndices <256>::Type> TABLE;
+        template <unsigned int Length> using OUT = OutTable <Length, typename MakeIndices <256>::Type>;
+
+        static T update (T c, uint8_t b) { return T ((c << 8) ^ TABLE::DATA[uint8_t ((c >> SHIFT) ^ b)]); }
+
+        template <unsigned int Length> static T roll (T c, uint8_t in, uint8_t out) { return T (update (c, in) ^ OUT <Length>::DATA[out]); }
+
+        template <typename Bytes> static T compute (Bytes const &d, unsigned int begin, unsigned int end)
+        {
+                T crc = 0;
+
+                for (unsigned int i = begin; i < end; ++i) {
+                        crc = update (crc, d[i]);
+                }
+
+                return crc;
+        }
+};
+
+template <typename T, T Poly>
+template <unsigned int... I>
+constexpr T Crc <T, Poly>::Table <Indices <I...>>::DATA[256];
+
+template <typename T, T Poly>
+template <unsigned int Length, unsigned int... I>
+constexpr T Crc <T, Poly>::OutTable <Length, Indices <I...>>::DATA[256];
+
+typedef Crc <uint8_t, 0x07> Crc8;
+
+static_assert (Crc8::step (0, '1') == 0x97, "CRC-8 table generation");
+
+/**
+ * Check of the last Length bytes pushed. The caller supplies the byte leaving the window
+ * (0 while fewer than Length bytes were pushed since reset ()).
+ */
+template <typename Check, unsigned int Length>
+class RollingCheck {
+public:
+
+        typedef typename Check::Value Value;
+
+        void push (uint8_t in, uint8_t out) { value = Check::template roll <Length> (value, in, out); }
+        void reset () { value = 0; }
+        Value get () const { return value; }
+
+private:
+
+        Value value = 0;
+};
+
+/*--------------------------------------------------------------------------*/
+
+/// Bit ranges of the fields do not intersect.
+template <typename... Fs> struct Disjoint;
+template <typename F, typename... Fs> struct DisjointFrom;
+
+template <typename F> struct DisjointFrom <F> : std::true_type {};
+template <typename F, typename G, typename... Fs> struct DisjointFrom <F, G, Fs...> :
+        std::integral_constant <bool, (F::BIT_END <= G::BIT_BEGIN || G::BIT_END <= F::BIT_BEGIN) && DisjointFrom <F, Fs...>::value> {};
+
+template <> struct Disjoint <> : std::true_type {};
+template <typename F, typename... Fs> struct Disjoint <F, Fs...> :
+        std::integral_constant <bool, DisjointFrom <F, Fs...>::value && Disjoint <Fs...>::value> {};
+
+/// All the fields lie within bits [begin, end).
+template <unsigned int Begin, unsigned int End, typename... Fs> struct Within;
+template <unsigned int Begin, unsigned int End> struct Within <Begin, End> : std::true_type {};
+template <unsigned int Begin, unsigned int End, typename F, typename... Fs> struct Within <Begin, End, F, Fs...> :
+        std::integral_constant <bool, F::BIT_BEGIN >= Begin && F::BIT_END <= End && Within <Begin, End, Fs...>::value> {};
+
+/*--------------------------------------------------------------------------*/
+
+/**
+ * A frame : start (command) byte, the fields, and a check byte over everything in between.
+ * Check has to produce one byte.
+ */
+template <uint8_t Command, unsigned int Size, typename Check, typename... Fields>
+struct Layout {
+
+        static const uint8_t COMMAND = Command;
+        static const unsigned int SIZE = Size;
+        static const unsigned int DATA_SIZE = Size - 2;
+
+        /// Check of the DATA_SIZE bytes before the check byte, when scanning a stream.
+        typedef RollingCheck <Check, DATA_SIZE> Rolling;
+
+        static_assert (sizeof (typename Check::Value) == 1, "One check byte per frame");
+
+        static_assert (Disjoint <Fields...>::value, "Two fields of the layout share bits");
+        static_assert (Within <8, (Size - 1) * 8, Fields...>::value, "A field overlaps the start or the check byte, or is past the frame");
+
+        template <typename Bytes> static bool validate (Bytes const &d)
+        {
+                return d[0] == Command && Check::compute (d, 1, Size - 1) == d[Size - 1];
+        }
+
+        template <typename Bytes> static void decode (Bytes const &d, Frame &f, Calibration const &c)
+        {
+                int expand[] = { 0, (Fields::template decode <Bytes> (d, f, c), 0)... };
+                (void)expand;
+        }
+
+        /// d has to hold SIZE bytes. Bits not covered by any field are 0.
+        template <typename Bytes> static void encode (Frame const &f, Bytes &d, Calibration const &c)
+        {
+                for (unsigned int i = 0; i < Size; ++i) {
+                        d[i] = 0;
+                }
+
+                d[0] = Command;
+                int expand[] = { 0, (Fields::template encode <Bytes> (f, d, c), 0)... };
+                (void)expand;
+                d[Size - 1] = Check::compute (d, 1, Size - 1);
+        }
+};
+
+/*--------------------------------------------------------------------------*/
+
+// GPIO byte.
+enum { GPIO_LEFT_TURN, GPIO_RIGHT_TURN, GPIO_FRONT_BRAKE, GPIO_REAR_BRAKE, GPIO_PARKING_LIGHT };
+
+/// 8 bytes at 38400 baud, rpm in 50 rpm steps.
+typedef Layout <0x01, 8, Sum8,
+                Calibrated <&Frame::velocity, 1, 2, Calibration::Curve, &Calibration::velocity>,
+                Calibrated <&Frame::rpm, 3, 1, Calibration::Curve, &Calibration::rpm, 50>,
+                Calibrated <&Frame::engineTemp, 4, 1, Calibration::Lut, &Calibration::engineTemp>,
+                Flag <&Frame::leftTurn, 5, GPIO_LEFT_TURN>,
+                Flag <&Frame::rightTurn, 5, GPIO_RIGHT_TURN>,
+                Flag <&Frame::frontBrake, 5, GPIO_FRONT_BRAKE>,
+                Flag <&Frame::rearBrake, 5, GPIO_REAR_BRAKE>,
+                Flag <&Frame::parkingLight, 5, GPIO_PARKING_LIGHT>,
+                Calibrated <&Frame::airTemp, 6, 1, Calibration::Lut, &Calibration::airTemp>> V1;
+
+/// 12 bytes, sequence number and AVR tick for loss accounting and sample timing, CRC.
+typedef Layout <0x02, 12, Crc8,
+                Field <uint8_t, &Frame::sequence, 1>,
+                Field <uint16_t, &Frame::tick, 2, 2>,
+                Calibrated <&Frame::velocity, 4, 2, Calibration::Curve, &Calibration::velocity>,
+                Calibrated <&Frame::rpm, 6, 2, Calibration::Curve, &Calibration::rpm>,
+                Calibrated <&Frame::engineTemp, 8, 1, Calibration::Lut, &Calibration::engineTemp>,
+                Flag <&Frame::leftTurn, 9, GPIO_LEFT_TURN>,
+                Flag <&Frame::rightTurn, 9, GPIO_RIGHT_TURN>,
+                Flag <&Frame::frontBrake, 9, GPIO_FRONT_BRAKE>,
+                Flag <&Frame::rearBrake, 9, GPIO_REAR_BRAKE>,
+                Flag <&Frame::parkingLight, 9, GPIO_PARKING_LIGHT>,
+                Calibrated <&Frame::airTemp, 10, 1, Calibration::Lut, &Calibration::airTemp>> V2;
+
+static const unsigned int MAX_FRAME_SIZE = (V1::SIZE > V2::SIZE) ? V1::SIZE : V2::SIZE;
+
+/// v2 AVR tick : 16 MHz, prescaler 64.
+static const uint64_t TICK_US = 4;
+static const uint64_t TICK_WRAP_US = 65536 * TICK_US;
+
+/*--------------------------------------------------------------------------*/
+
+/**
+ * Pi -> AVR commands (v2 firmware) : start byte, sequence number, command, 16 bit argument
+ * (big endian), CRC-8 of everything but the start byte. The AVR answers every command with
+ * an Ack frame in its telemetry stream : start byte, the sequence number, status, CRC-8.
+ */
+enum Command : uint8_t {
+        SET_RATE = 1,   // Samples per second.
+        SET_FIELDS = 2, // Mask of FIELD_* to send, the rest goes as 0.
+        SNAPSHOT = 3,   // Send a frame right now.
+        SYNC_TICK = 4   // Set the tick counter to the argument.
+};
+
+enum { FIELD_VELOCITY = 1 << 0, FIELD_RPM = 1 << 1, FIELD_ENGINE_TEMP = 1 << 2, FIELD_AIR_TEMP = 1 << 3, FIELD_GPIO = 1 << 4, FIELD_ALL = 0x1f };
+
+enum AckStatus : uint8_t { ACK_OK = 0, ACK_UNKNOWN_COMMAND = 1, ACK_BAD_ARGUMENT = 2 };
+
+static const uint8_t COMMAND_START = 0x10;
+static const unsigned int COMMAND_SIZE = 6;
+
+inline void encodeCommand (uint8_t sequence, Command command, uint16_t argument, uint8_t *d)
+{
+        d[0] = COMMAND_START;
+        d[1] = sequence;
+        d[2] = command;
+        d[3] = uint8_t (argument >> 8);
+        d[4] = uint8_t (argument);
+        d[5] = Crc8::compute (d, 1, COMMAND_SIZE - 1);
+}
+
+/// No fields : sequence number at 1, status at 2, read directly.
+typedef Layout <0x11, 4, Crc8> Ack;
+
+} // namespace protocol
+
+#endif /* PROTOCOL_H_ */
@@ -0,0 +1,90 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <iostream>
+#include "Realtime.h"
+
+namespace realtime {
+
+bool configureThread (pthread_t thread, const char *name, int cpu, int priority)
+{
+        bool ok = true;
+        long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+        if (cpu >= 0 && cpus > 0) {
+                cpu_set_t set;
+                CPU_ZERO (&set);
+                CPU_SET (cpu % cpus, &set);
+
+                if (int e = pthread_setaffinity_np (thread, sizeof (set), &set)) {
+                        std::cerr << "realtime::configureThread : " << name << " : unable to pin to CPU " << cpu << " : " << strerror (e) << std::endl;
+                        ok = false;
+                }
+        }
+
+        struct sched_param param;
+        memset (&param, 0, sizeof (param));
+        param.sched_priority = priority;
+
+        if (int e = pthread_setschedparam (thread, SCHED_FIFO, &param)) {
+                std::cerr << "realtime::configureThread : " << name << " : unable to set SCHED_FIFO " << priority << " : " << strerror (e) << std::endl;
+                ok = false;
+        }
+
+        return ok;
+}
+
+/*****************************************************************************/
+
+bool lockMemory ()
+{
+        if (mlockall (MCL_CURRENT | MCL_FUTURE) < 0) {
+                std::cerr << "realtime::lockMemory : mlockall failed : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        prefaultStack ();
+        return true;
+}
+
+/*****************************************************************************/
+
+void prefaultStack (size_t size)
+{
+        const size_t MAX_PREFAULT = 256 * 1024;
+        pthread_attr_t attr;
+        size_t stackSize = 0;
+
+        // MMAL threads are not ours : their stack may be small, and the caller deep into it already.
+        if (pthread_getattr_np (pthread_self (), &attr) == 0) {
+                pthread_attr_getstacksize (&attr, &stackSize);
+                pthread_attr_destroy (&attr);
+        }
+
+        if (stackSize) {
+                size = std::min (size, stackSize / 2);
+        }
+
+        unsigned char stack[MAX_PREFAULT];
+        memset (stack, 0, std::min (size, MAX_PREFAULT));
+
+        // Nobody reads the array : keeps the compiler from dropping the memset.
+        __asm__ __volatile__ ("" : : "r" (stack) : "memory");
+}
+
+} // namespace realtime
@@ -0,0 +1,49 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef REALTIME_H_
+#define REALTIME_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * Helpers for the opt-in realtime mode (-rt). Every function reports its own failures
+ * to stderr and returns false; the program carries on with whatever it got (typically
+ * the process lacks CAP_SYS_NICE / RLIMIT_RTPRIO or CAP_IPC_LOCK).
+ */
+namespace realtime {
+
+/// Priorities of the threads the realtime mode takes care of. Serial ingest comes first.
+const int INGEST_PRIORITY = 80;
+const int CALLBACK_PRIORITY = 70;
+const int WRITER_PRIORITY = 60;
+/// The live copy (-live) gives way to the archive.
+const int LIVE_WRITER_PRIORITY = 50;
+
+/**
+ * Pins the thread to cpu (modulo the number of CPUs online, so a Pi 1 config works on
+ * a Pi 3 and vice versa) and makes it SCHED_FIFO with the given priority.
+ */
+bool configureThread (pthread_t thread, const char *name, int cpu, int priority);
+
+/**
+ * mlockall (current and future mappings), so nothing we touch in the steady state can
+ * page fault.
+ */
+bool lockMemory ();
+
+/**
+ * Touches size bytes of the calling thread's stack, at most half of it. Every realtime
+ * thread calls it for itself : ingest, the encoder callback and the writer.
+ */
+void prefaultStack (size_t size = 64 * 1024);
+
+} // namespace realtime
+
+#endif /* REALTIME_H_ */
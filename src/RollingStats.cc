@@ -0,0 +1,193 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <math.h>
+#include <algorithm>
+#include "RollingStats.h"
+#include "TelemetryLog.h"
+
+size_t RollingStats::roundUp (uint64_t n)
+{
+        size_t p = 1;
+
+        while (p < n) {
+                p <<= 1;
+        }
+
+        return p;
+}
+
+/*****************************************************************************/
+
+void RollingStats::Queue::allocate (uint64_t capacity)
+{
+        slot.resize (roundUp (capacity));
+        mask = slot.size () - 1;
+}
+
+/*****************************************************************************/
+
+void RollingStats::Sum::add (double x)
+{
+        double t = sum + x;
+        compensation += (fabs (sum) >= fabs (x)) ? (sum - t) + x : (x - t) + sum;
+        sum = t;
+}
+
+/*****************************************************************************/
+
+RollingStats::RollingStats (std::initializer_list <Channel> c, std::initializer_list <unsigned int> windowsMs, unsigned int maxRateHz) :
+        channels (c),
+        shift (c.size (), 0)
+{
+        uint64_t longest = 0;
+
+        for (unsigned int ms : windowsMs) {
+                Window w;
+                w.ms = ms;
+                w.capacity = uint64_t (ms) * maxRateHz / 1000 + 1;
+                windows.push_back (w);
+                longest = std::max (longest, w.capacity);
+        }
+
+        while ((uint64_t (1) << historyBits) <= longest) {
+                ++historyBits;
+        }
+
+        historyMask = (size_t (1) << historyBits) - 1;
+        times.resize (historyMask + 1);
+        values.resize ((historyMask + 1) * channels.size ());
+        states.resize (windows.size () * channels.size ());
+
+        for (size_t w = 0; w < windows.size (); ++w) {
+                for (size_t i = 0; i < channels.size (); ++i) {
+                        State &s = state (i, w);
+                        s.min.allocate (windows[w].capacity);
+                        s.max.allocate (windows[w].capacity);
+                }
+        }
+}
+
+/*****************************************************************************/
+
+void RollingStats::push (Frame const &f)
+{
+        uint64_t k = next++;
+        uint64_t t = f.sampleTime;
+
+        // The slot overwritten here belongs to no window : history is longer than any of them.
+        times[k & historyMask] = t;
+
+        for (size_t i = 0; i < channels.size (); ++i) {
+                float x = f.*channels[i].member;
+
+                if (!k) {
+                        shift[i] = x;
+                }
+
+                values[(i << historyBits) + (k & historyMask)] = x;
+        }
+
+        for (size_t w = 0; w < windows.size (); ++w) {
+                Window &win = windows[w];
+                uint64_t span = uint64_t (win.ms) * 1000;
+
+                // Samples leaving : too old, or more than the window was allocated for.
+                while (win.begin < k && (next - win.begin > win.capacity || times[win.begin & historyMask] + span < t)) {
+                        for (size_t i = 0; i < channels.size (); ++i) {
+                                double y = value (i, win.begin) - shift[i];
+                                State &s = state (i, w);
+                                s.sum.add (-y);
+                                s.squares.add (-y * y);
+                        }
+
+                        ++win.begin;
+                }
+
+                for (size_t i = 0; i < channels.size (); ++i) {
+                        State &s = state (i, w);
+                        float x = value (i, k);
+                        double y = x - shift[i];
+                        s.sum.add (y);
+                        s.squares.add (y * y);
+
+                        while (s.min.size && s.min.front () < win.begin) {
+                                s.min.popFront ();
+                        }
+
+                        while (s.min.size && value (i, s.min.back ()) >= x) {
+                                s.min.popBack ();
+                        }
+
+                        s.min.pushBack (k);
+
+                        while (s.max.size && s.max.front () < win.begin) {
+                                s.max.popFront ();
+                        }
+
+                        while (s.max.size && value (i, s.max.back ()) <= x) {
+                                s.max.popBack ();
+                        }
+
+                        s.max.pushBack (k);
+                }
+        }
+}
+
+/*****************************************************************************/
+
+RollingStats::Result RollingStats::get (unsigned int channel, unsigned int window) const
+{
+        Result r;
+
+        if (!next) {
+                return r;
+        }
+
+        State const &s = state (channel, window);
+        uint64_t n = next - windows[window].begin;
+        double sum = s.sum.get ();
+        double variance = (s.squares.get () - sum * sum / n) / n;
+
+        r.count = uint32_t (n);
+        r.min = value (channel, s.min.front ());
+        r.max = value (channel, s.max.front ());
+        r.mean = float (shift[channel] + sum / n);
+        r.stddev = float (sqrt (std::max (variance, 0.0)));
+        return r;
+}
+
+/*****************************************************************************/
+
+void RollingStats::report (TelemetryLog &log) const
+{
+        for (size_t w = 0; w < windows.size (); ++w) {
+                char line[256] = "";
+                size_t n = 0;
+
+                for (size_t i = 0; i < channels.size () && n < sizeof (line); ++i) {
+                        Result r = get (i, w);
+                        n += snprintf (line + n, sizeof (line) - n, " %s=%.1f/%.1f/%.1f/%.2f", channels[i].name, r.min, r.max, r.mean, r.stddev);
+                }
+
+                log.event ("STATS window=%ums samples=%u%s", windows[w].ms, get (0, w).count, line);
+        }
+}
+
+/*****************************************************************************/
+
+void RollingStats::print (FILE *f) const
+{
+        for (size_t w = 0; w < windows.size (); ++w) {
+                for (size_t i = 0; i < channels.size (); ++i) {
+                        Result r = get (i, w);
+                        fprintf (f, "last %u ms %s : min %.1f, max %.1f, mean %.1f, stddev %.2f (%u samples)\n",
+                                 windows[w].ms, channels[i].name, r.min, r.max, r.mean, r.stddev, r.count);
+                }
+        }
+}
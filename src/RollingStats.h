@@ -0,0 +1,124 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef ROLLINGSTATS_H_
+#define ROLLINGSTATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <initializer_list>
+#include "Frame.h"
+
+class TelemetryLog;
+
+/**
+ * Min, max, mean and standard deviation of some Frame channels over the last few seconds,
+ * for every combination of channel and window, updated with each sample. Nothing is ever
+ * rescanned :
+ *
+ * - min and max come from monotonic queues of sample numbers (the front is the extreme, a
+ *   new sample first removes the ones it makes irrelevant from the back),
+ * - mean and deviation from running sums of x and x^2 which get the sample leaving the
+ *   window subtracted. The sums are compensated (Neumaier) and taken relative to the first
+ *   sample, so hours of adding and subtracting don't eat the precision.
+ *
+ * So push () is amortized O(channels * windows) and get () is O(1). Storage is allocated by
+ * the constructor for windowMs * maxRateHz samples per window : a faster stream makes the
+ * windows shorter than asked, never reallocates. Windows are in sample time.
+ *
+ * Not thread safe : push and get from the same thread.
+ */
+class RollingStats {
+public:
+
+        struct Channel {
+                const char *name;
+                float Frame::*member;
+        };
+
+        struct Result {
+                float min = 0;
+                float max = 0;
+                float mean = 0;
+                float stddev = 0;
+                uint32_t count = 0;
+        };
+
+        RollingStats (std::initializer_list <Channel> channels, std::initializer_list <unsigned int> windowsMs, unsigned int maxRateHz);
+
+        void push (Frame const &f);
+
+        /// Channel and window in the order given to the constructor.
+        Result get (unsigned int channel, unsigned int window) const;
+
+        /// Every window as one STATS event.
+        void report (TelemetryLog &log) const;
+        void print (FILE *f) const;
+
+private:
+
+        /// Neumaier summation.
+        struct Sum {
+                double sum = 0;
+                double compensation = 0;
+
+                void add (double x);
+                double get () const { return sum + compensation; }
+        };
+
+        /// Fixed capacity deque of sample numbers, capacity a power of 2.
+        struct Queue {
+                std::vector <uint64_t> slot;
+                size_t mask = 0;
+                size_t head = 0;
+                size_t size = 0;
+
+                void allocate (uint64_t capacity);
+                uint64_t front () const { return slot[head]; }
+                uint64_t back () const { return slot[(head + size - 1) & mask]; }
+                void popFront () { head = (head + 1) & mask; --size; }
+                void popBack () { --size; }
+                void pushBack (uint64_t k) { slot[(head + size++) & mask] = k; }
+        };
+
+        struct Window {
+                unsigned int ms;
+                uint64_t capacity; // Samples.
+                uint64_t begin = 0; // Number of the oldest sample inside.
+        };
+
+        /// Per channel and window.
+        struct State {
+                Sum sum;
+                Sum squares;
+                Queue min;
+                Queue max;
+        };
+
+        /// A power of 2 : sample numbers are 64 bit, and a 64 bit modulo is a library call on ARM.
+        static size_t roundUp (uint64_t n);
+
+        float value (unsigned int channel, uint64_t k) const { return values[(channel << historyBits) + (k & historyMask)]; }
+        State &state (unsigned int channel, unsigned int window) { return states[window * channels.size () + channel]; }
+        State const &state (unsigned int channel, unsigned int window) const { return states[window * channels.size () + channel]; }
+
+private:
+
+        std::vector <Channel> channels;
+        std::vector <Window> windows;
+        std::vector <State> states;
+        std::vector <float> shift; // First value of each channel.
+        unsigned int historyBits = 0; // 2^historyBits samples kept, more than the longest window.
+        size_t historyMask = 0;
+        std::vector <uint64_t> times;
+        std::vector <float> values;
+        uint64_t next = 0; // Number of the next sample.
+};
+
+#endif /* ROLLINGSTATS_H_ */
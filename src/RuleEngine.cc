@@ -0,0 +1,358 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include "RuleEngine.h"
+#include "TelemetryLog.h"
+
+const char *const RuleEngine::DEFAULT_RULES =
+        "# name          condition                                                        on ms      off ms\n"
+        "hard_braking    frontBrake & rearBrake & acceleration < -6 ~ 1.5                  on 100     off 500\n"
+        "over_rev        rpm > 11000 ~ 500                                                 on 200     off 1000\n"
+        "overheat        engineTemp > 110 ~ 5                                              on 5000    off 10000\n"
+        "indicator_on    leftTurn & velocity > 20 ~ 5 | rightTurn & velocity > 20 ~ 5      on 30000   off 2000\n";
+
+namespace {
+
+/// Whitespace separated, and the operators are tokens of their own : "a>5&b" is a > 5 & b.
+std::vector <std::string> tokenize (std::string const &line)
+{
+        std::vector <std::string> tokens;
+        std::string current;
+
+        for (char c : line) {
+                if (isspace ((unsigned char)c) || strchr ("&|!<>~", c)) {
+                        if (!current.empty ()) {
+                                tokens.push_back (current);
+                                current.clear ();
+                        }
+
+                        if (!isspace ((unsigned char)c)) {
+                                tokens.push_back (std::string (1, c));
+                        }
+                }
+                else {
+                        current += c;
+                }
+        }
+
+        if (!current.empty ()) {
+                tokens.push_back (current);
+        }
+
+        return tokens;
+}
+
+bool parseNumber (std::string const &token, double *value)
+{
+        char *end;
+        *value = strtod (token.c_str (), &end);
+        return !token.empty () && *end == '\0';
+}
+
+} // namespace
+
+/*****************************************************************************/
+
+bool RuleEngine::bind (std::string const &name, Term &t)
+{
+        static const struct {
+                const char *name;
+                float Frame::*member;
+        } FLOATS[] = {
+                { "velocity", &Frame::velocity },
+                { "rpm", &Frame::rpm },
+                { "engineTemp", &Frame::engineTemp },
+                { "airTemp", &Frame::airTemp },
+                { "acceleration", &Frame::acceleration },
+                { "jerk", &Frame::jerk },
+                { "distance", &Frame::distance },
+                { "braking", &Frame::braking },
+                { "motion", &Frame::motion },
+        };
+
+        static const struct {
+                const char *name;
+                bool Frame::*member;
+        } BOOLS[] = {
+                { "frontBrake", &Frame::frontBrake },
+                { "rearBrake", &Frame::rearBrake },
+                { "leftTurn", &Frame::leftTurn },
+                { "rightTurn", &Frame::rightTurn },
+                { "parkingLight", &Frame::parkingLight },
+        };
+
+        for (auto const &f : FLOATS) {
+                if (name == f.name) {
+                        t.source = Term::FLOAT;
+                        t.floatField = f.member;
+                        return true;
+                }
+        }
+
+        for (auto const &f : BOOLS) {
+                if (name == f.name) {
+                        t.source = Term::BOOL;
+                        t.boolField = f.member;
+                        return true;
+                }
+        }
+
+        if (name == "gear") {
+                t.source = Term::BYTE;
+                t.byteField = &Frame::gear;
+                return true;
+        }
+
+        return false;
+}
+
+/*****************************************************************************/
+
+bool RuleEngine::compile (const char *text, const char *origin)
+{
+        std::vector <Term> newTerms;
+        std::vector <Rule> newRules;
+        std::istringstream input (text);
+        std::string line;
+        unsigned int number = 0;
+        const char *error = nullptr;
+        std::string near;
+
+        while (!error && std::getline (input, line)) {
+                ++number;
+                line = line.substr (0, line.find ('#'));
+                std::vector <std::string> tok = tokenize (line);
+
+                if (tok.empty ()) {
+                        continue;
+                }
+
+                Rule r;
+                size_t i = 1;
+
+                if (tok[0].size () >= sizeof (r.name) || !isalpha ((unsigned char)tok[0][0])) {
+                        error = "bad rule name";
+                        near = tok[0];
+                        break;
+                }
+
+                if (newRules.size () == MAX_RULES) {
+                        error = "too many rules";
+                        break;
+                }
+
+                strcpy (r.name, tok[0].c_str ());
+                r.begin = newTerms.size ();
+
+                // Terms.
+                while (!error) {
+                        Term t;
+                        double value, hysteresis = 0;
+
+                        if (i < tok.size () && tok[i] == "!") {
+                                t.negate = true;
+                                ++i;
+                        }
+
+                        if (i >= tok.size () || !bind (tok[i], t)) {
+                                error = "expected a field";
+                                near = (i < tok.size ()) ? tok[i] : "end of line";
+                                break;
+                        }
+
+                        ++i;
+
+                        if (i < tok.size () && (tok[i] == "<" || tok[i] == ">")) {
+                                t.compare = (tok[i] == "<") ? Term::LESS : Term::GREATER;
+                                ++i;
+
+                                if (i >= tok.size () || !parseNumber (tok[i], &value)) {
+                                        error = "expected a number";
+                                        near = (i < tok.size ()) ? tok[i] : "end of line";
+                                        break;
+                                }
+
+                                ++i;
+
+                                if (i < tok.size () && tok[i] == "~") {
+                                        ++i;
+
+                                        if (i >= tok.size () || !parseNumber (tok[i], &hysteresis) || hysteresis < 0) {
+                                                error = "expected a hysteresis >= 0";
+                                                near = (i < tok.size ()) ? tok[i] : "end of line";
+                                                break;
+                                        }
+
+                                        ++i;
+                                }
+
+                                t.set = float (value);
+                                t.reset = float ((t.compare == Term::LESS) ? value + hysteresis : value - hysteresis);
+                        }
+
+                        if (i < tok.size () && tok[i] == "&") {
+                                ++i;
+                                newTerms.push_back (t);
+                                continue;
+                        }
+
+                        t.endsAnd = true;
+                        newTerms.push_back (t);
+
+                        if (i < tok.size () && tok[i] == "|") {
+                                ++i;
+                                continue;
+                        }
+
+                        break;
+                }
+
+                // Durations.
+                while (!error && i < tok.size ()) {
+                        double ms;
+
+                        if ((tok[i] != "on" && tok[i] != "off") || i + 1 >= tok.size () || !parseNumber (tok[i + 1], &ms) || ms < 0) {
+                                error = "expected on <ms> or off <ms>";
+                                near = tok[i];
+                                break;
+                        }
+
+                        ((tok[i] == "on") ? r.onUs : r.offUs) = uint64_t (ms * 1000);
+                        i += 2;
+                }
+
+                r.end = newTerms.size ();
+                newRules.push_back (r);
+        }
+
+        if (error) {
+                std::cerr << "RuleEngine::compile : " << origin << ":" << number << " : " << error;
+
+                if (!near.empty ()) {
+                        std::cerr << " near '" << near << "'";
+                }
+
+                std::cerr << std::endl;
+                return false;
+        }
+
+        terms.swap (newTerms);
+        rules.swap (newRules);
+        return true;
+}
+
+/*****************************************************************************/
+
+bool RuleEngine::load (const char *path)
+{
+        std::ifstream file (path);
+
+        if (!file) {
+                std::cerr << "RuleEngine::load : unable to open " << path << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        std::stringstream text;
+        text << file.rdbuf ();
+        return compile (text.str ().c_str (), path);
+}
+
+/*****************************************************************************/
+
+bool RuleEngine::Term::evaluate (Frame const &f)
+{
+        float x = (source == FLOAT) ? f.*floatField : (source == BOOL) ? float (f.*boolField) : float (f.*byteField);
+
+        switch (compare) {
+        case LESS:
+                state = (state) ? x < reset : x < set;
+                break;
+
+        case GREATER:
+                state = (state) ? x > reset : x > set;
+                break;
+
+        default:
+                state = x != 0;
+                break;
+        }
+
+        return state != negate;
+}
+
+/*****************************************************************************/
+
+void RuleEngine::update (Frame const &f)
+{
+        uint64_t t = f.sampleTime;
+
+        for (Rule &r : rules) {
+                bool any = false;
+                bool all = true;
+
+                for (size_t i = r.begin; i < r.end; ++i) {
+                        all = terms[i].evaluate (f) && all;
+
+                        if (terms[i].endsAnd) {
+                                any = any || all;
+                                all = true;
+                        }
+                }
+
+                if (any) {
+                        r.lastTrue = t;
+                }
+
+                // False spells shorter than offUs don't interrupt the condition.
+                bool held = any || (r.lastTrue && t - r.lastTrue < r.offUs);
+
+                if (!held) {
+                        r.heldSince = 0;
+
+                        if (r.active) {
+                                fire (r, false, r.lastTrue);
+                        }
+
+                        continue;
+                }
+
+                if (!r.heldSince) {
+                        r.heldSince = t;
+                }
+
+                if (!r.active && t - r.heldSince >= r.onUs) {
+                        fire (r, true, r.heldSince);
+                }
+        }
+}
+
+/*****************************************************************************/
+
+void RuleEngine::fire (Rule &r, bool active, uint64_t time)
+{
+        r.active = active;
+
+        if (active) {
+                log.event ("RULE %s on t=%" PRIu64, r.name, time);
+        }
+        else {
+                log.event ("RULE %s off t=%" PRIu64, r.name, time);
+        }
+
+        for (Handler const &h : handlers) {
+                h (r.name, active, time);
+        }
+}
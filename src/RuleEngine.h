@@ -0,0 +1,110 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef RULEENGINE_H_
+#define RULEENGINE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include "Frame.h"
+
+class TelemetryLog;
+
+/**
+ * Live event detection on the shield samples. Rules are text, one per line :
+ *
+ *   # name        condition                                        on ms   off ms
+ *   hard_braking  frontBrake & rearBrake & acceleration < -6 ~ 1.5  on 100  off 500
+ *
+ * The condition is an OR (|) of ANDs (&) of terms, no parentheses. A term is a Frame field
+ * (true if not 0), ! field, or a field compared to a number with < or >. A comparison can
+ * have a hysteresis (~ h) : once true, "x > t ~ h" stays true until x drops to t - h.
+ * A rule fires after its condition held for "on" ms, with false spells shorter than "off" ms
+ * bridged over (so blinking indicators count as on), and ends after "off" ms of false.
+ *
+ * compile () turns the rules into one flat array of terms, evaluated in order for every
+ * sample : all terms, every time (the hysteresis state needs it), so the cost per sample is
+ * fixed. Rule changes are logged as RULE events with the sample time, and passed to the
+ * subscribers. No allocations past compile () and subscribe ().
+ *
+ * Runs in the encoder callback thread, with the rest of the frame consumers.
+ */
+class RuleEngine {
+public:
+
+        /// rule, true when it fires / false when it ends, sample time of the change.
+        typedef std::function <void (const char *rule, bool active, uint64_t time)> Handler;
+
+        RuleEngine (TelemetryLog &log) : log (log) {}
+
+        /**
+         * Replaces the rules. Errors go to stderr with origin and the line number, and leave
+         * the previous rules in place.
+         */
+        bool compile (const char *text, const char *origin);
+
+        /// compile () the contents of a file.
+        bool load (const char *path);
+
+        void subscribe (Handler const &h) { handlers.push_back (h); }
+
+        void update (Frame const &f);
+
+        size_t size () const { return rules.size (); }
+
+        /// Hard braking, over-rev, engine overheat, indicator left on.
+        static const char *const DEFAULT_RULES;
+
+private:
+
+        struct Term {
+                enum Source : uint8_t { FLOAT, BOOL, BYTE };
+                enum Compare : uint8_t { NONZERO, LESS, GREATER };
+
+                Source source = FLOAT;
+                Compare compare = NONZERO;
+                bool negate = false;
+                bool endsAnd = false; // Last term of an AND.
+                bool state = false;
+                float Frame::*floatField = nullptr;
+                bool Frame::*boolField = nullptr;
+                uint8_t Frame::*byteField = nullptr;
+                float set = 0;   // Becomes true past this.
+                float reset = 0; // And false again past this one.
+
+                bool evaluate (Frame const &f);
+        };
+
+        struct Rule {
+                char name[32];
+                size_t begin; // Terms.
+                size_t end;
+                uint64_t onUs = 0;
+                uint64_t offUs = 0;
+                bool active = false;
+                uint64_t heldSince = 0;
+                uint64_t lastTrue = 0;
+        };
+
+        static const size_t MAX_RULES = 64;
+
+        /// Points t at the Frame field called name.
+        static bool bind (std::string const &name, Term &t);
+        void fire (Rule &r, bool active, uint64_t time);
+
+private:
+
+        TelemetryLog &log;
+        std::vector <Term> terms;
+        std::vector <Rule> rules;
+        std::vector <Handler> handlers;
+};
+
+#endif /* RULEENGINE_H_ */
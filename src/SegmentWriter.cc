@@ -0,0 +1,455 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_DIRECT
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <iostream>
+#include "SegmentWriter.h"
+#include "Clock.h"
+#include "Realtime.h"
+
+/*****************************************************************************/
+
+SegmentWriter *SegmentWriter::create (const char *name)
+{
+        // "stdio" : the name it had when it was built on stdio.
+        if (!strcmp (name, "buffered") || !strcmp (name, "stdio")) {
+                return new BufferedWriter;
+        }
+
+        if (!strcmp (name, "direct")) {
+                return new DirectWriter;
+        }
+
+        return nullptr;
+}
+
+/*****************************************************************************/
+
+BufferedWriter::BufferedWriter () : buffer (new uint8_t[BUFFER_SIZE])
+{
+}
+
+/*****************************************************************************/
+
+BufferedWriter::~BufferedWriter ()
+{
+        close ();
+        delete [] buffer;
+}
+
+/*****************************************************************************/
+
+bool BufferedWriter::open (const char *path)
+{
+        close ();
+
+        if ((fd = ::open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+                std::cerr << "BufferedWriter::open : unable to open " << path << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+bool BufferedWriter::write (uint8_t const *data, size_t length, bool)
+{
+        if (fd < 0) {
+                return false;
+        }
+
+        while (length) {
+                size_t n = std::min (length, BUFFER_SIZE - used);
+                memcpy (buffer + used, data, n);
+                used += n;
+                data += n;
+                length -= n;
+
+                if (used == BUFFER_SIZE && !flush ()) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+bool BufferedWriter::flush ()
+{
+        size_t done = 0;
+
+        while (done < used) {
+                uint64_t start = monotonicUs ();
+                ssize_t n = ::write (fd, buffer + done, used - done);
+                record (monotonicUs () - start);
+
+                if (n <= 0) {
+                        std::cerr << "BufferedWriter::flush : write failed : " << strerror (errno) << std::endl;
+                        used = 0;
+                        return false;
+                }
+
+                done += n;
+        }
+
+        used = 0;
+        return true;
+}
+
+/*****************************************************************************/
+
+void BufferedWriter::close ()
+{
+        if (fd >= 0) {
+                flush ();
+                ::close (fd);
+                fd = -1;
+        }
+}
+
+/*****************************************************************************/
+
+DirectWriter::DirectWriter () : running (true), failed (false), discarding (false), pending (0), inFlight (0), controlOps (0), dropped (0)
+{
+        for (Block &b : blocks) {
+                if (posix_memalign ((void **)&b.data, ALIGNMENT, BLOCK_SIZE)) {
+                        std::cerr << "DirectWriter::DirectWriter : out of memory" << std::endl;
+                        failed = true;
+                        continue;
+                }
+
+                // Touch the pages now rather than on the first ride minute.
+                memset (b.data, 0, BLOCK_SIZE);
+                freeBlocks.push (&b);
+        }
+
+        thread = std::thread (&DirectWriter::run, this);
+}
+
+/*****************************************************************************/
+
+DirectWriter::~DirectWriter ()
+{
+        close ();
+        discarding = true;
+
+        {
+                std::lock_guard <std::mutex> lock (mutex);
+                running = false;
+        }
+
+        wakeup.notify_one ();
+        thread.join ();
+
+        for (Block &b : blocks) {
+                free (b.data);
+        }
+}
+
+/*****************************************************************************/
+
+bool DirectWriter::open (const char *path)
+{
+        close ();
+
+        // The PREALLOCATE and the CLOSE of this segment, taken now so close () can't fail later.
+        for (unsigned int i = 0; controlOps.load (std::memory_order_acquire) + 2 > CONTROL_OPS; ++i) {
+                if (i >= CONTROL_WAIT_MS) {
+                        std::cerr << "DirectWriter::open : the card is not keeping up, " << controlOps.load () / 2
+                                  << " segments still waiting to be closed, not opening " << path << std::endl;
+                        return false;
+                }
+
+                usleep (1000);
+        }
+
+        controlOps.fetch_add (2, std::memory_order_relaxed);
+
+        if ((fd = ::open (path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644)) < 0) {
+                std::cerr << "DirectWriter::open : unable to open " << path << " : " << strerror (errno) << std::endl;
+                controlOps.fetch_sub (2, std::memory_order_relaxed);
+                return false;
+        }
+
+        offset = 0;
+        size = 0;
+
+        // First extent is allocated by the writer thread before any data arrives.
+        Op op;
+        op.type = Op::PREALLOCATE;
+        op.fd = fd;
+        op.block = nullptr;
+        op.offset = 0;
+        return submit (op);
+}
+
+/*****************************************************************************/
+
+bool DirectWriter::write (uint8_t const *data, size_t length, bool keyframe)
+{
+        if (fd < 0) {
+                return false;
+        }
+
+        bool start = keyframe && !lastKeyframe;
+        lastKeyframe = keyframe;
+
+        // Only this thread takes blocks, so the room can only grow until they are taken.
+        size_t room = ((current) ? BLOCK_SIZE - current->used : 0) + freeBlocks.read_available () * BLOCK_SIZE;
+
+        if ((dropping && !start) || room < length) {
+                // The card can't keep up. Drop rather than block the encoder.
+                dropping = true;
+                dropped.fetch_add (length, std::memory_order_relaxed);
+                return !failed.load (std::memory_order_relaxed);
+        }
+
+        dropping = false;
+
+        while (length) {
+                if (!current) {
+                        freeBlocks.pop (current);
+                }
+
+                size_t n = std::min (length, BLOCK_SIZE - current->used);
+                memcpy (current->data + current->used, data, n);
+                current->used += n;
+                size += n;
+                data += n;
+                length -= n;
+
+                if (current->used == BLOCK_SIZE) {
+                        flushBlock (false);
+                }
+        }
+
+        return !failed.load (std::memory_order_relaxed);
+}
+
+/*****************************************************************************/
+
+void DirectWriter::close ()
+{
+        if (fd < 0) {
+                return;
+        }
+
+        flushBlock (true);
+
+        Op op;
+        op.type = Op::CLOSE;
+        op.fd = fd;
+        op.block = nullptr;
+        op.offset = size;
+        submit (op);
+        fd = -1;
+}
+
+/*****************************************************************************/
+
+bool DirectWriter::sync (unsigned int timeoutMs)
+{
+        // Only used on shutdown, so polling is good enough.
+        for (unsigned int i = 0; inFlight.load (std::memory_order_acquire); ++i) {
+                if (i >= timeoutMs) {
+                        // The card stopped responding : nothing queued is going to make it anyway.
+                        discarding = true;
+                        return false;
+                }
+
+                usleep (1000);
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+void DirectWriter::configureThread (int cpu, int priority)
+{
+        realtime::configureThread (thread.native_handle (), "writer", cpu, priority);
+
+        // The stack has to be touched by the writer thread itself, see run ().
+        {
+                std::lock_guard <std::mutex> lock (mutex);
+                prefault = true;
+        }
+
+        wakeup.notify_one ();
+}
+
+/*****************************************************************************/
+
+bool DirectWriter::flushBlock (bool tail)
+{
+        if (!current) {
+                return true;
+        }
+
+        // Kept for the next segment : the free list is filled by the writer thread only.
+        if (!current->used) {
+                return true;
+        }
+
+        if (tail) {
+                // O_DIRECT needs whole aligned blocks. The padding gets truncated on CLOSE.
+                size_t padded = (current->used + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+                memset (current->data + current->used, 0, padded - current->used);
+                current->used = padded;
+        }
+
+        Op op;
+        op.type = Op::WRITE;
+        op.fd = fd;
+        op.block = current;
+        op.offset = offset;
+        offset += current->used;
+        current = nullptr;
+        return submit (op);
+}
+
+/*****************************************************************************/
+
+bool DirectWriter::submit (Op const &op)
+{
+        if (op.type == Op::WRITE) {
+                pending.fetch_add (1, std::memory_order_relaxed);
+        }
+
+        inFlight.fetch_add (1, std::memory_order_relaxed);
+
+        // Can't fail (see ops), unless the reservations above are broken.
+        bool ok = ops.push (op);
+
+        if (!ok) {
+                std::cerr << "DirectWriter::submit : operation queue full, lost an operation of type " << op.type << std::endl;
+                inFlight.fetch_sub (1, std::memory_order_relaxed);
+
+                if (op.type == Op::WRITE) {
+                        pending.fetch_sub (1, std::memory_order_relaxed);
+                }
+        }
+
+        {
+                std::lock_guard <std::mutex> lock (mutex);
+        }
+
+        wakeup.notify_one ();
+        return ok;
+}
+
+/*****************************************************************************/
+
+void DirectWriter::discard (Op const &op)
+{
+        if (op.type == Op::WRITE) {
+                op.block->used = 0;
+                freeBlocks.push (op.block);
+                pending.fetch_sub (1, std::memory_order_relaxed);
+        }
+        else {
+                // Not even the ftruncate : the padding stays, the file still parses up to it.
+                if (op.type == Op::CLOSE) {
+                        ::close (op.fd);
+                }
+
+                controlOps.fetch_sub (1, std::memory_order_release);
+        }
+
+        inFlight.fetch_sub (1, std::memory_order_release);
+}
+
+/*****************************************************************************/
+
+void DirectWriter::run ()
+{
+        int lastFd = -1;
+        off_t allocated = 0;
+
+        while (true) {
+                Op op;
+
+                {
+                        std::unique_lock <std::mutex> lock (mutex);
+                        wakeup.wait (lock, [this] { return ops.read_available () || !running || prefault; });
+
+                        if (prefault) {
+                                prefault = false;
+                                lock.unlock ();
+                                realtime::prefaultStack ();
+                                continue;
+                        }
+
+                        if (!ops.pop (op)) {
+                                // Not running and nothing left to do.
+                                return;
+                        }
+                }
+
+                if (discarding.load (std::memory_order_relaxed)) {
+                        discard (op);
+                        lastFd = -1;
+                        continue;
+                }
+
+                if (op.type == Op::CLOSE) {
+                        if (ftruncate (op.fd, op.offset) < 0) {
+                                std::cerr << "DirectWriter::run : ftruncate failed : " << strerror (errno) << std::endl;
+                        }
+
+                        ::close (op.fd);
+                        lastFd = -1;
+                        controlOps.fetch_sub (1, std::memory_order_release);
+                        inFlight.fetch_sub (1, std::memory_order_release);
+                        continue;
+                }
+
+                if (op.fd != lastFd) {
+                        lastFd = op.fd;
+                        allocated = 0;
+                }
+
+                if (op.type == Op::PREALLOCATE || op.offset + off_t (op.block->used) > allocated) {
+                        // Filesystems without fallocate (vfat on older kernels) simply don't get the extents.
+                        if (fallocate (op.fd, FALLOC_FL_KEEP_SIZE, allocated, PREALLOCATE_SIZE) == 0 || errno == EOPNOTSUPP) {
+                                allocated += PREALLOCATE_SIZE;
+                        }
+                }
+
+                if (op.type == Op::PREALLOCATE) {
+                        controlOps.fetch_sub (1, std::memory_order_release);
+                        inFlight.fetch_sub (1, std::memory_order_release);
+                        continue;
+                }
+
+                uint64_t start = monotonicUs ();
+                ssize_t n = pwrite (op.fd, op.block->data, op.block->used, op.offset);
+                record (monotonicUs () - start);
+
+                if (n != ssize_t (op.block->used)) {
+                        std::cerr << "DirectWriter::run : write failed : " << strerror (errno) << std::endl;
+                        failed = true;
+                }
+
+                op.block->used = 0;
+                freeBlocks.push (op.block);
+                pending.fetch_sub (1, std::memory_order_relaxed);
+                inFlight.fetch_sub (1, std::memory_order_release);
+        }
+}
@@ -0,0 +1,199 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SEGMENTWRITER_H_
+#define SEGMENTWRITER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <boost/lockfree/spsc_queue.hpp>
+#include "Stats.h"
+
+/**
+ * Backend which puts encoder output onto the card. One segment file is open at a time.
+ * latency () collects the time spent in each write syscall (or fwrite) so the backends
+ * can be compared on the same card.
+ */
+class SegmentWriter {
+public:
+
+        virtual ~SegmentWriter () {}
+
+        /// Opens (and for backends that support it, preallocates) a new segment file.
+        virtual bool open (const char *path) = 0;
+
+        /**
+         * False on errors only. A backend may drop a whole buffer instead (see getDropped),
+         * never a part of one. keyframe : the buffer belongs to a key frame, so a backend
+         * which dropped something can start again there.
+         */
+        virtual bool write (uint8_t const *data, size_t length, bool keyframe = false) = 0;
+        virtual void close () = 0;
+
+        /**
+         * Waits until everything handed over so far is on the card, at most timeoutMs. False
+         * on timeout : an asynchronous backend then throws away what it still has queued, so
+         * that destroying it waits for the write in progress only.
+         */
+        virtual bool sync (unsigned int timeoutMs) { return true; }
+
+        /// Blocks waiting for the card (0 for synchronous backends).
+        virtual unsigned int queueDepth () const { return 0; }
+        /// Realtime mode : pins the backend's own thread, if it has one.
+        virtual void configureThread (int cpu, int priority) {}
+
+        /// Bytes thrown away because the card could not keep up.
+        virtual uint64_t getDropped () const { return 0; }
+        virtual const char *name () const = 0;
+
+        LatencyStats const &latency () const { return stats; }
+
+        /// Same as latency (), but reset by whoever is watching the writer (see BitrateController).
+        LatencyStats &recentLatency () { return recent; }
+
+        /**
+         * "buffered" (or "stdio", its old name) or "direct". Returns nullptr for unknown names.
+         */
+        static SegmentWriter *create (const char *name);
+
+protected:
+
+        void record (uint32_t us)
+        {
+                stats.add (us);
+                recent.add (us);
+        }
+
+private:
+
+        LatencyStats stats;
+        LatencyStats recent;
+};
+
+/**
+ * The original path : buffered writes through the page cache, kernel decides when to write
+ * back. Does what stdio did, but with a buffer allocated once, not on every fopen.
+ */
+class BufferedWriter : public SegmentWriter {
+public:
+
+        virtual ~BufferedWriter ();
+
+        BufferedWriter ();
+        virtual bool open (const char *path);
+        virtual bool write (uint8_t const *data, size_t length, bool keyframe = false);
+        virtual void close ();
+        virtual const char *name () const { return "buffered"; }
+
+        static const size_t BUFFER_SIZE = 65536;
+
+private:
+
+        bool flush ();
+
+private:
+
+        int fd = -1;
+        size_t used = 0;
+        uint8_t *buffer;
+};
+
+/**
+ * Collects encoder output in page aligned, erase block sized buffers taken from a pool
+ * allocated once, and writes them with O_DIRECT from a separate thread. Segment files
+ * are fallocated in PREALLOCATE_SIZE extents so the filesystem does not hunt for free
+ * clusters on every write. The last, partial block is padded to the alignment, and
+ * the file truncated back to the real size on close.
+ *
+ * If the card falls behind and the pool has no room for a buffer, the buffer is dropped
+ * (and counted) instead of stalling the encoder callback, and so is everything after it
+ * up to the next key frame : the frames in between would reference what is missing.
+ * Buffers are never cut, so what is in the file always parses.
+ *
+ * The destructor does not wait for the card : whatever sync () did not wait for is
+ * thrown away (blocks back to the pool, files closed as they are).
+ */
+class DirectWriter : public SegmentWriter {
+public:
+
+        DirectWriter ();
+        virtual ~DirectWriter ();
+
+        virtual bool open (const char *path);
+        virtual bool write (uint8_t const *data, size_t length, bool keyframe = false);
+        virtual void close ();
+        virtual bool sync (unsigned int timeoutMs);
+        virtual void configureThread (int cpu, int priority);
+        virtual unsigned int queueDepth () const { return pending.load (std::memory_order_relaxed); }
+        virtual const char *name () const { return "direct"; }
+
+        virtual uint64_t getDropped () const { return dropped.load (std::memory_order_relaxed); }
+
+        static const size_t ALIGNMENT = 4096;
+        static const size_t BLOCK_SIZE = 1024 * 1024;
+        static const size_t POOL_SIZE = 8;
+        static const off_t PREALLOCATE_SIZE = 32 * 1024 * 1024;
+        /// Segments opened but not closed on the card yet, each takes a PREALLOCATE and a CLOSE.
+        static const unsigned int CONTROL_OPS = 8;
+        /// How long open () waits for the card to catch up with the closes before failing.
+        static const unsigned int CONTROL_WAIT_MS = 50;
+
+private:
+
+        struct Block {
+                uint8_t *data = nullptr;
+                size_t used = 0;
+        };
+
+        struct Op {
+                enum Type { PREALLOCATE, WRITE, CLOSE };
+                Type type;
+                int fd;
+                Block *block;
+                off_t offset;   // WRITE : where to put the block, CLOSE : final file size.
+        };
+
+        void run ();
+        bool submit (Op const &op);
+        void discard (Op const &op);
+        bool flushBlock (bool tail);
+
+private:
+
+        Block blocks[POOL_SIZE];
+        boost::lockfree::spsc_queue <Block *, boost::lockfree::capacity <POOL_SIZE + 1>> freeBlocks;
+        // A WRITE per block at most, the control ops are reserved by open () : a push never fails.
+        boost::lockfree::spsc_queue <Op, boost::lockfree::capacity <POOL_SIZE + CONTROL_OPS>> ops;
+
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        std::atomic <bool> running;
+        std::atomic <bool> failed;
+        std::atomic <bool> discarding; // Stopping, or sync () timed out : run () stops writing.
+        bool prefault = false; // Under the mutex. Set by configureThread (), for run ().
+        std::atomic <unsigned int> pending;
+        std::atomic <unsigned int> inFlight;
+        std::atomic <unsigned int> controlOps; // Reserved by open (), given back by run ().
+        std::atomic <uint64_t> dropped;
+
+        // Producer (encoder callback) side.
+        int fd = -1;
+        Block *current = nullptr;
+        off_t offset = 0;
+        uint64_t size = 0;
+        bool dropping = false;
+        bool lastKeyframe = false;
+};
+
+#endif /* SEGMENTWRITER_H_ */
@@ -0,0 +1,295 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+#include "Sei.h"
+
+namespace sei {
+namespace {
+
+const uint8_t NAL_SEI = 6;
+const uint8_t USER_DATA_UNREGISTERED = 5;
+const size_t UUID_SIZE = 16;
+const size_t MAX_TEXT = 160;
+
+const uint8_t UUID[UUID_SIZE] = { 0x4d, 0x8a, 0x1f, 0x3c, 0x92, 0x5e, 0x47, 0xb1, 0xa6, 0x0d, 0x2c, 0x7e, 0x93, 0x58, 0xe4, 0x11 };
+
+/// Copies the RBSP into the NAL payload, with an emulation prevention byte after every 00 00 followed by 00..03.
+size_t escape (uint8_t const *in, size_t length, uint8_t *out, size_t size)
+{
+        size_t n = 0;
+        unsigned int zeros = 0;
+
+        for (size_t i = 0; i < length; ++i) {
+                if (zeros == 2 && in[i] <= 3) {
+                        if (n == size) {
+                                return 0;
+                        }
+
+                        out[n++] = 3;
+                        zeros = 0;
+                }
+
+                if (n == size) {
+                        return 0;
+                }
+
+                out[n++] = in[i];
+                zeros = (in[i]) ? 0 : zeros + 1;
+        }
+
+        return n;
+}
+
+/// The reverse, in place. Returns the RBSP length.
+size_t unescape (uint8_t *data, size_t length)
+{
+        size_t n = 0;
+        unsigned int zeros = 0;
+
+        for (size_t i = 0; i < length; ++i) {
+                if (zeros == 2 && data[i] == 3) {
+                        zeros = 0;
+                        continue;
+                }
+
+                data[n++] = data[i];
+                zeros = (data[i]) ? 0 : zeros + 1;
+        }
+
+        return n;
+}
+
+/// ff ff ... xx coded SEI payload type or size.
+bool readValue (uint8_t const *&p, uint8_t const *end, size_t *value)
+{
+        *value = 0;
+
+        while (p < end && *p == 0xff) {
+                *value += 0xff;
+                ++p;
+        }
+
+        if (p == end) {
+                return false;
+        }
+
+        *value += *p++;
+        return true;
+}
+
+} // namespace
+
+/*****************************************************************************/
+
+size_t encode (Frame const &f, uint8_t *out, size_t size)
+{
+        char text[MAX_TEXT];
+        int length = snprintf (text, sizeof (text), "%" PRIu64 " %.2f %.1f %.1f %.1f %d %d %d %d %d %.2f %.1f %.1f %.2f %u",
+                               f.sampleTime,
+                               f.velocity,
+                               f.rpm,
+                               f.engineTemp,
+                               f.airTemp,
+                               f.frontBrake,
+                               f.rearBrake,
+                               f.leftTurn,
+                               f.rightTurn,
+                               f.parkingLight,
+                               f.acceleration,
+                               f.jerk,
+                               f.distance,
+                               f.braking,
+                               unsigned (f.gear));
+
+        if (length < 0 || size_t (length) >= sizeof (text)) {
+                return 0;
+        }
+
+        // Header, payload type, payload size, UUID, text, rbsp_trailing_bits.
+        uint8_t rbsp[MAX_NAL];
+        size_t payload = UUID_SIZE + length;
+        size_t n = 0;
+
+        rbsp[n++] = NAL_SEI;
+        rbsp[n++] = USER_DATA_UNREGISTERED;
+
+        for (size_t s = payload; ; s -= 0xff) {
+                rbsp[n++] = (s >= 0xff) ? 0xff : s;
+
+                if (s < 0xff) {
+                        break;
+                }
+        }
+
+        memcpy (rbsp + n, UUID, UUID_SIZE);
+        n += UUID_SIZE;
+        memcpy (rbsp + n, text, length);
+        n += length;
+        rbsp[n++] = 0x80;
+
+        static const uint8_t START_CODE[] = { 0, 0, 0, 1 };
+
+        if (size < sizeof (START_CODE)) {
+                return 0;
+        }
+
+        memcpy (out, START_CODE, sizeof (START_CODE));
+        size_t escaped = escape (rbsp, n, out + sizeof (START_CODE), size - sizeof (START_CODE));
+        return (escaped) ? sizeof (START_CODE) + escaped : 0;
+}
+
+/*****************************************************************************/
+
+bool decode (uint8_t const *nal, size_t length, Frame *f)
+{
+        if (!length || (nal[0] & 0x1f) != NAL_SEI || length > MAX_NAL * 2) {
+                return false;
+        }
+
+        uint8_t rbsp[MAX_NAL * 2];
+        memcpy (rbsp, nal, length);
+        length = unescape (rbsp, length);
+
+        uint8_t const *p = rbsp + 1;
+        uint8_t const *end = rbsp + length;
+
+        // One NAL may carry several SEI messages, ours is any of them.
+        while (p < end && *p != 0x80) {
+                size_t type, size;
+
+                if (!readValue (p, end, &type) || !readValue (p, end, &size) || size_t (end - p) < size) {
+                        return false;
+                }
+
+                if (type == USER_DATA_UNREGISTERED && size > UUID_SIZE && !memcmp (p, UUID, UUID_SIZE)) {
+                        char text[MAX_NAL * 2];
+                        memcpy (text, p + UUID_SIZE, size - UUID_SIZE);
+                        text[size - UUID_SIZE] = '\0';
+
+                        int fb, rb, lt, rt, pl;
+                        unsigned int gear;
+
+                        int n = sscanf (text, "%" SCNu64 " %f %f %f %f %d %d %d %d %d %f %f %f %f %u",
+                                        &f->sampleTime,
+                                        &f->velocity,
+                                        &f->rpm,
+                                        &f->engineTemp,
+                                        &f->airTemp,
+                                        &fb, &rb, &lt, &rt, &pl,
+                                        &f->acceleration,
+                                        &f->jerk,
+                                        &f->distance,
+                                        &f->braking,
+                                        &gear);
+
+                        if (n != 15) {
+                                return false;
+                        }
+
+                        f->timestamp = f->sampleTime;
+                        f->frontBrake = fb;
+                        f->rearBrake = rb;
+                        f->leftTurn = lt;
+                        f->rightTurn = rt;
+                        f->parkingLight = pl;
+                        f->gear = gear;
+                        return true;
+                }
+
+                p += size;
+        }
+
+        return false;
+}
+
+/*****************************************************************************/
+
+int extract (const char *path, FILE *out)
+{
+        std::ifstream file (path, std::ios::binary);
+
+        if (!file) {
+                std::cerr << "sei::extract : unable to open " << path << " : " << strerror (errno) << std::endl;
+                return -1;
+        }
+
+        std::vector <uint8_t> data ((std::istreambuf_iterator <char> (file)), std::istreambuf_iterator <char> ());
+        size_t size = data.size ();
+        unsigned int accessUnits = 0;
+        int found = 0;
+
+        // NAL units start after 00 00 01 and end where the next start code (00 00 01 or 00 00 00 01) does.
+        size_t i = 0;
+
+        while (i + 3 <= size) {
+                if (data[i] || data[i + 1] || data[i + 2] != 1) {
+                        ++i;
+                        continue;
+                }
+
+                size_t begin = i + 3;
+                size_t end = begin;
+
+                while (end + 3 <= size && (data[end] || data[end + 1] || data[end + 2] != 1)) {
+                        ++end;
+                }
+
+                if (end + 3 > size) {
+                        end = size;
+                }
+
+                i = end;
+
+                while (end > begin && !data[end - 1]) {
+                        --end;
+                }
+
+                if (end == begin) {
+                        continue;
+                }
+
+                uint8_t type = data[begin] & 0x1f;
+                Frame f;
+
+                // A slice with first_mb_in_slice = 0 (ue (v) coded as a single 1 bit) starts a picture.
+                if ((type == 1 || type == 5) && end - begin > 1 && (data[begin + 1] & 0x80)) {
+                        ++accessUnits;
+                }
+                else if (type == NAL_SEI && decode (&data[begin], end - begin, &f)) {
+                        fprintf (out, "%u %" PRIu64 " %.2f %.1f %.1f %.1f %d %d %d %d %d %.2f %.1f %.1f %.2f %u\n",
+                                 accessUnits,
+                                 f.sampleTime,
+                                 f.velocity,
+                                 f.rpm,
+                                 f.engineTemp,
+                                 f.airTemp,
+                                 f.frontBrake,
+                                 f.rearBrake,
+                                 f.leftTurn,
+                                 f.rightTurn,
+                                 f.parkingLight,
+                                 f.acceleration,
+                                 f.jerk,
+                                 f.distance,
+                                 f.braking,
+                                 unsigned (f.gear));
+                        ++found;
+                }
+        }
+
+        return found;
+}
+
+} // namespace sei
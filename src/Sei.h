@@ -0,0 +1,55 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SEI_H_
+#define SEI_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "Frame.h"
+
+/**
+ * Shield samples carried inside the H.264 stream (-sei), so the footage and its telemetry
+ * can't be separated by copying, trimming or remuxing : one SEI NAL unit of type
+ * user_data_unregistered in front of every access unit. The payload is our UUID followed
+ * by the sample as text, same fields as the F records of the telemetry log (without the
+ * record number) :
+ *
+ *   sampleTime velocity rpm engineTemp airTemp frontBrake rearBrake leftTurn rightTurn
+ *   parkingLight acceleration jerk distance braking gear
+ *
+ * Decoders skip SEI they don't know, players are not affected.
+ */
+namespace sei {
+
+/// Enough for one NAL unit made by encode ().
+const size_t MAX_NAL = 256;
+
+/**
+ * Makes the NAL unit (start code included, emulation prevention applied) carrying f.
+ * Returns its length, 0 if it did not fit. No allocations.
+ */
+size_t encode (Frame const &f, uint8_t *out, size_t size);
+
+/**
+ * Reads the sample back from a NAL unit (without the start code). False if it is not one
+ * of ours.
+ */
+bool decode (uint8_t const *nal, size_t length, Frame *f);
+
+/**
+ * Prints the samples embedded in an Annex B file to out, one line per sample, prefixed
+ * with the number of the access unit (counted from 0) which follows it. Returns the
+ * number of samples found, -1 if the file can't be read.
+ */
+int extract (const char *path, FILE *out);
+
+} // namespace sei
+
+#endif /* SEI_H_ */
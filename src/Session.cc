@@ -0,0 +1,345 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <limits.h>
+#include <algorithm>
+#include <iostream>
+#include "Session.h"
+#include "Clock.h"
+
+/*****************************************************************************/
+
+Manifest::~Manifest ()
+{
+        if (fd >= 0) {
+                close (fd);
+        }
+}
+
+/*****************************************************************************/
+
+bool Manifest::open (std::string const &path)
+{
+        if ((fd = ::open (path.c_str (), O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+                std::cerr << "Manifest::open : unable to open " << path << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+bool Manifest::last (ManifestEntry *entry)
+{
+        // How many records back we look if the tail turns out to be garbage.
+        const int MAX_CORRUPTED = 16;
+        struct stat st;
+
+        if (fd < 0 || fstat (fd, &st) < 0) {
+                return false;
+        }
+
+        off_t size = st.st_size;
+
+        if (size % RECORD_SIZE) {
+                size -= size % RECORD_SIZE;
+
+                if (ftruncate (fd, size) < 0) {
+                        std::cerr << "Manifest::last : unable to truncate torn record : " << strerror (errno) << std::endl;
+                }
+        }
+
+        char buf[RECORD_SIZE + 1];
+
+        for (off_t off = size - RECORD_SIZE; off >= 0 && off >= size - MAX_CORRUPTED * off_t (RECORD_SIZE); off -= RECORD_SIZE) {
+                if (pread (fd, buf, RECORD_SIZE, off) != RECORD_SIZE) {
+                        return false;
+                }
+
+                buf[RECORD_SIZE] = '\0';
+                char type;
+
+                int n = sscanf (buf, "%c %u %u %" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNu64 " %u %u %u",
+                                &type,
+                                &entry->ride,
+                                &entry->segment,
+                                &entry->startPts,
+                                &entry->endPts,
+                                &entry->startTime,
+                                &entry->endTime,
+                                &entry->size,
+                                &entry->keyframes,
+                                &entry->telemetryBegin,
+                                &entry->telemetryEnd);
+
+                if (n == 11 && (type == ManifestEntry::RIDE || type == ManifestEntry::SEGMENT)) {
+                        entry->type = ManifestEntry::Type (type);
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/*****************************************************************************/
+
+bool Manifest::append (ManifestEntry const &e)
+{
+        char buf[RECORD_SIZE + 1];
+
+        int n = snprintf (buf, sizeof (buf), "%c %10u %10u %20" PRId64 " %20" PRId64 " %16" PRId64 " %16" PRId64 " %20" PRIu64 " %10u %10u %10u",
+                          char (e.type),
+                          e.ride,
+                          e.segment,
+                          e.startPts,
+                          e.endPts,
+                          e.startTime,
+                          e.endTime,
+                          e.size,
+                          e.keyframes,
+                          e.telemetryBegin,
+                          e.telemetryEnd);
+
+        if (n < 0 || n >= int (RECORD_SIZE)) {
+                return false;
+        }
+
+        // Pad to the fixed record size.
+        memset (buf + n, ' ', RECORD_SIZE - 1 - n);
+        buf[RECORD_SIZE - 1] = '\n';
+
+        if (write (fd, buf, RECORD_SIZE) != RECORD_SIZE) {
+                std::cerr << "Manifest::append : write failed : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        fdatasync (fd);
+        return true;
+}
+
+/*****************************************************************************/
+
+/**
+ * Numbers above every rideNNNNN directory and every NNNNN.h264 segment in them. For when
+ * the manifest can't tell : lost, or a tail too damaged to parse. False if baseDir can't
+ * be listed.
+ */
+static bool scanRides (std::string const &baseDir, unsigned int *nextRide, unsigned int *nextSegment)
+{
+        DIR *base = opendir (baseDir.c_str ());
+
+        if (!base) {
+                std::cerr << "Session::start : unable to list " << baseDir << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        *nextRide = *nextSegment = 0;
+        struct dirent *r;
+
+        while ((r = readdir (base))) {
+                unsigned int ride, segment;
+                int end = 0;
+
+                // %n : the whole name has to match, not just its beginning.
+                if (sscanf (r->d_name, "ride%u%n", &ride, &end) != 1 || r->d_name[end]) {
+                        continue;
+                }
+
+                *nextRide = std::max (*nextRide, ride + 1);
+                DIR *dir = opendir ((baseDir + "/" + r->d_name).c_str ());
+
+                if (!dir) {
+                        continue;
+                }
+
+                struct dirent *s;
+
+                while ((s = readdir (dir))) {
+                        end = 0;
+
+                        if (sscanf (s->d_name, "%u.h264%n", &segment, &end) == 1 && end && !s->d_name[end]) {
+                                *nextSegment = std::max (*nextSegment, segment + 1);
+                        }
+                }
+
+                closedir (dir);
+        }
+
+        closedir (base);
+        return true;
+}
+
+/*****************************************************************************/
+
+Session::~Session ()
+{
+        closeSegment ();
+}
+
+/*****************************************************************************/
+
+bool Session::start ()
+{
+        if (mkdir (baseDir.c_str (), 0755) < 0 && errno != EEXIST) {
+                std::cerr << "Session::start : unable to create " << baseDir << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        if (!manifest.open (baseDir + "/manifest")) {
+                return false;
+        }
+
+        ManifestEntry last;
+
+        if (manifest.last (&last)) {
+                current.ride = last.ride + 1;
+                nextSegment = (last.type == ManifestEntry::SEGMENT) ? last.segment + 1 : last.segment;
+        }
+        // Starting from 0 would overwrite whatever is on the card : go by the files instead.
+        else if (!scanRides (baseDir, &current.ride, &nextSegment)) {
+                return false;
+        }
+        else if (current.ride) {
+                std::cerr << "Session::start : no usable manifest record, numbering from ride " << current.ride << ", segment " << nextSegment << std::endl;
+        }
+
+        char name[16];
+        snprintf (name, sizeof (name), "/ride%05u", current.ride);
+        rideDir = baseDir + name;
+
+        if (mkdir (rideDir.c_str (), 0755) < 0 && errno != EEXIST) {
+                std::cerr << "Session::start : unable to create " << rideDir << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        if (!log.open ((rideDir + "/telemetry.log").c_str ())) {
+                return false;
+        }
+
+        ManifestEntry ride;
+        ride.type = ManifestEntry::RIDE;
+        ride.ride = current.ride;
+        ride.segment = nextSegment;
+        ride.startPts = ride.endPts = UNKNOWN_PTS;
+        ride.startTime = ride.endTime = wallClockUs ();
+        return manifest.append (ride);
+}
+
+/*****************************************************************************/
+
+bool Session::openSegment ()
+{
+        closeSegment ();
+
+        // Called from the encoder callback, so no std::string here.
+        char path[PATH_MAX];
+        snprintf (path, sizeof (path), "%s/%05u.h264", rideDir.c_str (), nextSegment);
+
+        if (!(segmentOpen = writer->open (path))) {
+                return false;
+        }
+
+        std::cerr << "New file : " << path << std::endl;
+
+        if (subs.getFormat () != Subtitles::NONE) {
+                snprintf (path, sizeof (path), "%s/%05u.%s", rideDir.c_str (), nextSegment, subs.extension ());
+                subs.open (path);
+        }
+
+        current.type = ManifestEntry::SEGMENT;
+        current.segment = nextSegment++;
+        current.startPts = current.endPts = UNKNOWN_PTS;
+        current.startTime = current.endTime = wallClockUs ();
+        current.size = 0;
+        current.keyframes = 0;
+        current.telemetryBegin = current.telemetryEnd = log.count ();
+        buffersInSegment = 0;
+        return true;
+}
+
+/*****************************************************************************/
+
+void Session::closeSegment ()
+{
+        if (!segmentOpen) {
+                return;
+        }
+
+        writer->close ();
+        subs.close ();
+        segmentOpen = false;
+
+        current.endTime = wallClockUs ();
+        current.telemetryEnd = log.count ();
+        log.flush ();
+        manifest.append (current);
+}
+
+/*****************************************************************************/
+
+bool Session::write (uint8_t const *data, size_t length, int64_t pts, bool keyframe)
+{
+        if (!segmentOpen) {
+                return false;
+        }
+
+        ++buffersInSegment;
+
+        if (pts != UNKNOWN_PTS) {
+                if (current.startPts == UNKNOWN_PTS) {
+                        current.startPts = pts;
+                }
+
+                current.endPts = pts;
+                subs.timestamp (pts, monotonicUs ());
+        }
+
+        if (keyframe) {
+                ++current.keyframes;
+        }
+
+        if (!length) {
+                return true;
+        }
+
+        return append (data, length, keyframe);
+}
+
+/*****************************************************************************/
+
+bool Session::insert (uint8_t const *data, size_t length)
+{
+        if (!segmentOpen) {
+                return false;
+        }
+
+        return append (data, length, false);
+}
+
+/*****************************************************************************/
+
+bool Session::append (uint8_t const *data, size_t length, bool keyframe)
+{
+        // Whatever the writer dropped is not in the segment.
+        uint64_t dropped = writer->getDropped ();
+        bool ok = writer->write (data, length, keyframe);
+        size_t kept = length - size_t (writer->getDropped () - dropped);
+
+        current.size += kept;
+        bytesWritten.fetch_add (kept, std::memory_order_relaxed);
+        return ok;
+}
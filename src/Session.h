@@ -0,0 +1,142 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <atomic>
+#include "TelemetryLog.h"
+#include "SegmentWriter.h"
+#include "Subtitles.h"
+
+/**
+ * One record of the manifest.
+ */
+struct ManifestEntry {
+
+        enum Type : char { RIDE = 'R', SEGMENT = 'S' };
+
+        Type type = SEGMENT;
+        unsigned int ride = 0;
+        unsigned int segment = 0;
+        int64_t startPts = 0;
+        int64_t endPts = 0;
+        int64_t startTime = 0;          // Wall clock, us since the epoch.
+        int64_t endTime = 0;
+        uint64_t size = 0;              // Bytes.
+        unsigned int keyframes = 0;
+        unsigned int telemetryBegin = 0; // Telemetry log records [begin, end) written while the segment was open.
+        unsigned int telemetryEnd = 0;
+};
+
+/**
+ * Append-only list of rides and closed segments kept in the base directory. All the
+ * records have the same size, so the last one is read with one pread regardless of
+ * how many segments were recorded over the season. A torn record (power cut in the middle
+ * of a write) is truncated away when the manifest is opened.
+ */
+class Manifest {
+public:
+
+        Manifest () {}
+        ~Manifest ();
+
+        bool open (std::string const &path);
+        bool last (ManifestEntry *entry);
+        bool append (ManifestEntry const &entry);
+
+        static const size_t RECORD_SIZE = 160;
+
+private:
+
+        Manifest (Manifest const &) = delete;
+        Manifest &operator= (Manifest const &) = delete;
+
+private:
+
+        int fd = -1;
+};
+
+/**
+ * Ride (one run of the program) layout on the card :
+ *
+ * <base>/manifest
+ * <base>/ride00042/telemetry.log
+ * <base>/ride00042/histogram.csv      (LoadHistogram)
+ * <base>/ride00042/01234.h264
+ * <base>/ride00042/01234.vtt          (Subtitles, if enabled)
+ * <base>/ride00042/01235.h264
+ * <base>/ride00042/live/00000.h264   (LiveStream, if enabled)
+ *
+ * Segment numbers are unique across rides and both counters are resumed from the
+ * manifest tail, so a restart never overwrites the footage of the previous ride. Without
+ * a usable tail they are taken from the ride directories and segment files on the card.
+ */
+class Session {
+public:
+
+        Session (std::string const &baseDir, SegmentWriter *writer) : baseDir (baseDir), writer (writer) {}
+        ~Session ();
+
+        bool start ();
+
+        bool openSegment ();
+        void closeSegment ();
+        bool isOpen () const { return segmentOpen; }
+
+        /**
+         * Appends encoder output to the current segment. Pass UNKNOWN_PTS if the buffer
+         * has no time stamp.
+         */
+        bool write (uint8_t const *data, size_t length, int64_t pts, bool keyframe);
+
+        /**
+         * Appends bytes of our own (SEI NAL units, see Sei.h) to the current segment. Not
+         * counted as an encoder buffer.
+         */
+        bool insert (uint8_t const *data, size_t length);
+
+        unsigned int getRide () const { return current.ride; }
+        unsigned int getSegment () const { return current.segment; }
+        unsigned int getBuffersInSegment () const { return buffersInSegment; }
+        /// All the bytes of all the segments of this ride. Safe to call from any thread.
+        uint64_t getBytesWritten () const { return bytesWritten.load (std::memory_order_relaxed); }
+        std::string const &getRideDir () const { return rideDir; }
+        TelemetryLog &telemetry () { return log; }
+        /// Sidecar of the current segment, written if a format was set. Encoder callback thread only.
+        Subtitles &subtitles () { return subs; }
+        SegmentWriter &getWriter () { return *writer; }
+
+        static const int64_t UNKNOWN_PTS = INT64_MIN;
+
+private:
+
+        Session (Session const &) = delete;
+        Session &operator= (Session const &) = delete;
+
+        bool append (uint8_t const *data, size_t length, bool keyframe);
+
+private:
+
+        std::string baseDir;
+        SegmentWriter *writer;
+        std::string rideDir;
+        Manifest manifest;
+        TelemetryLog log;
+        Subtitles subs;
+        ManifestEntry current;
+        unsigned int nextSegment = 0;
+        unsigned int buffersInSegment = 0;
+        std::atomic <uint64_t> bytesWritten {0};
+        bool segmentOpen = false;
+};
+
+#endif /* SESSION_H_ */
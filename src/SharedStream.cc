@@ -0,0 +1,113 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <new>
+#include "SharedStream.h"
+
+static_assert (ATOMIC_INT_LOCK_FREE == 2, "Shared memory counters have to be lock free");
+
+bool SharedStream::open (const char *n, size_t capacity)
+{
+        close ();
+
+        size_t size = 1;
+
+        while (size < capacity && size < (size_t (1) << 30)) {
+                size <<= 1;
+        }
+
+        int fd = shm_open (n, O_CREAT | O_RDWR, 0644);
+
+        if (fd < 0) {
+                std::cerr << "SharedStream::open : unable to open " << n << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        size_t total = sizeof (Header) + size;
+
+        if (ftruncate (fd, total) < 0) {
+                std::cerr << "SharedStream::open : unable to resize " << n << " : " << strerror (errno) << std::endl;
+                ::close (fd);
+                return false;
+        }
+
+        void *p = mmap (nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close (fd);
+
+        if (p == MAP_FAILED) {
+                std::cerr << "SharedStream::open : unable to map " << n << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        // Readers of a previous run may still have it mapped : magic goes last.
+        header = new (p) Header;
+        header->magic = 0;
+        header->capacity = size;
+        header->written.store (0, std::memory_order_relaxed);
+        header->writing.store (0, std::memory_order_relaxed);
+        header->joinPoint.store (0, std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_release);
+        header->magic = MAGIC;
+
+        data = static_cast <uint8_t *> (p) + sizeof (Header);
+        mapped = total;
+        mask = size - 1;
+        position = 0;
+        strncpy (name, n, sizeof (name) - 1);
+        return true;
+}
+
+/*****************************************************************************/
+
+void SharedStream::close ()
+{
+        if (!header) {
+                return;
+        }
+
+        header->magic = 0;
+        munmap (header, mapped);
+        shm_unlink (name);
+        header = nullptr;
+        data = nullptr;
+}
+
+/*****************************************************************************/
+
+void SharedStream::write (uint8_t const *d, size_t length, bool joinPoint)
+{
+        if (!header || length > mask) {
+                return;
+        }
+
+        uint32_t start = position;
+        position += length;
+
+        // Before the data : a reader copying bytes this overwrites finds out from writing. The
+        // fence is a store barrier (dmb), so no byte of the memcpy gets ahead of the counter.
+        header->writing.store (position, std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_release);
+
+        size_t offset = start & mask;
+        size_t first = std::min (length, size_t (mask) + 1 - offset);
+        memcpy (data + offset, d, first);
+        memcpy (data, d + first, length - first);
+        header->written.store (position, std::memory_order_release);
+
+        // After written : a reader never sees a join point ahead of the data.
+        if (joinPoint) {
+                header->joinPoint.store (start, std::memory_order_release);
+        }
+}
@@ -0,0 +1,77 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SHAREDSTREAM_H_
+#define SHAREDSTREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * H.264 byte stream published in POSIX shared memory (shm_open), for live view on the
+ * bike without touching the card. One writer (us), any number of readers, nobody waits
+ * for anybody : readers which fall behind by more than the capacity lose data.
+ *
+ * Layout : Header, then capacity bytes of data. Stream byte n lives at data[n % capacity].
+ * A reader :
+ *
+ * 1. checks magic, starts at joinPoint (SPS / PPS followed by a key frame), or waits for
+ *    the next one if written - joinPoint is more than capacity already,
+ * 2. loads written (acquire) and copies bytes [position, written) out,
+ * 3. issues an acquire fence, loads writing and checks that writing - position is still
+ *    <= capacity, otherwise a write in progress (or done meanwhile) overwrote a part of
+ *    what it copied : drops the copy and goes back to 1.
+ *
+ * Like a seqlock : the writer publishes writing before it touches the data, and written
+ * after. Checking written in step 3 instead would miss a memcpy still going on.
+ *
+ * Positions are 32 bit and wrap : compare them by subtraction. The counters are 32 bit
+ * atomics because 64 bit ones are not lock free on the Pi 1, and lock based ones do not
+ * work between processes.
+ */
+class SharedStream {
+public:
+
+        struct Header {
+                uint32_t magic;
+                uint32_t capacity;
+                std::atomic <uint32_t> written;   // Stream bytes so far.
+                std::atomic <uint32_t> writing;   // End of the write in progress, written when there is none.
+                std::atomic <uint32_t> joinPoint; // Where the newest SPS / PPS begins.
+        };
+
+        static const uint32_t MAGIC = 0x564c4b42; // "BKLV"
+
+        SharedStream () {}
+        ~SharedStream () { close (); }
+
+        /// name like "/bikecam-live". capacity is rounded up to a power of two.
+        bool open (const char *name, size_t capacity);
+        void close ();
+        bool isOpen () const { return header != nullptr; }
+
+        /// joinPoint : data starts with stream headers a decoder can begin at.
+        void write (uint8_t const *data, size_t length, bool joinPoint);
+
+private:
+
+        SharedStream (SharedStream const &) = delete;
+        SharedStream &operator= (SharedStream const &) = delete;
+
+private:
+
+        Header *header = nullptr;
+        uint8_t *data = nullptr;
+        size_t mapped = 0;
+        uint32_t mask = 0;
+        uint32_t position = 0;
+        char name[64] = {};
+};
+
+#endif /* SHAREDSTREAM_H_ */
@@ -1,4 +1,5 @@
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -8,6 +9,8 @@
 #include <iostream>
 #include <algorithm>
 #include "Shield.h"
+#include "Protocol.h"
+#include "Clock.h"
 
 const char *PORT = "/dev/ttyAMA0";
 
@@ -17,7 +20,12 @@ std::ostream &operator<< (std::ostream &o, Frame const &f)
              " km/h, RPM=" << f.rpm <<
              " rpm, ENGINE=" << f. engineTemp <<
              " \u2103, AIR=" << f.airTemp <<
-             " \u2103, FB=" << f.frontBrake <<
+             " \u2103, ACC=" << f.acceleration <<
+             " m/s2, JERK=" << f.jerk <<
+             " m/s3, DIST=" << f.distance <<
+             " m, BRAKE=" << f.braking <<
+             " g, GEAR=" << unsigned (f.gear) <<
+             ", FB=" << f.frontBrake <<
              ", RB=" << f.rearBrake <<
              ", LEFT=" << f.leftTurn <<
              ", RIGHT=" << f.rightTurn <<
@@ -25,11 +33,82 @@ std::ostream &operator<< (std::ostream &o, Frame const &f)
         return o;
 }
 
-Shield::Shield (std::string const &port)
+static speed_t toSpeed (unsigned int baud)
+{
+        switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 500000: return B500000;
+        case 921600: return B921600;
+        case 1000000: return B1000000;
+        default: return B0;
+        }
+}
+
+Shield::Shield (std::string const &port, unsigned int baud) : port (port), baud (baud), buffer (protocol::MAX_FRAME_SIZE)
 {
 #if 0
         std::cerr << "Shield::Shield : starting serial port communication..." << std::endl;
 #endif
+        reopen ();
+}
+
+Shield::~Shield ()
+{
+        close ();
+}
+
+void Shield::close ()
+{
+        if (ttyFd >= 0) {
+                if (closeHandler) {
+                        closeHandler ();
+                }
+
+                ::close (ttyFd);
+                ttyFd = -1;
+        }
+
+        rxPos = rxLen = 0;
+        txLen = 0; // A half written command would be garbage to the AVR after reopening.
+        resetParser ();
+}
+
+void Shield::resetParser ()
+{
+        buffer.clear ();
+        v1Check.reset ();
+        v2Check.reset ();
+        ackCheck.reset ();
+        sinceFrame = 0;
+        locked = false;
+        version = 0;
+        syncFrames = 0;
+}
+
+bool Shield::reopen ()
+{
+        close ();
+
+        if ((ttyFd = open (port.c_str (), O_RDWR | O_NONBLOCK | O_NOCTTY)) < 0) {
+                return false;
+        }
+
+        if (!configure ()) {
+                close ();
+                return false;
+        }
+
+        return true;
+}
+
+bool Shield::configure ()
+{
         struct termios tio;
 
         memset(&tio, 0, sizeof(tio));
@@ -40,67 +119,265 @@ Shield::Shield (std::string const &port)
         tio.c_cc[VMIN] = 1;
         tio.c_cc[VTIME] = 2;
 
-        ttyFd = open(PORT, O_RDONLY | O_SYNC);
-        cfsetispeed(&tio, B38400);
+        speed_t speed = toSpeed (baud);
 
-        tcsetattr(ttyFd, TCSANOW, &tio);
+        if (speed == B0) {
+                return false;
+        }
+
+        cfsetispeed (&tio, speed);
+        cfsetospeed (&tio, speed);
+
+        // Bytes received at the previous rate are garbage.
+        return tcsetattr (ttyFd, TCSANOW, &tio) == 0 && tcflush (ttyFd, TCIFLUSH) == 0;
 }
 
-Shield::~Shield ()
+bool Shield::setBaud (unsigned int b)
 {
-        close(ttyFd);
+        if (toSpeed (b) == B0) {
+                return false;
+        }
+
+        baud = b;
+        rxPos = rxLen = 0;
+        resetParser ();
+        return ttyFd < 0 || configure ();
 }
 
-Frame Shield::read ()
+bool Shield::send (uint8_t const *data, size_t length)
 {
-        uint8_t c;
-        boost::circular_buffer<uint8_t> buffer (FRAME_SIZE);
-        Frame frame;
+        if (TX_SIZE - txLen < length) {
+                return false;
+        }
 
-        do {
-                if (::read (ttyFd, &c, 1) > 0) {
-                        buffer.push_back (c);
+        memcpy (tx + txLen, data, length);
+        txLen += length;
+        flush ();
+        return true;
+}
+
+void Shield::flush ()
+{
+        if (ttyFd < 0 || !txLen) {
+                return;
+        }
+
+        ssize_t r = ::write (ttyFd, tx, txLen);
+
+        if (r <= 0) {
+                // EAGAIN : tty buffer full, next flush (). Errors show up on the reading side.
+                return;
+        }
+
+        txLen -= r;
+        memmove (tx, tx + r, txLen);
+}
+
+bool Shield::read (Frame &frame)
+{
+        while (true) {
+                if (rxPos == rxLen) {
+                        ssize_t r = (ttyFd >= 0) ? ::read (ttyFd, rx, RX_SIZE) : -1;
+
+                        if (r < 0 && errno == EAGAIN) {
+                                return false;
+                        }
+
+                        if (r <= 0) {
+                                // Hang up or I/O error (e.g. the adapter is gone).
+                                close ();
+                                return false;
+                        }
+
+                        rxPos = 0;
+                        rxLen = r;
+                        stats.bytes += r;
+                }
+
+                if (scan (rx[rxPos++], frame)) {
+                        ++stats.frames;
+                        return true;
                 }
         }
-        while (!validateBuffer (buffer));
+}
 
-        frame.velocity = ((buffer[BUF_VELOCITY_MSB] << 8) | (buffer[BUF_VELOCITY_LSB])) * VELOCITY_FACTOR;
-        frame.rpm = buffer[BUF_RPM] * RPM_FACTOR;
-        frame.engineTemp = computeTemp (buffer[BUF_ENGINE_TEMP]);
-        frame.airTemp = buffer[BUF_AIR_TEMP];
-        frame.frontBrake = buffer[BUF_GPIO] & (1 << GPIO_FRONT_BRAKE);
-        frame.rearBrake = buffer[BUF_GPIO] & (1 << GPIO_REAR_BRAKE);
-        frame.leftTurn = buffer[BUF_GPIO] & (1 << GPIO_LEFT_TURN);
-        frame.rightTurn = buffer[BUF_GPIO] & (1 << GPIO_RIGHT_TURN);
-        frame.parkingLight = buffer[BUF_GPIO] & (1 << GPIO_PARKING_LIGHT);
+/**
+ * True if b is the check byte of a frame of the Layout, i.e. the start byte is at the right
+ * distance back and b matches the rolling check of the bytes in between.
+ */
+template <typename Layout>
+bool Shield::endsFrame (typename Layout::Rolling const &check, uint8_t b) const
+{
+        size_t n = buffer.size ();
+        return n >= Layout::SIZE - 1 && buffer[n - (Layout::SIZE - 1)] == Layout::COMMAND && check.get () == b;
+}
 
-        return frame;
+/**
+ * Feeds one byte to the parser. In sync (the previous byte ended a frame) only the frame
+ * which starts right after the previous one is checked, so data inside a frame is never
+ * mistaken for another one. Out of sync, every byte is checked as a possible end of a v2,
+ * then a v1 frame. The checks roll along the stream, so this is O(1) per byte whatever
+ * the amount of garbage.
+ */
+bool Shield::endsFrame (uint8_t start, uint8_t b) const
+{
+        switch (start) {
+        case protocol::V1::COMMAND: return endsFrame <protocol::V1> (v1Check, b);
+        case protocol::V2::COMMAND: return endsFrame <protocol::V2> (v2Check, b);
+        case protocol::Ack::COMMAND: return endsFrame <protocol::Ack> (ackCheck, b);
+        default: return false;
+        }
 }
 
-bool Shield::validateBuffer (InputData const &d)
+bool Shield::scan (uint8_t b, Frame &frame)
 {
-#if 0
-        std::cerr << "Shield::validateBuffer ";
+        size_t n = buffer.size ();
+        size_t size = 0;
 
-        for (uint8_t b : d) {
-                std::cerr << std::hex << (int)b << ", ";
+        if (locked) {
+                uint8_t start = (n) ? buffer[0] : b;
+                size_t expected = frameSize (start);
+
+                if (!expected) {
+                        locked = false;
+                }
+                else if (n + 1 < expected) {
+                        push (b);
+                        return false;
+                }
+                else if (endsFrame (start, b)) {
+                        size = expected;
+                }
+                else {
+                        ++stats.checksumErrors;
+                        locked = false;
+                }
         }
 
-        std::cerr << "F=" << d.full () << ", FR=" << std::hex << (int)d.front ();
+        if (!locked) {
+                if (endsFrame <protocol::V2> (v2Check, b)) {
+                        size = protocol::V2::SIZE;
+                }
+                else if (endsFrame <protocol::V1> (v1Check, b)) {
+                        size = protocol::V1::SIZE;
+                }
+                else if (endsFrame <protocol::Ack> (ackCheck, b)) {
+                        size = protocol::Ack::SIZE;
+                }
+        }
 
-        if (d.full ()) {
-                std::cerr << ", AC=" << std::accumulate (d.begin () + 1, d.end () - 1, 0) << ", B=" << std::hex << (int)d.back ();
+        if (!size) {
+                push (b);
+                return false;
         }
 
-        std::cerr << std::endl;
-#endif
+        uint8_t data[protocol::MAX_FRAME_SIZE];
+        std::copy (buffer.end () - (size - 1), buffer.end (), data);
+        data[size - 1] = b;
+
+        if (sinceFrame > size - 1) {
+                uint32_t skipped = sinceFrame - (size - 1);
+                stats.discardedBytes += skipped;
+                resyncBytes.add (skipped);
+        }
+
+        buffer.clear ();
+        v1Check.reset ();
+        v2Check.reset ();
+        ackCheck.reset ();
+        sinceFrame = 0;
+        locked = true;
+
+        if (data[0] == protocol::Ack::COMMAND) {
+                if (ackHandler) {
+                        ackHandler (data[1], data[2]);
+                }
+
+                return false;
+        }
+
+        decode (data, frame);
+        return true;
+}
 
-        // Computer sum of buffer bytes ommiting the first and last ones (COMMAND, and checksum respectively).
-        return d.full () && d.front () == SHIELD_COMMAND_BYTE & static_cast <uint8_t> (std::accumulate (d.begin () + 1, d.end () - 1, 0)) == d.back ();
+void Shield::push (uint8_t b)
+{
+        size_t n = buffer.size ();
+        v1Check.push (b, (n >= protocol::V1::DATA_SIZE) ? buffer[n - protocol::V1::DATA_SIZE] : 0);
+        v2Check.push (b, (n >= protocol::V2::DATA_SIZE) ? buffer[n - protocol::V2::DATA_SIZE] : 0);
+        ackCheck.push (b, (n >= protocol::Ack::DATA_SIZE) ? buffer[n - protocol::Ack::DATA_SIZE] : 0);
+        buffer.push_back (b);
+        ++sinceFrame;
 }
 
-float Shield::computeTemp (uint8_t temp)
+size_t Shield::frameSize (uint8_t command) const
 {
-        // Empirical equation. Found by my wife with excel.
-        return 0.95515 * temp - 25.724;
+        switch (command) {
+        case protocol::V1::COMMAND: return protocol::V1::SIZE;
+        case protocol::V2::COMMAND: return protocol::V2::SIZE;
+        case protocol::Ack::COMMAND: return protocol::Ack::SIZE;
+        default: return 0;
+        }
+}
+
+void Shield::decode (uint8_t const *data, Frame &frame)
+{
+        frame.timestamp = monotonicUs ();
+
+        if (data[0] == protocol::V1::COMMAND) {
+                protocol::V1::decode (data, frame, calibration);
+                frame.version = version = 1;
+                frame.sequence = 0;
+                frame.tick = 0;
+                frame.sampleTime = frame.timestamp;
+                return;
+        }
+
+        protocol::V2::decode (data, frame, calibration);
+        frame.sampleTime = sampleTime (frame.timestamp, frame.tick);
+
+        if (version == 2) {
+                stats.lostFrames += uint8_t (frame.sequence - lastSequence - 1);
+        }
+
+        lastSequence = frame.sequence;
+        frame.version = version = 2;
+}
+
+/**
+ * Maps the 16 bit AVR tick of a sample onto our monotonic clock. The tick is first extended
+ * to 64 bits, then shifted by an offset which is the lowest (reception - tick) seen, i.e. the
+ * one with the least transmission and scheduling delay. The minimum is taken over windows of
+ * SYNC_WINDOW frames, so drift between the two crystals does not accumulate.
+ */
+uint64_t Shield::sampleTime (uint64_t received, uint16_t tick)
+{
+        // After a gap of half the tick period the unwrapped time is ambiguous, start over.
+        if (syncFrames && received - lastReceived >= protocol::TICK_WRAP_US / 2) {
+                syncFrames = 0;
+        }
+
+        if (!syncFrames) {
+                ticks = tick;
+                offset = windowMin = received - ticks * protocol::TICK_US;
+        }
+        else {
+                ticks += uint16_t (tick - lastTick);
+        }
+
+        lastTick = tick;
+        lastReceived = received;
+
+        uint64_t tickUs = ticks * protocol::TICK_US;
+        uint64_t candidate = received - tickUs;
+
+        windowMin = std::min (windowMin, candidate);
+        offset = std::min (offset, candidate);
+
+        if (++syncFrames % SYNC_WINDOW == 0) {
+                offset = windowMin;
+                windowMin = candidate;
+        }
+
+        return offset + tickUs;
 }
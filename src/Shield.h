@@ -9,67 +9,140 @@
 #ifndef SHIELD_H_
 #define SHIELD_H_
 
-#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <functional>
 #include <boost/circular_buffer.hpp>
+#include "Frame.h"
+#include "Protocol.h"
+#include "Stats.h"
 
 extern const char *PORT;
 
 /**
- * Data frame from AVR shield.
+ * Counters of the serial link, since the program started.
  */
-struct Frame {
-        float velocity = 0;
-        float rpm = 0;
-        float engineTemp = 0;
-        float airTemp = 0;
-        bool frontBrake = false;
-        bool rearBrake = false;
-        bool leftTurn = false;
-        bool rightTurn = false;
-        bool parkingLight = false;
+struct LinkStats {
+        uint64_t bytes = 0;          // Received.
+        uint64_t frames = 0;         // Valid ones.
+        uint64_t checksumErrors = 0; // Frames with the right start byte and a wrong checksum.
+        uint64_t discardedBytes = 0; // Skipped while looking for a frame boundary.
+        uint64_t lostFrames = 0;     // Gaps in v2 sequence numbers.
 };
 
-extern std::ostream &operator<< (std::ostream &o, Frame const &f);
-
 /**
- * AVR shield on top of the RasPI.
+ * AVR shield on top of the RasPI. Two protocols are understood, told apart by the start
+ * (command) byte of each frame, so the firmware can be upgraded without touching the Pi.
+ * See Protocol.h for the layouts. v2 is meant for baud rates up to 1M.
  */
 class Shield {
 public:
 
-        Shield (std::string const &port);
+        Shield (std::string const &port, unsigned int baud = DEFAULT_BAUD);
         virtual ~Shield ();
 
-        Frame read ();
+        /// Closes and opens the port again, at the current baud rate. Discards partial frames.
+        bool reopen ();
+        void close ();
+        bool isOpen () const { return ttyFd >= 0; }
+
+        /// Changes the baud rate of the open port. False if the rate is not supported.
+        bool setBaud (unsigned int baud);
+        unsigned int getBaud () const { return baud; }
+
+        LinkStats const &getStats () const { return stats; }
+
+        /// Bytes skipped before each frame found out of sync.
+        LatencyStats const &getResyncBytes () const { return resyncBytes; }
+
+        /// Of the last frame, 0 if none since the port was (re)opened.
+        int getVersion () const { return version; }
+
+        /**
+         * Non-blocking : parses whatever the tty has buffered and returns true as soon as a
+         * complete frame is found. False means no more data for now, wait for EPOLLIN on fd ()
+         * and call again. Bytes read past the frame are kept for the next call. A read error
+         * or a hang up closes the port, isOpen () tells.
+         */
+        bool read (Frame &frame);
+
+        int fd () const { return ttyFd; }
+
+        /**
+         * Queues bytes for the AVR and writes as much as the tty takes right away, never
+         * blocking. The rest goes out with the following flush () calls. False if the queue
+         * is full. Commands are tiny compared to the tty buffer, so this is the rare case.
+         */
+        bool send (uint8_t const *data, size_t length);
+        void flush ();
+
+        typedef std::function <void (uint8_t sequence, uint8_t status)> AckHandler;
+
+        /// Acks are consumed by read (), they are not frames.
+        void onAck (AckHandler const &handler) { ackHandler = handler; }
+
+        /**
+         * Called with the descriptor still open, right before the port closes (close (),
+         * reopen (), or a read error), so whoever polls fd () can stop watching it before the
+         * number gets reused.
+         */
+        void onClose (std::function <void ()> const &handler) { closeHandler = handler; }
+
+        /// Tables the following frames are decoded with. Defaults until called.
+        void setCalibration (Calibration const &c) { calibration = c; }
 
 private:
 
         typedef boost::circular_buffer<uint8_t> InputData;
-        bool validateBuffer (InputData const &d);
-        float computeTemp (uint8_t temp);
+        bool scan (uint8_t b, Frame &frame);
+        bool endsFrame (uint8_t start, uint8_t b) const;
+        void push (uint8_t b);
+        template <typename Layout> bool endsFrame (typename Layout::Rolling const &check, uint8_t b) const;
+        void resetParser ();
+        size_t frameSize (uint8_t command) const;
+        void decode (uint8_t const *data, Frame &frame);
+        uint64_t sampleTime (uint64_t received, uint16_t tick);
+        bool configure ();
 
 private:
 
-        int ttyFd = 0;
-        const unsigned int FRAME_SIZE = 8; // Start (command) byte, 6 data bytes and 1 checksum byte.
-
-        const unsigned int BUF_VELOCITY_MSB = 1;
-        const unsigned int BUF_VELOCITY_LSB = 2;
-        const unsigned int BUF_RPM = 3;
-        const unsigned int BUF_ENGINE_TEMP = 4;
-        const unsigned int BUF_GPIO = 5;
-        const unsigned int BUF_AIR_TEMP = 6;
-
-        const unsigned int GPIO_LEFT_TURN = 0;
-        const unsigned int GPIO_RIGHT_TURN = 1;
-        const unsigned int GPIO_FRONT_BRAKE = 2;
-        const unsigned int GPIO_REAR_BRAKE = 3;
-        const unsigned int GPIO_PARKING_LIGHT = 4;
-
-        const float ENGINE_TEMP_FACTOR = 0.5;
-        const float RPM_FACTOR = 50;
-        const float VELOCITY_FACTOR = 0.4; // Found empirically
-        const uint8_t SHIELD_COMMAND_BYTE = 0x01;
+        std::string port;
+        unsigned int baud;
+        int ttyFd = -1;
+        LinkStats stats;
+        InputData buffer; // Bytes since the last frame, at most one frame of them. Allocated once.
+        protocol::V1::Rolling v1Check;
+        protocol::V2::Rolling v2Check;
+        protocol::Ack::Rolling ackCheck;
+        AckHandler ackHandler;
+        std::function <void ()> closeHandler;
+        Calibration calibration;
+        static const size_t TX_SIZE = 256;
+        uint8_t tx[TX_SIZE];
+        size_t txLen = 0;
+        size_t sinceFrame = 0;
+        bool locked = false;
+        LatencyStats resyncBytes;
+        static const size_t RX_SIZE = 64;
+        uint8_t rx[RX_SIZE];
+        size_t rxPos = 0;
+        size_t rxLen = 0;
+        int version = 0;
+        uint8_t lastSequence = 0;
+
+        // AVR tick to monotonicUs () mapping, see sampleTime ().
+        unsigned int syncFrames = 0;
+        uint16_t lastTick = 0;
+        uint64_t ticks = 0;
+        uint64_t lastReceived = 0;
+        uint64_t offset = 0;
+        uint64_t windowMin = 0;
+
+        const unsigned int SYNC_WINDOW = 256;
+
+public:
+
+        static const unsigned int DEFAULT_BAUD = 38400;
 };
 
 #endif /* SHIELD_H_ */
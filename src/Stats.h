@@ -0,0 +1,120 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+
+/**
+ * Lock-free latency histogram. Buckets are powers of two split into 4 linear sub-buckets,
+ * so percentiles are accurate to 25% of the value, which is plenty for telling a 200 us
+ * write from a 200 ms stall. One thread may add while others read.
+ */
+class LatencyStats {
+public:
+
+        LatencyStats () { reset (); }
+
+        void add (uint32_t us)
+        {
+                buckets[bucket (us)].fetch_add (1, std::memory_order_relaxed);
+                samples.fetch_add (1, std::memory_order_relaxed);
+                total.fetch_add (us, std::memory_order_relaxed);
+
+                uint32_t m = maximum.load (std::memory_order_relaxed);
+                while (us > m && !maximum.compare_exchange_weak (m, us, std::memory_order_relaxed)) {
+                }
+        }
+
+        void reset ()
+        {
+                for (unsigned int i = 0; i < BUCKETS; ++i) {
+                        buckets[i].store (0, std::memory_order_relaxed);
+                }
+
+                samples.store (0, std::memory_order_relaxed);
+                total.store (0, std::memory_order_relaxed);
+                maximum.store (0, std::memory_order_relaxed);
+        }
+
+        uint32_t count () const { return samples.load (std::memory_order_relaxed); }
+        uint32_t max () const { return maximum.load (std::memory_order_relaxed); }
+        uint32_t mean () const { uint32_t n = count (); return (n) ? uint32_t (total.load (std::memory_order_relaxed) / n) : 0; }
+
+        /**
+         * Upper bound of the bucket containing the p-th percentile (p in 0..1).
+         */
+        uint32_t percentile (double p) const
+        {
+                uint32_t n = count ();
+
+                if (!n) {
+                        return 0;
+                }
+
+                uint64_t rank = uint64_t (p * n);
+                uint64_t acc = 0;
+
+                for (unsigned int i = 0; i < BUCKETS; ++i) {
+                        acc += buckets[i].load (std::memory_order_relaxed);
+
+                        if (acc > rank) {
+                                uint32_t m = max ();
+                                return (upperBound (i) < m) ? upperBound (i) : m;
+                        }
+                }
+
+                return max ();
+        }
+
+        void print (FILE *f, const char *name) const
+        {
+                fprintf (f, "%s : n=%u, mean=%u us, p50=%u us, p99=%u us, max=%u us\n",
+                         name, count (), mean (), percentile (0.5), percentile (0.99), max ());
+        }
+
+private:
+
+        static const unsigned int SUB_BITS = 2;
+        static const unsigned int BUCKETS = (32 - SUB_BITS + 1) << SUB_BITS;
+
+        static unsigned int bucket (uint32_t v)
+        {
+                if (v < (1u << SUB_BITS)) {
+                        return v;
+                }
+
+                unsigned int msb = 31 - __builtin_clz (v);
+                unsigned int sub = (v >> (msb - SUB_BITS)) & ((1u << SUB_BITS) - 1);
+                return ((msb - SUB_BITS + 1) << SUB_BITS) + sub;
+        }
+
+        static uint32_t upperBound (unsigned int b)
+        {
+                if (b < (1u << SUB_BITS)) {
+                        return b;
+                }
+
+                unsigned int msb = (b >> SUB_BITS) + SUB_BITS - 1;
+                uint64_t sub = b & ((1u << SUB_BITS) - 1);
+                uint64_t v = (uint64_t (1) << msb) + ((sub + 1) << (msb - SUB_BITS)) - 1;
+                return (v > UINT32_MAX) ? UINT32_MAX : uint32_t (v);
+        }
+
+private:
+
+        std::atomic <uint32_t> buckets[BUCKETS];
+        std::atomic <uint32_t> samples;
+        std::atomic <uint64_t> total;
+        std::atomic <uint32_t> maximum;
+};
+
+#endif /* STATS_H_ */
@@ -0,0 +1,216 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <iostream>
+#include "Subtitles.h"
+
+Subtitles::~Subtitles ()
+{
+        close ();
+}
+
+/*****************************************************************************/
+
+bool Subtitles::parseFormat (const char *name, Format *format)
+{
+        if (!strcmp (name, "srt")) {
+                *format = SRT;
+                return true;
+        }
+
+        if (!strcmp (name, "vtt")) {
+                *format = WEBVTT;
+                return true;
+        }
+
+        return false;
+}
+
+/*****************************************************************************/
+
+bool Subtitles::open (const char *path)
+{
+        close ();
+
+        if ((fd = ::open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+                std::cerr << "Subtitles::open : unable to open " << path << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        cues = 0;
+        startPts = UNKNOWN;
+        offset = currentOffset;
+        currentOffset = UNKNOWN;
+
+        if (format == WEBVTT) {
+                print ("WEBVTT\n\n");
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+void Subtitles::close ()
+{
+        if (fd < 0) {
+                return;
+        }
+
+        // The cue goes on in the next segment, from its start.
+        if (pending) {
+                emit (std::max (lastSample, cueStart + MIN_CUE_US));
+        }
+
+        flush ();
+        ::close (fd);
+        fd = -1;
+}
+
+/*****************************************************************************/
+
+void Subtitles::timestamp (int64_t pts, uint64_t arrival)
+{
+        int64_t d = int64_t (arrival) - pts;
+
+        if (startPts == UNKNOWN) {
+                startPts = pts;
+        }
+
+        currentOffset = std::min (currentOffset, d);
+        offset = std::min (offset, d);
+}
+
+/*****************************************************************************/
+
+void Subtitles::describe (Frame const &f, char *out, size_t size) const
+{
+        snprintf (out, size, "%ld km/h  %ld rpm\nE %ld°C  A %ld°C  G%c%s%s%s%s",
+                  lrintf (f.velocity),
+                  lrintf (f.rpm / 100) * 100,
+                  lrintf (f.engineTemp),
+                  lrintf (f.airTemp),
+                  (f.gear) ? char ('0' + f.gear) : '-',
+                  (f.leftTurn) ? "  left" : "",
+                  (f.rightTurn) ? "  right" : "",
+                  (f.frontBrake || f.rearBrake) ? "  brake" : "",
+                  (f.parkingLight) ? "  park" : "");
+}
+
+/*****************************************************************************/
+
+void Subtitles::add (Frame const &f)
+{
+        if (format == NONE) {
+                return;
+        }
+
+        char current[TEXT_SIZE];
+        describe (f, current, sizeof (current));
+
+        // Shield data stopped for a while, the cue ends with the last sample.
+        if (pending && f.sampleTime - lastSample > MAX_GAP_US) {
+                emit (lastSample);
+                pending = false;
+        }
+
+        lastSample = f.sampleTime;
+
+        if (pending && !strcmp (current, text)) {
+                return;
+        }
+
+        if (pending && f.sampleTime - cueStart < MIN_CUE_US) {
+                strcpy (text, current);
+                return;
+        }
+
+        if (pending) {
+                emit (f.sampleTime);
+        }
+
+        pending = true;
+        cueStart = f.sampleTime;
+        strcpy (text, current);
+}
+
+/*****************************************************************************/
+
+void Subtitles::emit (uint64_t end)
+{
+        if (fd < 0 || startPts == UNKNOWN || offset == UNKNOWN) {
+                return;
+        }
+
+        // Monotonic time of the first frame of the segment.
+        int64_t base = offset + startPts;
+        int64_t from = std::max (int64_t (cueStart), base) - base;
+        int64_t to = int64_t (end) - base;
+
+        if (to <= from) {
+                return;
+        }
+
+        char separator = (format == SRT) ? ',' : '.';
+        from /= 1000;
+        to /= 1000;
+
+        if (format == SRT) {
+                print ("%u\n", ++cues);
+        }
+
+        print ("%02ld:%02ld:%02ld%c%03ld --> %02ld:%02ld:%02ld%c%03ld\n%s\n\n",
+               long (from / 3600000), long (from / 60000 % 60), long (from / 1000 % 60), separator, long (from % 1000),
+               long (to / 3600000), long (to / 60000 % 60), long (to / 1000 % 60), separator, long (to % 1000),
+               text);
+}
+
+/*****************************************************************************/
+
+void Subtitles::print (const char *format, ...)
+{
+        if (BUFFER_SIZE - used < MAX_CUE) {
+                flush ();
+        }
+
+        va_list args;
+        va_start (args, format);
+        int n = vsnprintf (buffer + used, MAX_CUE, format, args);
+        va_end (args);
+
+        if (n > 0) {
+                used += std::min (size_t (n), MAX_CUE - 1);
+        }
+}
+
+/*****************************************************************************/
+
+void Subtitles::flush ()
+{
+        size_t done = 0;
+
+        while (fd >= 0 && done < used) {
+                ssize_t n = ::write (fd, buffer + done, used - done);
+
+                if (n <= 0) {
+                        break;
+                }
+
+                done += n;
+        }
+
+        used = 0;
+}
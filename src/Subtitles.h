@@ -0,0 +1,99 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SUBTITLES_H_
+#define SUBTITLES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Frame.h"
+
+/**
+ * Subtitle sidecar of a segment (SRT or WebVTT), so any player shows the telemetry next to
+ * the footage :
+ *
+ *   00:00:01.200 --> 00:00:01.800
+ *   87 km/h  6400 rpm
+ *   E 92°C  A 21°C  G4  left brake
+ *
+ * Written as the samples come : a cue lasts as long as its text stays the same, and text
+ * changing again within MIN_CUE_US just replaces the one of the pending cue, so a
+ * wobbling reading doesn't make a cue per sample.
+ *
+ * Times are relative to the first PTS of the segment. Samples are stamped with the
+ * monotonic clock and the PTS come from the camera clock, so timestamp () gets both for
+ * every encoder buffer : the smallest difference (arrival - PTS) over the current and
+ * previous segment maps one onto the other, with the encoder latency jitter filtered out
+ * and the drift between the clocks followed.
+ *
+ * Formatted into a buffer which is a part of the object, like TelemetryLog. Runs in the
+ * encoder callback thread.
+ */
+class Subtitles {
+public:
+
+        enum Format { NONE, SRT, WEBVTT };
+
+        Subtitles () {}
+        ~Subtitles ();
+
+        /// "srt" or "vtt".
+        static bool parseFormat (const char *name, Format *format);
+
+        void setFormat (Format f) { format = f; }
+        Format getFormat () const { return format; }
+        /// File name extension for the format, without the dot.
+        const char *extension () const { return (format == SRT) ? "srt" : "vtt"; }
+
+        bool open (const char *path);
+        /// Writes the pending cue out.
+        void close ();
+
+        /// Encoder buffer with a known PTS, which arrived at monotonic time arrival.
+        void timestamp (int64_t pts, uint64_t arrival);
+
+        void add (Frame const &f);
+
+private:
+
+        Subtitles (Subtitles const &) = delete;
+        Subtitles &operator= (Subtitles const &) = delete;
+
+        /// Cue text of a sample.
+        void describe (Frame const &f, char *text, size_t size) const;
+        void emit (uint64_t end);
+        void print (const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+        void flush ();
+
+private:
+
+        static const uint64_t MIN_CUE_US = 200000;
+        static const uint64_t MAX_GAP_US = 1000000;
+        static const size_t TEXT_SIZE = 128;
+        static const size_t MAX_CUE = 256;
+        static const size_t BUFFER_SIZE = 4096;
+        static const int64_t UNKNOWN = INT64_MAX;
+
+        Format format = NONE;
+        int fd = -1;
+        unsigned int cues = 0;
+
+        int64_t startPts = UNKNOWN;
+        int64_t offset = UNKNOWN;        // arrival - PTS, both segments.
+        int64_t currentOffset = UNKNOWN; // This segment only.
+
+        bool pending = false;
+        uint64_t cueStart = 0;  // Monotonic.
+        uint64_t lastSample = 0;
+        char text[TEXT_SIZE];
+
+        size_t used = 0;
+        char buffer[BUFFER_SIZE];
+};
+
+#endif /* SUBTITLES_H_ */
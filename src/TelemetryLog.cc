@@ -0,0 +1,183 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <iostream>
+#include "TelemetryLog.h"
+#include "Clock.h"
+
+TelemetryLog::~TelemetryLog ()
+{
+        close ();
+}
+
+/*****************************************************************************/
+
+bool TelemetryLog::open (const char *path)
+{
+        close ();
+        std::lock_guard <std::mutex> lock (mutex);
+
+        if ((fd = ::open (path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+                std::cerr << "TelemetryLog::open : unable to open " << path << " : " << strerror (errno) << std::endl;
+                return false;
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+void TelemetryLog::close ()
+{
+        std::lock_guard <std::mutex> lock (mutex);
+
+        if (fd >= 0) {
+                flushLocked ();
+                ::close (fd);
+                fd = -1;
+        }
+}
+
+/*****************************************************************************/
+
+void TelemetryLog::flush ()
+{
+        std::lock_guard <std::mutex> lock (mutex);
+        flushLocked ();
+}
+
+/*****************************************************************************/
+
+void TelemetryLog::flushLocked ()
+{
+        size_t done = 0;
+
+        while (fd >= 0 && done < used) {
+                ssize_t n = ::write (fd, buffer + done, used - done);
+
+                if (n <= 0) {
+                        break;
+                }
+
+                done += n;
+        }
+
+        used = 0;
+}
+
+/*****************************************************************************/
+
+bool TelemetryLog::reserve ()
+{
+        if (fd < 0) {
+                return false;
+        }
+
+        if (BUFFER_SIZE - used < MAX_RECORD) {
+                flushLocked ();
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+void TelemetryLog::log (Frame const &f)
+{
+        std::lock_guard <std::mutex> lock (mutex);
+
+        if (!reserve ()) {
+                return;
+        }
+
+        int n = snprintf (buffer + used, MAX_RECORD, "%u %" PRIu64 " F %.1f %.0f %.1f %.1f %d %d %d %d %d %.2f %.1f %.1f %.2f %u\n",
+                          records++,
+                          f.sampleTime,
+                          f.velocity,
+                          f.rpm,
+                          f.engineTemp,
+                          f.airTemp,
+                          f.frontBrake,
+                          f.rearBrake,
+                          f.leftTurn,
+                          f.rightTurn,
+                          f.parkingLight,
+                          f.acceleration,
+                          f.jerk,
+                          f.distance,
+                          f.braking,
+                          unsigned (f.gear));
+
+        if (n > 0) {
+                used += std::min (size_t (n), MAX_RECORD - 1);
+        }
+}
+
+/*****************************************************************************/
+
+void TelemetryLog::log (Motion const &m)
+{
+        std::lock_guard <std::mutex> lock (mutex);
+
+        if (!reserve ()) {
+                return;
+        }
+
+        // pts, magnitude, moving fraction, dominant direction, direction histogram, regions.
+        int n = snprintf (buffer + used, MAX_RECORD, "%u %" PRIu64 " M %" PRId64 " %.2f %.3f %u %u,%u,%u,%u,%u,%u,%u,%u %.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+                          records++,
+                          monotonicUs (),
+                          m.pts,
+                          m.magnitude,
+                          m.moving,
+                          unsigned (m.direction),
+                          m.histogram[0], m.histogram[1], m.histogram[2], m.histogram[3],
+                          m.histogram[4], m.histogram[5], m.histogram[6], m.histogram[7],
+                          m.regions[0], m.regions[1], m.regions[2],
+                          m.regions[3], m.regions[4], m.regions[5],
+                          m.regions[6], m.regions[7], m.regions[8]);
+
+        if (n > 0) {
+                used += std::min (size_t (n), MAX_RECORD - 1);
+        }
+}
+
+/*****************************************************************************/
+
+void TelemetryLog::event (const char *format, ...)
+{
+        std::lock_guard <std::mutex> lock (mutex);
+
+        if (!reserve ()) {
+                return;
+        }
+
+        int n = snprintf (buffer + used, MAX_RECORD, "%u %" PRIu64 " E ", records++, monotonicUs ());
+
+        if (n <= 0 || size_t (n) >= MAX_RECORD - 1) {
+                return;
+        }
+
+        va_list args;
+        va_start (args, format);
+        int m = vsnprintf (buffer + used + n, MAX_RECORD - 1 - n, format, args);
+        va_end (args);
+
+        // Truncated events still end with a new line.
+        n += (m < 0) ? 0 : std::min (size_t (m), MAX_RECORD - 2 - n);
+        buffer[used + n] = '\n';
+        used += n + 1;
+}
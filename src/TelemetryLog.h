@@ -0,0 +1,66 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef TELEMETRYLOG_H_
+#define TELEMETRYLOG_H_
+
+#include <stddef.h>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include "Shield.h"
+#include "MotionAnalyzer.h"
+
+/**
+ * Append-only, line oriented log of everything the shield sent us during a ride, plus
+ * events from the rest of the program. Every line starts with a record (block) number,
+ * so a segment can refer to the telemetry recorded alongside it by a [begin, end) range.
+ *
+ * Records are formatted straight into a buffer which is a part of the object and written
+ * out with write(2) when it fills up, so logging never touches the heap.
+ */
+class TelemetryLog {
+public:
+
+        TelemetryLog () {}
+        ~TelemetryLog ();
+
+        bool open (const char *path);
+        void close ();
+        void flush ();
+
+        void log (Frame const &f);
+        /// M record, time is when the vectors arrived.
+        void log (Motion const &m);
+        void event (const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+        /// Number of records written so far, i.e. number of the next record.
+        unsigned int count () const { return records.load (std::memory_order_relaxed); }
+
+private:
+
+        TelemetryLog (TelemetryLog const &) = delete;
+        TelemetryLog &operator= (TelemetryLog const &) = delete;
+
+        /// Makes room for one record. Call with the mutex held.
+        bool reserve ();
+        void flushLocked ();
+
+private:
+
+        static const size_t BUFFER_SIZE = 16384;
+        static const size_t MAX_RECORD = 512;
+
+        int fd = -1;
+        std::atomic <unsigned int> records {0};
+        size_t used = 0;
+        char buffer[BUFFER_SIZE];
+        std::mutex mutex;
+};
+
+#endif /* TELEMETRYLOG_H_ */
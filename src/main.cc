@@ -54,6 +54,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <string.h>
 #include <memory.h>
+#include <inttypes.h>
 
 #define VERSION_STRING "v1.1"
 
@@ -73,12 +74,41 @@ extern "C" {
 };
 
 #include "Shield.h"
+#include "Calibration.h"
+#include "Session.h"
+#include "BitrateController.h"
+#include "ParkingMonitor.h"
+#include "Clock.h"
+#include "AllocationTracker.h"
+#include "Realtime.h"
+#include "EventLoop.h"
+#include "LinkMonitor.h"
+#include "CommandChannel.h"
+#include "Decimator.h"
+#include "DerivedMetrics.h"
+#include "RollingStats.h"
+#include "GearEstimator.h"
+#include "LoadHistogram.h"
+#include "RuleEngine.h"
+#include "Overlay.h"
+#include "Sei.h"
+#include "MotionAnalyzer.h"
+#include "MotionDetector.h"
+#include "PreEventRing.h"
+#include "LiveStream.h"
+#include <iostream>
+#include <memory>
 #include <boost/lockfree/spsc_queue.hpp>
 #include <boost/lockfree/queue.hpp>
 #include <thread>
 //#include <boost/filesystem.hpp>
 
-typedef boost::lockfree::spsc_queue <Frame, boost::lockfree::capacity <10>> Queue;
+/// Fastest shield rate (protocol v2), and how long the camera takes to the first encoder buffer, with a margin.
+const unsigned int MAX_SHIELD_HZ = 1000;
+const unsigned int STARTUP_WINDOW_MS = 4000;
+
+/// Shield ingest starts before the camera, so the queue holds all the frames of the startup window.
+typedef boost::lockfree::spsc_queue <Frame, boost::lockfree::capacity <MAX_SHIELD_HZ * STARTUP_WINDOW_MS / 1000>> Queue;
 
 /// Camera number to use - we only have one camera, indexed from 0.
 #define CAMERA_NUMBER 0
@@ -98,8 +128,23 @@ typedef boost::lockfree::spsc_queue <Frame, boost::lockfree::capacity <10>> Queu
 // Max bitrate we allow for recording
 const int MAX_BITRATE = 30000000; // 30Mbits/s
 
-/// Interval at which we check for an failure abort during capture
-const int ABORT_INTERVAL = 100; // ms
+/// How long the writer may take to put the last segment on the card when we stop
+const unsigned int SHUTDOWN_DEADLINE_MS = 2000;
+
+/// Encoder buffers after which the pipeline is expected not to allocate any more (see AllocationTracker.h)
+const unsigned int WARMUP_BUFFERS = 300;
+
+/// Rolling statistics of the shield channels go to the telemetry log this often (sample time)
+const uint64_t STATS_INTERVAL_US = 60000000;
+
+/// Parked footage kept in memory before a surveillance event (-surveil), at the parked bitrate
+const unsigned int PRE_EVENT_SECONDS = 30;
+
+/// -surveil without -live : the ISP scales the preview port down this much, the detector needs no more
+const unsigned int SURVEIL_PREVIEW_DIVISOR = 8;
+
+/// Key frame interval of the live stream (-live), which is also how finely its segments can be cut
+const unsigned int LIVE_KEYFRAME_SECONDS = 2;
 
 
 extern "C" int mmal_status_to_int(MMAL_STATUS_T status);
@@ -112,9 +157,41 @@ typedef struct
    unsigned int width;                          /// Requested width of image
    unsigned int height;                         /// requested height of image
    int bitrate;                        /// Requested bitrate
+   int bitrate_floor;                  /// Lowest bitrate the storage backpressure loop may go down to
+   int bitrate_ceiling;                /// Highest bitrate it may go up to (0 : same as bitrate)
    int framerate;                      /// Requested frame rate (fps)
+   int park_delay;                     /// Seconds of zero speed and rpm before switching to the parked profile (0 : never)
+   int park_framerate;                 /// Frame rate while parked
+   int park_bitrate;                   /// Bitrate while parked
+   int shield_baud;                    /// Serial rate the shield is opened at, see LinkMonitor for the search
+   int shield_rate;                    /// Shield samples per second while moving (0 : firmware default), v2 only
+   int shield_park_rate;               /// and while parked
+   int decimate_rate;                  /// Shield samples per second kept after filtering (0 : all of them)
+   int link_timeout;                   /// ms without a valid shield frame after which the link is down (0 : no supervision)
    unsigned int intraperiod;                    /// Intra-refresh period (key frame rate)
    char *filename;                     /// filename of output file
+   char *directory;                    /// base directory for the manifest and ride directories
+   char *writer;                       /// segment writer backend, see SegmentWriter::create
+   char *calibration;                  /// per-bike shield calibration file (NULL : built in tables)
+   char *rules;                        /// event rules file (NULL : RuleEngine::DEFAULT_RULES)
+   char *subtitles;                    /// subtitle sidecar format of the segments (NULL : none)
+   char *extract;                      /// segment to print the SEI telemetry of, instead of recording
+   int sei;                            /// !0 : latest shield sample as SEI in front of every frame
+   int motion;                         /// !0 : inline motion vectors from the encoder, analysed into M records
+   int overlay;                        /// !0 : telemetry burned into the video (I420 frames through the ARM)
+   int surveil;                        /// !0 : while parked, record only around motion seen on the preview port
+   char *zones;                        /// zones the motion is looked for in (NULL : the whole picture)
+   int live;                           /// !0 : second, low resolution H.264 stream from the preview port
+   unsigned int live_width;                     /// Size of the live stream
+   unsigned int live_height;
+   int live_bitrate;                   /// Bitrate of the live stream
+   char *live_shm;                     /// shared memory name the live stream is published under (NULL : none)
+   unsigned int preview_width;                  /// Of the camera preview port with -surveil or -live, scaled by the ISP
+   unsigned int preview_height;
+   int realtime;                       /// !0 : pinned SCHED_FIFO threads and locked memory
+   int ingest_cpu;                     /// CPU for the main (event loop, shield ingest) thread in realtime mode
+   int callback_cpu;                   /// CPU for the encoder callback thread in realtime mode
+   int writer_cpu;                     /// CPU for the segment writer thread in realtime mode
    int verbose;                        /// !0 if want detailed run information
    int immutableInput;                /// Flag to specify whether encoder works in place or creates a new buffer. Result is preview can display either
                                        /// the camera output or the encoder output (with compression artifacts)
@@ -127,16 +204,38 @@ typedef struct
    MMAL_CONNECTION_T *encoder_connection; /// Pointer to the connection from camera to encoder
 
    MMAL_POOL_T *encoder_pool; /// Pointer to the pool of buffers used by encoder output port
+   MMAL_POOL_T *preview_pool; /// Buffers of the camera preview port, for -surveil without -live
+   MMAL_COMPONENT_T *live_encoder_component; /// Encoder of the live stream
+   MMAL_CONNECTION_T *live_connection;       /// Camera preview port to the live encoder
+   MMAL_POOL_T *live_pool;                   /// Buffers of the live encoder output port
 } RASPIVID_STATE;
 
 /** Struct used to pass information in encoder port userdata to callback
  */
 typedef struct
 {
-   FILE *file_handle;                   /// File handle to write buffer data to.
+   Session *session;                    /// Ride we write segments and telemetry to.
    RASPIVID_STATE *pstate;            /// pointer to our state in case required in callback
    int abort;                           /// Set to 1 in callback if an error occurs to attempt to abort the capture
+   Notifier *events;                    /// Wakes the main loop up on abort and on parking state changes
    Queue *queue;
+   ParkingMonitor *parking;
+   LatencyStats *frame_interval;        /// Shield frame inter-arrival times (jitter measurement)
+   RollingStats *stats;                 /// Windowed statistics of the shield channels
+   uint64_t last_stats;                 /// Sample time of the last STATS report
+   RuleEngine *rules;                   /// Live event detection
+   Overlay *overlay;                    /// Gets the latest frame, NULL without -overlay
+   MotionAnalyzer *motion;              /// Motion vector buffers, NULL without -motion
+   MotionDetector *detector;            /// Preview frames while parked, NULL without -surveil
+   PreEventRing *ring;                  /// Encoder output while nothing moves, NULL without -surveil
+   int surveilling;                     /// Encoder output goes to the ring instead of a segment
+   LiveStream *live;                    /// Live encoder output, NULL without -live
+   uint64_t last_frame_time;
+   Frame last_sample;                   /// Newest shield sample consumed, for -sei
+   int frame_start;                     /// The next encoder buffer starts a frame
+   uint64_t start_time;                 /// monotonicUs () at the start of main
+   int first_frame;                     /// Set to 1 once the first IDR frame has been written
+   unsigned int buffers;                /// Encoder buffers received so far
 } PORT_USERDATA;
 
 /**
@@ -160,10 +259,27 @@ static void default_status(RASPIVID_STATE *state)
    state->width = 1280;       // Default to 1080p
    state->height = 720;
    state->bitrate = 17000000; // This is a decent default bitrate for 1080p
+   state->bitrate_floor = 5000000;
+   state->bitrate_ceiling = 0;
    state->framerate = VIDEO_FRAME_RATE_NUM;
+   state->park_delay = 180;
+   state->park_framerate = 5;
+   state->park_bitrate = 1000000;
+   state->link_timeout = 500;
+   state->shield_baud = Shield::DEFAULT_BAUD;
    state->intraperiod = 0;    // Not set
    state->immutableInput = 1;
    state->filename = "video.h264";
+   state->directory = ".";
+   state->writer = "buffered";
+   state->realtime = 0;
+   state->ingest_cpu = 0;
+   state->callback_cpu = 1;
+   state->writer_cpu = 2;
+   state->live_width = 640;
+   state->live_height = 360;
+   state->live_bitrate = 1000000;
+   state->live_shm = "/moto-live";
 
    // Setup preview window defaults
 //   raspipreview_set_defaults(&state->preview_parameters);
@@ -187,11 +303,306 @@ static void dump_status(RASPIVID_STATE *state)
 
    fprintf(stderr, "Width %d, Height %d, filename %s\n", state->width, state->height, state->filename);
    fprintf(stderr, "bitrate %d, framerate %d, time delay %d\n", state->bitrate, state->framerate, state->timeout);
+   fprintf(stderr, "bitrate floor %d, bitrate ceiling %d\n", state->bitrate_floor, state->bitrate_ceiling);
+   fprintf(stderr, "park delay %d, park framerate %d, park bitrate %d\n", state->park_delay, state->park_framerate, state->park_bitrate);
+   fprintf(stderr, "shield baud %d, link timeout %d, rates %d,%d, decimated to %d\n", state->shield_baud, state->link_timeout, state->shield_rate, state->shield_park_rate, state->decimate_rate);
+   fprintf(stderr, "overlay %d, realtime %d, CPUs : ingest %d, callback %d, writer %d\n", state->overlay, state->realtime, state->ingest_cpu, state->callback_cpu, state->writer_cpu);
+   fprintf(stderr, "directory %s, writer %s, calibration %s, rules %s\n", state->directory, state->writer, state->calibration ? state->calibration : "built in", state->rules ? state->rules : "built in");
+   fprintf(stderr, "subtitles %s, sei %d, motion %d\n", state->subtitles ? state->subtitles : "none", state->sei, state->motion);
+   fprintf(stderr, "surveil %d, zones %s\n", state->surveil, state->zones ? state->zones : "whole picture");
+   fprintf(stderr, "live %d, %ux%u, bitrate %d, shared memory %s\n", state->live, state->live_width, state->live_height, state->live_bitrate, state->live_shm ? state->live_shm : "none");
 
 //   raspipreview_dump_parameters(&state->preview_parameters);
    raspicamcontrol_dump_parameters(&state->camera_parameters);
 }
 
+/// Command ID's and Structure defining our command line options
+enum
+{
+   CommandHelp,
+   CommandVerbose,
+   CommandTimeout,
+   CommandBitrate,
+   CommandBitrateFloor,
+   CommandBitrateCeiling,
+   CommandParkDelay,
+   CommandParkFramerate,
+   CommandParkBitrate,
+   CommandShieldBaud,
+   CommandShieldRate,
+   CommandDecimate,
+   CommandLinkTimeout,
+   CommandDirectory,
+   CommandWriter,
+   CommandCalibration,
+   CommandRules,
+   CommandOverlay,
+   CommandSubtitles,
+   CommandSei,
+   CommandExtract,
+   CommandMotion,
+   CommandSurveil,
+   CommandZones,
+   CommandLive,
+   CommandLiveSize,
+   CommandLiveBitrate,
+   CommandLiveShm,
+   CommandRealtime,
+   CommandRealtimeCpus,
+};
+
+typedef struct
+{
+   int id;
+   const char *command;
+   const char *abbrev;
+   const char *help;
+   int num_parameters;
+} COMMAND_LIST;
+
+static COMMAND_LIST cmdline_commands[] =
+{
+   { CommandHelp,      "-help",      "?", "This help information", 0 },
+   { CommandVerbose,   "-verbose",   "v", "Output verbose information during run", 0 },
+   { CommandTimeout,   "-timeout",   "t", "Time (in ms) to capture for. 0 means record until stopped", 1 },
+   { CommandBitrate,   "-bitrate",   "b", "Set bitrate. Use bits per second (e.g. 10MBits/s would be -b 10000000)", 1 },
+   { CommandBitrateFloor, "-bitratefloor", "bf", "Lowest bitrate used when the card can't keep up. Equal to the ceiling disables adaptation", 1 },
+   { CommandBitrateCeiling, "-bitrateceiling", "bc", "Highest bitrate the adaptation may go back up to (default : -b)", 1 },
+   { CommandParkDelay, "-parkdelay", "pd", "Seconds with zero speed and rpm before switching to the parked profile. 0 disables", 1 },
+   { CommandParkFramerate, "-parkfps", "pf", "Frame rate while parked", 1 },
+   { CommandParkBitrate, "-parkbitrate", "pb", "Bitrate while parked", 1 },
+   { CommandShieldBaud, "-shieldbaud", "sb", "Shield serial baud rate, up to 1000000 (protocol v2)", 1 },
+   { CommandShieldRate, "-shieldrate", "sr", "Shield samples per second : moving,parked (e.g. -sr 500,10). 0 keeps the firmware default. v2 only", 1 },
+   { CommandDecimate,  "-decimate",  "dr", "Low pass filter the shield data and keep this many samples per second. 0 keeps all", 1 },
+   { CommandLinkTimeout, "-linktimeout", "lt", "ms without valid shield data before the link is reset and the baud rate searched. 0 disables", 1 },
+   { CommandDirectory, "-directory", "d", "Base directory for the manifest and ride directories", 1 },
+   { CommandWriter,    "-writer",    "w", "Segment writer : buffered (page cache, also stdio) or direct (O_DIRECT, preallocated)", 1 },
+   { CommandCalibration, "-calibration", "cal", "Shield calibration file (lines : channel raw value)", 1 },
+   { CommandRules,     "-rules",     "ru", "Event rules file (lines : name condition [on ms] [off ms])", 1 },
+   { CommandOverlay,   "-overlay",   "ov", "Burn speed, rpm, temperatures and indicators into the video", 0 },
+   { CommandSubtitles, "-subtitles", "st", "Telemetry subtitles next to every segment : srt or vtt", 1 },
+   { CommandSei,       "-sei",       "se", "Embed the latest shield sample as SEI user data in front of every frame", 0 },
+   { CommandExtract,   "-extract",   "x", "Print the telemetry embedded in a segment (see -sei) and exit", 1 },
+   { CommandMotion,    "-motion",    "mv", "Log the scene motion of every frame from the encoder motion vectors", 0 },
+   { CommandSurveil,   "-surveil",   "sv", "While parked, record only around motion (with the footage of the seconds before)", 0 },
+   { CommandZones,     "-zones",     "zn", "Where -surveil looks for motion, in percent of the picture : x,y,w,h;x,y,w,h...", 1 },
+   { CommandLive,      "-live",      "lv", "Also record a low resolution stream, in segments of its own and in shared memory", 0 },
+   { CommandLiveSize,  "-livesize",  "ls", "Size of the live stream (e.g. -ls 640x360)", 1 },
+   { CommandLiveBitrate, "-livebitrate", "lb", "Bitrate of the live stream", 1 },
+   { CommandLiveShm,   "-liveshm",   "lm", "Shared memory name of the live stream (e.g. /moto-live). none disables", 1 },
+   { CommandRealtime,  "-realtime",  "rt", "Pin ingest, callback and writer threads, run them SCHED_FIFO and lock memory", 0 },
+   { CommandRealtimeCpus, "-rtcpus", "rc", "CPUs for the realtime mode : ingest,callback,writer (e.g. -rc 0,1,2)", 1 },
+};
+
+static int cmdline_commands_size = sizeof(cmdline_commands) / sizeof(cmdline_commands[0]);
+
+/**
+ * Find the command line option matching arg (without the leading '-')
+ *
+ * @param arg Command line argument
+ * @param num_parameters Set to the number of parameters the option takes
+ * @return Command ID or -1 if not found
+ */
+static int get_command_id(const char *arg, int *num_parameters)
+{
+   int j;
+
+   for (j = 0; j < cmdline_commands_size; j++)
+   {
+      if (!strcmp(arg, cmdline_commands[j].command) || !strcmp(arg, cmdline_commands[j].abbrev))
+      {
+         *num_parameters = cmdline_commands[j].num_parameters;
+         return cmdline_commands[j].id;
+      }
+   }
+
+   return -1;
+}
+
+/**
+ * Display usage information for the application to stderr
+ *
+ * @param app_name String to display as the application name
+ */
+static void display_valid_parameters(const char *app_name)
+{
+   int j;
+
+   fprintf(stderr, "Usage: %s [options]\n\n", app_name);
+
+   for (j = 0; j < cmdline_commands_size; j++)
+      fprintf(stderr, "-%s, -%s\t: %s\n", cmdline_commands[j].abbrev, cmdline_commands[j].command, cmdline_commands[j].help);
+
+   fprintf(stderr, "\n");
+}
+
+/**
+ * Parse the incoming command line and put resulting parameters in to the state
+ *
+ * @param argc Number of arguments in command line
+ * @param argv Array of pointers to strings from command line
+ * @param state Pointer to state structure to assign any discovered parameters to
+ * @return non-0 if failed for some reason, 0 otherwise
+ */
+static int parse_cmdline(int argc, const char **argv, RASPIVID_STATE *state)
+{
+   int i;
+
+   for (i = 1; i < argc; i++)
+   {
+      int num_parameters = 0;
+      int command_id;
+
+      if (argv[i][0] != '-')
+         return 1;
+
+      command_id = get_command_id(&argv[i][1], &num_parameters);
+
+      if (command_id == -1 || i + num_parameters >= argc)
+         return 1;
+
+      switch (command_id)
+      {
+      case CommandHelp:
+         return 1;
+
+      case CommandVerbose:
+         state->verbose = 1;
+         break;
+
+      case CommandTimeout:
+         if (sscanf(argv[i + 1], "%d", &state->timeout) != 1)
+            return 1;
+         break;
+
+      case CommandBitrate:
+         if (sscanf(argv[i + 1], "%d", &state->bitrate) != 1 || state->bitrate > MAX_BITRATE)
+            return 1;
+         break;
+
+      case CommandBitrateFloor:
+         if (sscanf(argv[i + 1], "%d", &state->bitrate_floor) != 1)
+            return 1;
+         break;
+
+      case CommandBitrateCeiling:
+         if (sscanf(argv[i + 1], "%d", &state->bitrate_ceiling) != 1 || state->bitrate_ceiling > MAX_BITRATE)
+            return 1;
+         break;
+
+      case CommandParkDelay:
+         if (sscanf(argv[i + 1], "%d", &state->park_delay) != 1)
+            return 1;
+         break;
+
+      case CommandParkFramerate:
+         if (sscanf(argv[i + 1], "%d", &state->park_framerate) != 1)
+            return 1;
+         break;
+
+      case CommandParkBitrate:
+         if (sscanf(argv[i + 1], "%d", &state->park_bitrate) != 1 || state->park_bitrate > MAX_BITRATE)
+            return 1;
+         break;
+
+      case CommandShieldBaud:
+         if (sscanf(argv[i + 1], "%d", &state->shield_baud) != 1 || state->shield_baud <= 0 || state->shield_baud > 1000000)
+            return 1;
+         break;
+
+      case CommandShieldRate:
+         if (sscanf(argv[i + 1], "%d,%d", &state->shield_rate, &state->shield_park_rate) != 2 || state->shield_rate < 0 || state->shield_park_rate < 0)
+            return 1;
+         break;
+
+      case CommandDecimate:
+         if (sscanf(argv[i + 1], "%d", &state->decimate_rate) != 1 || state->decimate_rate < 0)
+            return 1;
+         break;
+
+      case CommandLinkTimeout:
+         if (sscanf(argv[i + 1], "%d", &state->link_timeout) != 1 || state->link_timeout < 0)
+            return 1;
+         break;
+
+      case CommandDirectory:
+         state->directory = (char *)argv[i + 1];
+         break;
+
+      case CommandWriter:
+         state->writer = (char *)argv[i + 1];
+         break;
+
+      case CommandCalibration:
+         state->calibration = (char *)argv[i + 1];
+         break;
+
+      case CommandRules:
+         state->rules = (char *)argv[i + 1];
+         break;
+
+      case CommandOverlay:
+         state->overlay = 1;
+         break;
+
+      case CommandSubtitles:
+         state->subtitles = (char *)argv[i + 1];
+         break;
+
+      case CommandSei:
+         state->sei = 1;
+         break;
+
+      case CommandExtract:
+         state->extract = (char *)argv[i + 1];
+         break;
+
+      case CommandMotion:
+         state->motion = 1;
+         break;
+
+      case CommandSurveil:
+         state->surveil = 1;
+         break;
+
+      case CommandZones:
+         state->zones = (char *)argv[i + 1];
+         break;
+
+      case CommandLive:
+         state->live = 1;
+         break;
+
+      case CommandLiveSize:
+         if (sscanf(argv[i + 1], "%ux%u", &state->live_width, &state->live_height) != 2 || !state->live_width || !state->live_height)
+            return 1;
+         break;
+
+      case CommandLiveBitrate:
+         if (sscanf(argv[i + 1], "%d", &state->live_bitrate) != 1 || state->live_bitrate > MAX_BITRATE)
+            return 1;
+         break;
+
+      case CommandLiveShm:
+         state->live_shm = (strcmp(argv[i + 1], "none") == 0) ? NULL : (char *)argv[i + 1];
+         break;
+
+      case CommandRealtime:
+         state->realtime = 1;
+         break;
+
+      case CommandRealtimeCpus:
+         if (sscanf(argv[i + 1], "%d,%d,%d", &state->ingest_cpu, &state->callback_cpu, &state->writer_cpu) != 3)
+            return 1;
+         break;
+      }
+
+      i += num_parameters;
+   }
+
+   return 0;
+}
+
 /**
  *  buffer header callback function for camera control
  *
@@ -214,29 +625,66 @@ static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 }
 
 /**
- *
+ * Starts a new segment every FRAMES_PER_FILE buffers. Segment numbering is kept by the
+ * session (resumed from the manifest), so nothing gets overwritten after a restart.
+ */
+static bool rotateFiles (Session *session)
+{
+        const unsigned int FRAMES_PER_FILE = 90;
+
+        if (!session->isOpen () || session->getBuffersInSegment () > FRAMES_PER_FILE) {
+                return session->openSegment ();
+        }
+
+        return true;
+}
+
+/**
+ * Stores the shield frames queued by the main loop. Runs in the encoder callback, and
+ * once more on shutdown after the encoder output port is disabled.
  */
-FILE *rotateFiles (FILE *file)
+static void consumeFrames(PORT_USERDATA *pData)
 {
-        const int FILE_NAME_LEN = 32;
-        const int FRAMES_PER_FILE = 90;
-        char filename[FILE_NAME_LEN];
-        static unsigned int fileNo = 0;
-        static unsigned int frameCnt = 0;
+        Frame frame;
 
-        if (!file || frameCnt++ > FRAMES_PER_FILE) {
+        while (pData->queue->pop(frame)) {
+                if (pData->motion) {
+                        frame.motion = pData->motion->last ().magnitude;
+                }
+
+                pData->session->telemetry ().log (frame);
 
-                if (file) {
-                        fclose (file);
+                if (pData->last_frame_time) {
+                        pData->frame_interval->add (frame.timestamp - pData->last_frame_time);
                 }
 
-                snprintf (filename, FILE_NAME_LEN, "%05d.h264", fileNo++);
-                std::cerr << "New file : " << filename << std::endl;
-                file = fopen(filename, "wb");
-                frameCnt = 0;
-        }
+                pData->last_frame_time = frame.timestamp;
+                pData->last_sample = frame;
+
+                pData->stats->push (frame);
+                pData->rules->update (frame);
+                pData->session->subtitles ().add (frame);
+
+                if (pData->overlay) {
+                        pData->overlay->setFrame (frame);
+                }
+
+                if (frame.sampleTime - pData->last_stats >= STATS_INTERVAL_US) {
+                        if (pData->last_stats) {
+                                pData->stats->report (pData->session->telemetry ());
+                        }
+
+                        pData->last_stats = frame.sampleTime;
+                }
+
+                if (pData->parking->update (frame)) {
+                        pData->events->notify ();
+                }
 
-        return file;
+                if (pData->pstate->verbose) {
+                        std::cerr << frame << std::endl;
+                }
+        }
 }
 
 /**
@@ -253,28 +701,104 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
         // We pass our file handle and other stuff in via the userdata field.
         PORT_USERDATA *pData = (PORT_USERDATA *) port->userdata;
 
-        if (pData) {
-                int bytes_written = buffer->length;
+        if (pData && (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)) {
+                // Motion vectors (-motion), not a part of the stream.
+                if (pData->motion) {
+                        mmal_buffer_header_mem_lock(buffer);
 
-//                std::cerr << "Open" << std::endl;
-                pData->file_handle = rotateFiles (pData->file_handle);
+                        if (pData->motion->analyze (buffer->data + buffer->offset, buffer->length, buffer->pts)) {
+                                pData->session->telemetry ().log (pData->motion->last ());
+                        }
+
+                        mmal_buffer_header_mem_unlock(buffer);
+                }
+        } else if (pData) {
+                if (++pData->buffers == 1 && pData->pstate->realtime) {
+                        // The callback thread belongs to MMAL, this is the first chance to set it up.
+                        realtime::configureThread (pthread_self (), "callback", pData->pstate->callback_cpu, realtime::CALLBACK_PRIORITY);
+                        realtime::prefaultStack ();
+                }
+                else if (pData->buffers == WARMUP_BUFFERS) {
+                        allocation::arm ();
+                }
+
+                bool written = true;
+                int64_t pts = (buffer->pts == MMAL_TIME_UNKNOWN) ? Session::UNKNOWN_PTS : buffer->pts;
+                bool keyframe = (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) != 0;
+
+                if (pData->ring) {
+                        // Parked and nothing moves : no segment, the ring only. Motion opens one, starting with the ring.
+                        bool surveilling = pData->parking->getState () == ParkingMonitor::PARKED && !pData->detector->isActive (monotonicUs ());
+
+                        if (surveilling != bool (pData->surveilling)) {
+                                pData->surveilling = surveilling;
+
+                                if (surveilling) {
+                                        pData->session->telemetry ().event ("SURVEILLANCE watching");
+                                        pData->session->closeSegment ();
+                                }
+                                else {
+                                        pData->session->telemetry ().event ("SURVEILLANCE recording pre_event=%zu", pData->ring->size ());
+                                        Session *session = pData->session;
+                                        written = session->openSegment () &&
+                                                  pData->ring->drain ([session] (uint8_t const *data, size_t length) { return session->insert (data, length); },
+                                                                      [session] (uint8_t const *data, size_t length, int64_t pts, bool keyframe) {
+                                                                              return session->write (data, length, pts, keyframe);
+                                                                      });
+                                }
+                        }
 
-                if (buffer->length) {
                         mmal_buffer_header_mem_lock(buffer);
-                        bytes_written = fwrite(buffer->data, 1, buffer->length, pData->file_handle);
+
+                        if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) {
+                                pData->ring->addHeaders (buffer->data, buffer->length);
+                        }
+                        else if (surveilling) {
+                                pData->ring->push (buffer->data, buffer->length, pts, keyframe);
+                        }
+
                         mmal_buffer_header_mem_unlock(buffer);
                 }
 
-                if (bytes_written != buffer->length) {
+                if (!pData->surveilling) {
+                        written = written && rotateFiles (pData->session);
+
+                        // Sample goes in front of the first buffer of a frame, after SPS / PPS. Frame payload is written as it is.
+                        if (written && pData->pstate->sei && pData->frame_start && pData->last_sample.sampleTime && buffer->length &&
+                            !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)) {
+                                uint8_t nal[sei::MAX_NAL];
+                                size_t n = sei::encode (pData->last_sample, nal, sizeof (nal));
+                                written = !n || pData->session->insert (nal, n);
+                        }
+
+                        if (written) {
+                                mmal_buffer_header_mem_lock(buffer);
+                                written = pData->session->write (buffer->data, buffer->length, pts, keyframe);
+                                mmal_buffer_header_mem_unlock(buffer);
+                        }
+                }
+
+                if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)) {
+                        pData->frame_start = (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) != 0;
+                }
+
+                if (!written) {
                         vcos_log_error("Failed to write buffer data - aborting");
                         pData->abort = 1;
                 }
+                else if (!pData->first_frame && keyframe) {
+                        pData->first_frame = 1;
+                        uint64_t sinceStart = monotonicUs () - pData->start_time;
+                        uint64_t sinceBoot = bootTimeUs ();
+                        pData->session->telemetry ().event ("FIRST_FRAME start=%" PRIu64 "ms boot=%" PRIu64 "ms", sinceStart / 1000, sinceBoot / 1000);
+                        fprintf (stderr, "Time to first frame : %" PRIu64 " ms since start, %" PRIu64 " ms since boot\n", sinceStart / 1000, sinceBoot / 1000);
+                }
 
-                // Store sield data;
-                Frame frame;
-                while (pData->queue->pop(frame)) {
-                        std::cerr << frame << std::endl;
+                if (pData->abort) {
+                        pData->events->notify ();
                 }
+
+                consumeFrames (pData);
         } else {
                 vcos_log_error("Received a encoder buffer callback with no state");
         }
@@ -298,6 +822,58 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
         }
 }
 
+/**
+ * Preview port frames (-surveil without -live), small ones. The port runs only while
+ * parked (see run_preview_port), the check here covers the frames already on their way
+ * when the state changes. The detector takes one every MotionDetector::INTERVAL_US, the
+ * others are sent back untouched.
+ */
+static void preview_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+        PORT_USERDATA *pData = (PORT_USERDATA *) port->userdata;
+
+        if (pData && buffer->length && pData->parking->getState () == ParkingMonitor::PARKED) {
+                mmal_buffer_header_mem_lock(buffer);
+                pData->detector->process (buffer->data + buffer->offset, monotonicUs ());
+                mmal_buffer_header_mem_unlock(buffer);
+        }
+
+        mmal_buffer_header_release(buffer);
+
+        if (pData && port->is_enabled) {
+                MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(pData->pstate->preview_pool->queue);
+
+                if (!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS) {
+                        vcos_log_error("Unable to return a buffer to the preview port");
+                }
+        }
+}
+
+/**
+ * Live encoder output (-live). A thread of its own, apart from encoder_buffer_callback :
+ * only the LiveStream is touched here.
+ */
+static void live_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+        PORT_USERDATA *pData = (PORT_USERDATA *) port->userdata;
+
+        if (pData && buffer->length && !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)) {
+                mmal_buffer_header_mem_lock(buffer);
+                pData->live->write (buffer->data + buffer->offset, buffer->length, buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG);
+                mmal_buffer_header_mem_unlock(buffer);
+        }
+
+        mmal_buffer_header_release(buffer);
+
+        if (pData && port->is_enabled) {
+                MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(pData->pstate->live_pool->queue);
+
+                if (!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS) {
+                        vcos_log_error("Unable to return a buffer to the live encoder port");
+                }
+        }
+}
+
 
 /**
  * Create the camera component, set up its ports
@@ -364,20 +940,33 @@ static MMAL_COMPONENT_T *create_camera_component(RASPIVID_STATE *state)
    // Now set up the port formats
 
    // Set the encode format on the Preview port
-   // HW limitations mean we need the preview to be the same size as the required recorded output
 
    format = preview_port->format;
 
    format->encoding = MMAL_ENCODING_OPAQUE;
    format->encoding_variant = MMAL_ENCODING_I420;
 
-   format->encoding = MMAL_ENCODING_OPAQUE;
-   format->es->video.width = state->width;
-   format->es->video.height = state->height;
+   if (state->surveil || state->live)
+   {
+      // Frames for the live encoder, Y plane for the MotionDetector (see preview_buffer_callback). Small
+      // ones : the ISP scales them down, instead of the ARM or a resizer going through full size frames.
+      format->encoding = MMAL_ENCODING_I420;
+      format->es->video.width = VCOS_ALIGN_UP(state->preview_width, 32);
+      format->es->video.height = VCOS_ALIGN_UP(state->preview_height, 16);
+      format->es->video.crop.width = state->preview_width;
+      format->es->video.crop.height = state->preview_height;
+   }
+   else
+   {
+      format->encoding = MMAL_ENCODING_OPAQUE;
+      format->es->video.width = state->width;
+      format->es->video.height = state->height;
+      format->es->video.crop.width = state->width;
+      format->es->video.crop.height = state->height;
+   }
+
    format->es->video.crop.x = 0;
    format->es->video.crop.y = 0;
-   format->es->video.crop.width = state->width;
-   format->es->video.crop.height = state->height;
    format->es->video.frame_rate.num = state->framerate;
    format->es->video.frame_rate.den = VIDEO_FRAME_RATE_DEN;
 
@@ -389,14 +978,31 @@ static MMAL_COMPONENT_T *create_camera_component(RASPIVID_STATE *state)
       goto error;
    }
 
+   if (state->surveil && mmal_port_parameter_set_boolean(preview_port, MMAL_PARAMETER_ZERO_COPY, 1) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to set zero copy on the camera preview port");
+      goto error;
+   }
+
    // Set the encode format on the video  port
 
    format = video_port->format;
    format->encoding_variant = MMAL_ENCODING_I420;
 
-   format->encoding = MMAL_ENCODING_OPAQUE;
-   format->es->video.width = state->width;
-   format->es->video.height = state->height;
+   if (state->overlay)
+   {
+      // Frames the ARM can draw into, see overlay_connection_callback. Planes are padded like the encoder wants them.
+      format->encoding = MMAL_ENCODING_I420;
+      format->es->video.width = VCOS_ALIGN_UP(state->width, 32);
+      format->es->video.height = VCOS_ALIGN_UP(state->height, 16);
+   }
+   else
+   {
+      format->encoding = MMAL_ENCODING_OPAQUE;
+      format->es->video.width = state->width;
+      format->es->video.height = state->height;
+   }
+
    format->es->video.crop.x = 0;
    format->es->video.crop.y = 0;
    format->es->video.crop.width = state->width;
@@ -412,6 +1018,13 @@ static MMAL_COMPONENT_T *create_camera_component(RASPIVID_STATE *state)
       goto error;
    }
 
+   // Frames are mapped into the ARM address space instead of being copied in and out.
+   if (state->overlay && mmal_port_parameter_set_boolean(video_port, MMAL_PARAMETER_ZERO_COPY, 1) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to set zero copy on the camera video port");
+      goto error;
+   }
+
    // Ensure there are enough buffers to avoid dropping frames
    if (video_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
       video_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
@@ -456,6 +1069,23 @@ static MMAL_COMPONENT_T *create_camera_component(RASPIVID_STATE *state)
 
    raspicamcontrol_set_all_parameters(camera, &state->camera_parameters);
 
+   if (state->surveil && !state->live)
+   {
+      preview_port->buffer_size = preview_port->buffer_size_recommended;
+      preview_port->buffer_num = preview_port->buffer_num_recommended;
+
+      if (preview_port->buffer_num < preview_port->buffer_num_min)
+         preview_port->buffer_num = preview_port->buffer_num_min;
+
+      state->preview_pool = mmal_port_pool_create(preview_port, preview_port->buffer_num, preview_port->buffer_size);
+
+      if (!state->preview_pool)
+      {
+         vcos_log_error("Failed to create buffer header pool for camera preview port %s", preview_port->name);
+         goto error;
+      }
+   }
+
    state->camera_component = camera;
 
    if (state->verbose)
@@ -479,6 +1109,12 @@ error:
  */
 static void destroy_camera_component(RASPIVID_STATE *state)
 {
+   if (state->preview_pool)
+   {
+      mmal_port_pool_destroy(state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT], state->preview_pool);
+      state->preview_pool = NULL;
+   }
+
    if (state->camera_component)
    {
       mmal_component_destroy(state->camera_component);
@@ -577,6 +1213,13 @@ static MMAL_COMPONENT_T *create_encoder_component(RASPIVID_STATE *state)
       // Continue rather than abort..
    }
 
+   // Vectors come in buffers of their own, see encoder_buffer_callback
+   if (state->motion && mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, 1) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to enable inline motion vectors");
+      // Continue without them
+   }
+
    //  Enable component
    status = mmal_component_enable(encoder);
 
@@ -630,31 +1273,252 @@ static void destroy_encoder_component(RASPIVID_STATE *state)
    }
 }
 
+/**
+ * Create the encoder of the live stream. Its ports get their formats when connected, see
+ * connect_live_pipeline
+ *
+ * @param state Pointer to state control struct
+ *
+ * @return 0 if failed, pointer to the live encoder if successful
+ */
+static MMAL_COMPONENT_T *create_live_components(RASPIVID_STATE *state)
+{
+   MMAL_COMPONENT_T *encoder = 0;
+
+   if (mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &encoder) != MMAL_SUCCESS || !encoder->input_num || !encoder->output_num)
+   {
+      vcos_log_error("Unable to create the live video encoder component");
+      goto error;
+   }
+
+   if (mmal_component_enable(encoder) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to enable the live video encoder component");
+      goto error;
+   }
+
+   state->live_encoder_component = encoder;
+
+   if (state->verbose)
+      fprintf(stderr, "Live stream components done\n");
+
+   return encoder;
+
+   error:
+   if (encoder)
+      mmal_component_destroy(encoder);
+
+   return 0;
+}
+
+/**
+ * Destroy the live stream components
+ *
+ * @param state Pointer to state control struct
+ */
+static void destroy_live_components(RASPIVID_STATE *state)
+{
+   if (state->live_pool)
+   {
+      mmal_port_pool_destroy(state->live_encoder_component->output[0], state->live_pool);
+      state->live_pool = NULL;
+   }
+
+   if (state->live_encoder_component)
+   {
+      mmal_component_destroy(state->live_encoder_component);
+      state->live_encoder_component = NULL;
+   }
+}
+
 /**
  * Connect two specific ports together
  *
  * @param output_port Pointer the output port
  * @param input_port Pointer the input port
  * @param Pointer to a mmal connection pointer, reassigned if function successful
+ * @param callback NULL : tunnelled connection. Otherwise buffers go through the ARM, and the
+ *                 callback moves them (see overlay_connection_callback)
+ * @param user_data Passed to the callback in the connection
  * @return Returns a MMAL_STATUS_T giving result of operation
  *
  */
-static MMAL_STATUS_T connect_ports(MMAL_PORT_T *output_port, MMAL_PORT_T *input_port, MMAL_CONNECTION_T **connection)
+static MMAL_STATUS_T connect_ports(MMAL_PORT_T *output_port, MMAL_PORT_T *input_port, MMAL_CONNECTION_T **connection,
+                                   MMAL_CONNECTION_CALLBACK_T callback = NULL, void *user_data = NULL)
 {
    MMAL_STATUS_T status;
+   uint32_t flags = MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT;
+
+   if (!callback)
+      flags |= MMAL_CONNECTION_FLAG_TUNNELLING;
 
-   status =  mmal_connection_create(connection, output_port, input_port, MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT);
+   status =  mmal_connection_create(connection, output_port, input_port, flags);
 
    if (status == MMAL_SUCCESS)
    {
+      (*connection)->callback = callback;
+      (*connection)->user_data = user_data;
+
       status =  mmal_connection_enable(*connection);
       if (status != MMAL_SUCCESS)
          mmal_connection_destroy(*connection);
+      else if (callback)
+         callback(*connection); // Nothing comes back before the camera gets its first buffers.
    }
 
    return status;
 }
 
+/**
+ * Moves the buffers of a non-tunnelled connection : frames from the output port go to the
+ * input port after apply (data) has seen them, the ones the input port is done with go
+ * back. Runs in a MMAL thread whenever either port returns a buffer.
+ */
+template <typename Apply>
+static void forward_buffers(MMAL_CONNECTION_T *connection, Apply apply)
+{
+   MMAL_BUFFER_HEADER_T *buffer;
+
+   while ((buffer = mmal_queue_get(connection->queue)) != NULL)
+   {
+      if (buffer->cmd)
+      {
+         // Port events, nothing to pass on.
+         mmal_buffer_header_release(buffer);
+         continue;
+      }
+
+      if (buffer->length)
+      {
+         mmal_buffer_header_mem_lock(buffer);
+         apply(buffer->data + buffer->offset);
+         mmal_buffer_header_mem_unlock(buffer);
+      }
+
+      if (mmal_port_send_buffer(connection->in, buffer) != MMAL_SUCCESS)
+      {
+         vcos_log_error("Unable to send a frame to %s", connection->in->name);
+         mmal_buffer_header_release(buffer);
+      }
+   }
+
+   while ((buffer = mmal_queue_get(connection->pool->queue)) != NULL)
+   {
+      if (mmal_port_send_buffer(connection->out, buffer) != MMAL_SUCCESS)
+      {
+         vcos_log_error("Unable to return a buffer to %s", connection->out->name);
+         mmal_buffer_header_release(buffer);
+         break;
+      }
+   }
+}
+
+/**
+ * Camera to encoder connection with -overlay : draws it into every frame.
+ *
+ * @param connection user_data is the Overlay
+ */
+static void overlay_connection_callback(MMAL_CONNECTION_T *connection)
+{
+   Overlay *overlay = (Overlay *)connection->user_data;
+   forward_buffers(connection, [overlay] (uint8_t *frame) { overlay->apply(frame); });
+}
+
+/**
+ * Camera preview to live encoder connection with both -live and -surveil : the detector
+ * looks at the frames on their way to the live stream, see preview_buffer_callback.
+ *
+ * @param connection user_data is the PORT_USERDATA
+ */
+static void surveillance_connection_callback(MMAL_CONNECTION_T *connection)
+{
+   PORT_USERDATA *pData = (PORT_USERDATA *)connection->user_data;
+
+   forward_buffers(connection, [pData] (uint8_t *frame) {
+      if (pData->parking->getState() == ParkingMonitor::PARKED)
+         pData->detector->process(frame, monotonicUs());
+   });
+}
+
+/**
+ * Camera preview port (already at the live stream size), live encoder. The encoder output
+ * is set up for live_buffer_callback, but not enabled
+ *
+ * @param state Pointer to state control struct
+ * @param callback_data Given to surveillance_connection_callback if there is a detector
+ * @return Returns a MMAL_STATUS_T giving result of operation
+ */
+static MMAL_STATUS_T connect_live_pipeline(RASPIVID_STATE *state, PORT_USERDATA *callback_data)
+{
+   MMAL_PORT_T *preview_port = state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT];
+   MMAL_PORT_T *encoder_input = state->live_encoder_component->input[0];
+   MMAL_PORT_T *encoder_output = state->live_encoder_component->output[0];
+   MMAL_STATUS_T status;
+
+   if (callback_data->detector)
+   {
+      // Frames pass through the ARM as they are, both ends have to map them the same way.
+      if ((status = mmal_port_parameter_set_boolean(encoder_input, MMAL_PARAMETER_ZERO_COPY, 1)) != MMAL_SUCCESS)
+      {
+         vcos_log_error("Unable to set zero copy on the live encoder input port");
+         return status;
+      }
+
+      status = connect_ports(preview_port, encoder_input, &state->live_connection, surveillance_connection_callback, callback_data);
+   }
+   else
+      status = connect_ports(preview_port, encoder_input, &state->live_connection);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to connect the camera preview port to the live encoder");
+      return status;
+   }
+
+   mmal_format_copy(encoder_output->format, encoder_input->format);
+   encoder_output->format->encoding = MMAL_ENCODING_H264;
+   encoder_output->format->bitrate = state->live_bitrate;
+   encoder_output->buffer_size = encoder_output->buffer_size_recommended;
+
+   if (encoder_output->buffer_size < encoder_output->buffer_size_min)
+      encoder_output->buffer_size = encoder_output->buffer_size_min;
+
+   encoder_output->buffer_num = encoder_output->buffer_num_recommended;
+
+   if (encoder_output->buffer_num < encoder_output->buffer_num_min)
+      encoder_output->buffer_num = encoder_output->buffer_num_min;
+
+   if ((status = mmal_port_format_commit(encoder_output)) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to set format on the live encoder output port");
+      return status;
+   }
+
+   {
+      MMAL_PARAMETER_UINT32_T param = {{ MMAL_PARAMETER_INTRAPERIOD, sizeof(param)}, state->framerate * LIVE_KEYFRAME_SECONDS};
+
+      if (mmal_port_parameter_set(encoder_output, &param.hdr) != MMAL_SUCCESS)
+         vcos_log_error("Unable to set the live stream intraperiod");
+   }
+
+   // SPS / PPS in front of every key frame : every live segment, and every reader of the shared memory, can start there.
+   if ((status = mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, 1)) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to set inline headers on the live encoder");
+      return status;
+   }
+
+   state->live_pool = mmal_port_pool_create(encoder_output, encoder_output->buffer_num, encoder_output->buffer_size);
+
+   if (!state->live_pool)
+   {
+      vcos_log_error("Failed to create buffer header pool for live encoder output port %s", encoder_output->name);
+      return MMAL_ENOMEM;
+   }
+
+   return MMAL_SUCCESS;
+}
+
 /**
  * Checks if specified port is valid and enabled, then disables it
  *
@@ -668,39 +1532,136 @@ static void check_disable_port(MMAL_PORT_T *port)
 }
 
 /**
- * Handler for sigint signals
- *
- * @param signal_number ID of incoming signal.
- *
+ * -surveil without -live : the preview port runs only while parked, the only time the
+ * detector looks at it. Its userdata is set up by then.
  */
-static void signal_handler(int signal_number)
+static void run_preview_port(RASPIVID_STATE *state, bool run)
 {
-   // Going to abort on all signals
-   vcos_log_error("Aborting program\n");
+   MMAL_PORT_T *port = state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT];
 
-   // TODO : Need to close any open stuff...how?
+   if (!run)
+   {
+      check_disable_port(port);
+      return;
+   }
+
+   if (port->is_enabled)
+      return;
 
-   exit(255);
+   if (mmal_port_enable(port, preview_buffer_callback) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Failed to enable the camera preview port, no surveillance");
+      return;
+   }
+
+   int num = mmal_queue_length(state->preview_pool->queue);
+
+   for (int q = 0; q < num; q++)
+   {
+      if (mmal_port_send_buffer(port, mmal_queue_get(state->preview_pool->queue)) != MMAL_SUCCESS)
+         vcos_log_error("Unable to send a buffer to the camera preview port (%d)", q);
+   }
 }
 
 /**
- *
+ * Changes the bitrate of a running encoder and notes it in the telemetry stream.
  */
-void shieldThread (std::string const &portFile, Queue *queue)
+static bool setBitrate (MMAL_PORT_T *encoderOutput, unsigned int bitrate, TelemetryLog &log, const char *reason)
 {
-        Shield port (portFile);
-        uint8_t cnt = 0;
-        char mark[] = { '/', '-', '\\', '|' };
+        if (mmal_port_parameter_set_uint32 (encoderOutput, MMAL_PARAMETER_VIDEO_BIT_RATE, bitrate) != MMAL_SUCCESS) {
+                vcos_log_error ("Unable to set bitrate %u", bitrate);
+                return false;
+        }
+
+        log.event ("BITRATE %u %s", bitrate, reason);
+        return true;
+}
 
-        while (true) {
-#if 0
-                std::cout << "\033[A\033[2K" << port.read () << " [" << mark[++cnt % 4] << "]" << std::endl;
-#endif
-                queue->push (port.read ());
+/**
+ * One step of the storage backpressure loop, called every BitrateController::TICK_MS.
+ */
+static void updateBitrate (MMAL_PORT_T *encoderOutput, BitrateController *controller, Session *session)
+{
+        SegmentWriter &writer = session->getWriter ();
+        LatencyStats &recent = writer.recentLatency ();
+        unsigned int depth = writer.queueDepth ();
+        uint32_t p99 = recent.percentile (0.99);
+        recent.reset ();
+
+        unsigned int bitrate = controller->update (depth, p99, writer.getDropped ());
+
+        if (bitrate) {
+                char reason[64];
+                snprintf (reason, sizeof (reason), "depth=%u p99=%u", depth, p99);
+                setBitrate (encoderOutput, bitrate, session->telemetry (), reason);
         }
 }
 
+/**
+ * Shield samples per second for the given state, 0 : the firmware default.
+ */
+static unsigned int shieldRate (RASPIVID_STATE const *state, ParkingMonitor::State s)
+{
+        return (s == ParkingMonitor::PARKED) ? state->shield_park_rate : state->shield_rate;
+}
+
+/**
+ * Tells the AVR how fast to sample for the given state. Also after every link up : the AVR
+ * may have been reset and forgotten everything.
+ */
+static void configureShield (RASPIVID_STATE *state, CommandChannel *commands, ParkingMonitor::State s)
+{
+        commands->syncTick ();
+        unsigned int rate = shieldRate (state, s);
+
+        if (rate) {
+                commands->setRate (rate);
+        }
+}
+
+/**
+ * Switches between the full and the parked recording profile. Neither the camera nor
+ * the encoder is torn down : frame rate and bitrate are changed on the running ports.
+ * Going back to full, an I frame is requested so the full profile starts at once instead
+ * of at the next GOP.
+ */
+static void applyProfile (RASPIVID_STATE *state, ParkingMonitor::State s, BitrateController *controller, ParkingMonitor *parking, Session *session, CommandChannel *commands)
+{
+        MMAL_PORT_T *cameraVideo = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+        MMAL_PORT_T *encoderOutput = state->encoder_component->output[0];
+        TelemetryLog &log = session->telemetry ();
+        bool parked = (s == ParkingMonitor::PARKED);
+        MMAL_RATIONAL_T fps = { (parked) ? state->park_framerate : state->framerate, VIDEO_FRAME_RATE_DEN };
+
+        if (mmal_port_parameter_set_rational (cameraVideo, MMAL_PARAMETER_FRAME_RATE, fps) != MMAL_SUCCESS) {
+                vcos_log_error ("Unable to set frame rate %d", fps.num);
+        }
+
+        if (parked) {
+                controller->pin (state->park_bitrate);
+                setBitrate (encoderOutput, state->park_bitrate, log, "parked");
+        }
+        else {
+                setBitrate (encoderOutput, controller->release (), log, "moving");
+        }
+
+        if (state->surveil && !state->live) {
+                run_preview_port (state, parked);
+        }
+
+        // Parked with -surveil, the pre-event ring starts at a key frame, so one now spares it a GOP.
+        if ((!parked || state->surveil) && mmal_port_parameter_set_boolean (encoderOutput, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1) != MMAL_SUCCESS) {
+                vcos_log_error ("Unable to request an I frame");
+        }
 
+        unsigned int rate = shieldRate (state, s);
+
+        if (rate) {
+                commands->setRate (rate);
+        }
+
+        parking->beginPhase (s, session->getBytesWritten (), state->bitrate, log);
+}
 
 /**
  * main
@@ -717,39 +1678,236 @@ int main(int argc, const char **argv)
    MMAL_PORT_T *preview_input_port = NULL;
    MMAL_PORT_T *encoder_input_port = NULL;
    MMAL_PORT_T *encoder_output_port = NULL;
+   MMAL_PORT_T *live_output_port = NULL;
    FILE *output_file = NULL;
+   uint64_t start_time = monotonicUs();
+   bool camera_ok = false, encoder_ok = false, storage_ok = false;
+   bool interrupted = false;
+
+   // SIGINT and SIGTERM are taken from a signalfd by the main loop. Every thread started
+   // from now on (MMAL ones included) inherits the mask.
+   EventLoop::blockSignals();
 
    bcm_host_init();
 
    // Register our application with the logging system
    vcos_log_register("RaspiVid", VCOS_LOG_CATEGORY);
 
-   signal(SIGINT, signal_handler);
-
    default_status(&state);
 
+   if (parse_cmdline(argc, argv, &state))
+   {
+      display_valid_parameters(argv[0]);
+      exit(0);
+   }
+
+   if (state.extract)
+   {
+      int found = sei::extract(state.extract, stdout);
+
+      if (found >= 0)
+         fprintf(stderr, "%d samples in %s\n", found, state.extract);
+
+      exit((found < 0) ? 1 : 0);
+   }
+
+   std::unique_ptr <SegmentWriter> writer (SegmentWriter::create (state.writer));
+
+   if (!writer)
+   {
+      vcos_log_error("%s: Unknown segment writer %s", __func__, state.writer);
+      display_valid_parameters(argv[0]);
+      exit(1);
+   }
+
+   Subtitles::Format subtitles = Subtitles::NONE;
+
+   if (state.subtitles && !Subtitles::parseFormat(state.subtitles, &subtitles))
+   {
+      vcos_log_error("%s: Unknown subtitle format %s", __func__, state.subtitles);
+      display_valid_parameters(argv[0]);
+      exit(1);
+   }
+
+   std::vector <MotionDetector::Zone> zones;
+
+   if (state.zones && !MotionDetector::parseZones(state.zones, &zones))
+   {
+      vcos_log_error("%s: Invalid surveillance zones %s", __func__, state.zones);
+      display_valid_parameters(argv[0]);
+      exit(1);
+   }
+
+   // The preview port carries the live stream, or else just enough for the detector.
+   if (state.live)
+   {
+      state.preview_width = state.live_width;
+      state.preview_height = state.live_height;
+   }
+   else
+   {
+      state.preview_width = (state.width / SURVEIL_PREVIEW_DIVISOR) & ~1U;
+      state.preview_height = (state.height / SURVEIL_PREVIEW_DIVISOR) & ~1U;
+   }
+
+   Calibration calibration;
+
+   if (state.calibration && !calibration.load(state.calibration))
+   {
+      vcos_log_error("%s: Unable to load the calibration %s", __func__, state.calibration);
+      exit(1);
+   }
+
    if (state.verbose)
    {
       fprintf(stderr, "\n%s Camera App %s\n\n", basename(argv[0]), VERSION_STRING);
       dump_status(&state);
    }
 
+   Queue queue;
+   unsigned long long queue_dropped = 0; // Full queue : the encoder callback fell behind, or the camera took too long.
+   Session session (state.directory, writer.get ());
+   session.subtitles().setFormat(subtitles);
+   RuleEngine rules (session.telemetry ());
+
+   if (state.rules ? !rules.load(state.rules) : !rules.compile(RuleEngine::DEFAULT_RULES, "built in rules"))
+   {
+      vcos_log_error("%s: Unable to compile the event rules", __func__);
+      exit(1);
+   }
+
+   if (state.verbose)
+      rules.subscribe([] (const char *rule, bool active, uint64_t time) {
+         fprintf(stderr, "rule %s %s at %" PRIu64 " us\n", rule, (active) ? "fired" : "ended", time);
+      });
+   LatencyStats frame_interval;
+   std::unique_ptr <Overlay> overlay;
+   std::unique_ptr <MotionAnalyzer> motion;
+   std::unique_ptr <MotionDetector> detector;
+   std::unique_ptr <PreEventRing> ring;
+   std::unique_ptr <SegmentWriter> live_writer;
+   std::unique_ptr <LiveStream> live;
+
+   if (state.overlay)
+      overlay.reset(new Overlay(state.width, state.height, VCOS_ALIGN_UP(state.width, 32), VCOS_ALIGN_UP(state.height, 16)));
+
+   if (state.motion)
+      motion.reset(new MotionAnalyzer(state.width, state.height));
+
+   if (state.surveil)
+   {
+      detector.reset(new MotionDetector(state.preview_width, state.preview_height, VCOS_ALIGN_UP(state.preview_width, 32), zones));
+      ring.reset(new PreEventRing(size_t(state.park_bitrate / 8) * PRE_EVENT_SECONDS));
+   }
+
+   // A writer thread of its own : the live encoder callback hands buffers over and never
+   // waits for the card, which the archive keeps busy.
+   if (state.live)
+   {
+      live_writer.reset(SegmentWriter::create("direct"));
+      live.reset(new LiveStream(live_writer.get()));
+   }
+
+   if (state.realtime)
+   {
+      // Writer pools and the queue exist by now, MCL_FUTURE takes care of the rest.
+      realtime::lockMemory();
+      writer->configureThread(state.writer_cpu, realtime::WRITER_PRIORITY);
+
+      if (live_writer)
+         live_writer->configureThread(state.writer_cpu, realtime::LIVE_WRITER_PRIORITY);
+   }
+
+   // Everything the main thread waits for goes through one epoll loop : shield data,
+   // signals, events from the encoder callback and timers.
+   EventLoop loop;
+   Notifier events;
+   Notifier started;
+   Shield shield (PORT, state.shield_baud);
+   shield.setCalibration(calibration);
+
+   loop.addSignals([&loop, &interrupted] (uint32_t signo) {
+      vcos_log_error("Caught signal %u, stopping", signo);
+      interrupted = true;
+      loop.stop();
+   });
+
+   // Shield ingest starts right away. Frames wait in the queue until video is live.
+   Decimator decimator (state.decimate_rate);
+   DerivedMetrics metrics;
+   GearEstimator gears;
+   LoadHistogram histogram;
+
+   // 1 s, 10 s and 60 s of the queued stream, sized for the decimated rate (with a margin) or for a 1 kHz shield.
+   RollingStats stats ({ { "velocity", &Frame::velocity }, { "rpm", &Frame::rpm }, { "engine", &Frame::engineTemp } },
+                       { 1000, 10000, 60000 }, (state.decimate_rate) ? 2 * state.decimate_rate : MAX_SHIELD_HZ);
+   LinkMonitor link (shield, loop, session.telemetry(), state.link_timeout, [&queue, &queue_dropped, &decimator, &metrics, &gears, &histogram] (Frame const &frame) {
+      Frame out;
+
+      if (decimator.push(frame, out))
+      {
+         metrics.update(out);
+         gears.update(out);
+         histogram.add(out);
+
+         if (!queue.push(out))
+            ++queue_dropped;
+      }
+   });
+   CommandChannel commands (shield, loop, session.telemetry());
+
    // OK, we have a nice set of parameters. Now set up our components
    // We have three components. Camera, Preview and encoder.
+   // They don't depend on each other until connect_ports, so they are created in parallel,
+   // and the session (manifest, ride directory, first segment file) is prepared on the card
+   // at the same time. The main loop keeps reading the shield meanwhile.
+   {
+      std::atomic <int> pending {3};
+      auto done = [&pending, &started] { if (--pending == 0) started.notify(); };
+
+      loop.watch(started, [&loop] (uint32_t) { loop.stop(); });
+
+      std::thread storage_thread([&] { storage_ok = session.start() && session.openSegment(); done(); });
+      std::thread encoder_thread([&] { encoder_ok = create_encoder_component(&state) != 0 && (!state.live || create_live_components(&state) != 0); done(); });
+      std::thread camera_thread([&] { camera_ok = create_camera_component(&state) != 0; done(); });
+
+      loop.run();
 
-   if (!create_camera_component(&state))
+      camera_thread.join();
+      encoder_thread.join();
+      storage_thread.join();
+   }
+
+   // Not before : threads created by the main thread would inherit its SCHED_FIFO priority.
+   if (state.realtime)
+      realtime::configureThread(pthread_self(), "ingest", state.ingest_cpu, realtime::INGEST_PRIORITY);
+
+   if (state.verbose)
+      fprintf(stderr, "Components created in %" PRIu64 " ms\n", (monotonicUs() - start_time) / 1000);
+
+   if (!camera_ok)
    {
       vcos_log_error("%s: Failed to create camera component", __func__);
+
+      if (encoder_ok)
+      {
+         destroy_live_components(&state);
+         destroy_encoder_component(&state);
+      }
    }
-   else if (!create_encoder_component(&state))
+   else if (!encoder_ok)
    {
       vcos_log_error("%s: Failed to create encode component", __func__);
+      destroy_live_components(&state);
+      destroy_encoder_component(&state);
       destroy_camera_component(&state);
    }
    else
    {
       PORT_USERDATA callback_data;
-      Queue queue;
+      ParkingMonitor parking (uint64_t (state.park_delay) * 1000000);
+      ParkingMonitor::State profile = ParkingMonitor::MOVING;
+      BitrateController controller (state.bitrate, state.bitrate_floor, (state.bitrate_ceiling) ? state.bitrate_ceiling : state.bitrate);
 
       if (state.verbose)
          fprintf(stderr, "Starting component connection stage\n");
@@ -763,8 +1921,21 @@ int main(int argc, const char **argv)
          if (state.verbose)
             fprintf(stderr, "Connecting camera stills port to encoder input port\n");
 
-         // Now connect the camera to the encoder
-         status = connect_ports(camera_video_port, encoder_input_port, &state.encoder_connection);
+         // Now connect the camera to the encoder, through the ARM when there is an overlay to draw
+         if (overlay)
+         {
+            // The camera buffers are passed on as they are, so both ends have to map them the
+            // same way : a failure here would mean corrupted or missing video, not just slower.
+            if (mmal_port_parameter_set_boolean(encoder_input_port, MMAL_PARAMETER_ZERO_COPY, 1) != MMAL_SUCCESS)
+            {
+               vcos_log_error("%s: Unable to set zero copy on the encoder input port, -overlay can't work", __func__);
+               goto error;
+            }
+
+            status = connect_ports(camera_video_port, encoder_input_port, &state.encoder_connection, overlay_connection_callback, overlay.get());
+         }
+         else
+            status = connect_ports(camera_video_port, encoder_input_port, &state.encoder_connection);
 
          if (status != MMAL_SUCCESS)
          {
@@ -796,14 +1967,81 @@ int main(int argc, const char **argv)
 //            }
          }
 
+         if (!storage_ok)
+         {
+            vcos_log_error("%s: Failed to start the session in %s", __func__, state.directory);
+            goto error;
+         }
+
+         if (interrupted)
+            goto error;
+
+         histogram.setPath(session.getRideDir() + "/histogram.csv");
+
+         // The telemetry log opened with the session, after the link may have come up.
+         link.report();
+
+         link.onUp([&] { configureShield(&state, &commands, parking.getState()); });
+
+         // Commands need the protocol version, known from the first frame on. Before that
+         // onUp takes care of it.
+         if (link.isUp() && shield.getVersion())
+            configureShield(&state, &commands, parking.getState());
+
          // Set up our userdata - this is passed though to the callback where we need the information.
-         callback_data.file_handle = rotateFiles (NULL);
+         callback_data.session = &session;
          callback_data.pstate = &state;
          callback_data.abort = 0;
+         callback_data.events = &events;
          callback_data.queue = &queue;
+         callback_data.parking = &parking;
+         callback_data.start_time = start_time;
+         callback_data.first_frame = 0;
+         callback_data.frame_start = 1;
+         callback_data.buffers = 0;
+         callback_data.frame_interval = &frame_interval;
+         callback_data.last_frame_time = 0;
+         callback_data.stats = &stats;
+         callback_data.rules = &rules;
+         callback_data.overlay = overlay.get();
+         callback_data.motion = motion.get();
+         callback_data.detector = detector.get();
+         callback_data.ring = ring.get();
+         callback_data.surveilling = 0;
+         callback_data.live = live.get();
+         callback_data.last_stats = 0;
 
          encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&callback_data;
 
+         // The controller starts from the bitrate clamped to its floor and ceiling, the encoder has to as well.
+         setBitrate(encoder_output_port, controller.getBitrate(), session.telemetry(), "initial");
+
+         if (live)
+         {
+            if (!live->start(session.getRideDir(), state.live_shm))
+               vcos_log_error("%s: Live stream segments and shared memory unavailable", __func__);
+
+            if ((status = connect_live_pipeline(&state, &callback_data)) != MMAL_SUCCESS)
+               goto error;
+
+            live_output_port = state.live_encoder_component->output[0];
+            live_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&callback_data;
+
+            if ((status = mmal_port_enable(live_output_port, live_buffer_callback)) != MMAL_SUCCESS)
+            {
+               vcos_log_error("Failed to setup the live encoder output");
+               goto error;
+            }
+
+            int num = mmal_queue_length(state.live_pool->queue);
+
+            for (int q = 0; q < num; q++)
+            {
+               if (mmal_port_send_buffer(live_output_port, mmal_queue_get(state.live_pool->queue)) != MMAL_SUCCESS)
+                  vcos_log_error("Unable to send a buffer to the live encoder output port (%d)", q);
+            }
+         }
+
          if (state.verbose)
             fprintf(stderr, "Enabling encoder output port\n");
 
@@ -820,20 +2058,9 @@ int main(int argc, const char **argv)
             // Only encode stuff if we have a filename and it opened
             if (output_file)
             {
-               int wait;
-
                if (state.verbose)
                   fprintf(stderr, "Starting video capture\n");
 
-               // Start shield process;
-                std::thread t {shieldThread, std::string (PORT), &queue};
-                t.detach ();
-
-               if (mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
-               {
-                  goto error;
-               }
-
                // Send all the buffers to the encoder output port
                {
                   int num = mmal_queue_length(state.encoder_pool->queue);
@@ -851,26 +2078,59 @@ int main(int argc, const char **argv)
                   }
                }
 
-               // Now wait until we need to stop. Whilst waiting we do need to check to see if we have aborted (for example
-               // out of storage space)
-               // Going to check every ABORT_INTERVAL milliseconds
+               // Enabled once parked, see applyProfile.
+               if (detector && !live)
+                  camera_preview_port->userdata = (struct MMAL_PORT_USERDATA_T *)&callback_data;
 
-               for (wait = 0; state.timeout == 0 || wait < state.timeout; wait+= ABORT_INTERVAL)
+               // Buffers are in place before capture starts, so the first frame doesn't wait for them.
+               if (mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
                {
-                  vcos_sleep(ABORT_INTERVAL);
-                  if (callback_data.abort)
-                     break;
+                  goto error;
                }
 
+               if (state.park_delay)
+                  parking.beginPhase(ParkingMonitor::MOVING, 0, state.bitrate, session.telemetry());
+
+               // Now wait until we need to stop : a signal, the timeout, or an abort from the
+               // callback (for example out of storage space). The callback also wakes us up
+               // when the parking state changes.
+               loop.watch(events, [&] (uint32_t) {
+                  if (callback_data.abort)
+                  {
+                     loop.stop();
+                     return;
+                  }
+
+                  if (parking.getState() != profile)
+                  {
+                     profile = parking.getState();
+                     applyProfile(&state, profile, &controller, &parking, &session, &commands);
+                  }
+               });
+
+               loop.addTimer(BitrateController::TICK_MS, true, [&] (uint32_t) {
+                  updateBitrate(encoder_output_port, &controller, &session);
+               });
+
+               // Only a copy of the counts here : the file I/O and the fsyncs run in the histogram's own thread.
+               loop.addTimer(STATS_INTERVAL_US / 1000, true, [&histogram] (uint32_t) { histogram.requestSave(); });
+
+               if (state.timeout)
+                  loop.addTimer(state.timeout, false, [&loop] (uint32_t) { loop.stop(); });
+
+               loop.run();
+
+               allocation::disarm();
+
                if (state.verbose)
                   fprintf(stderr, "Finished capture\n");
             }
             else
             {
                if (state.timeout)
-                  vcos_sleep(state.timeout);
-               else
-                  for (;;) vcos_sleep(ABORT_INTERVAL);
+                  loop.addTimer(state.timeout, false, [&loop] (uint32_t) { loop.stop(); });
+
+               loop.run();
             }
 
 
@@ -885,6 +2145,15 @@ error:
       check_disable_port(camera_still_port);
       check_disable_port(encoder_output_port);
 
+      if (detector && !live)
+         check_disable_port(camera_preview_port);
+
+      check_disable_port(live_output_port);
+
+      if (state.live_connection)
+         mmal_connection_destroy(state.live_connection);
+
+
       mmal_connection_destroy(state.encoder_connection);
 
       // Can now close our file. Note disabling ports may flush buffers which causes
@@ -892,13 +2161,69 @@ error:
       if (output_file && output_file != stdout)
          fclose(output_file);
 
+      // No more callbacks : whatever the shield sent meanwhile goes to the log from here.
+      if (encoder_output_port && encoder_output_port->userdata)
+         consumeFrames(&callback_data);
+
+      // Writes the manifest entry of the last segment.
+      session.closeSegment ();
+
+      // A card which does not respond won't hold the shutdown forever. Past the deadline
+      // the writer throws away what is still queued (the manifest already describes the
+      // segment), only the write in progress is waited for.
+      if (!writer->sync (SHUTDOWN_DEADLINE_MS))
+         vcos_log_error("%s: writer did not drain in %u ms", __func__, SHUTDOWN_DEADLINE_MS);
+      writer->latency ().print (stderr, writer->name ());
+      link.print (stderr);
+      commands.print (stderr);
+      decimator.print (stderr);
+      metrics.print (stderr);
+      metrics.report (session.telemetry ());
+      stats.report (session.telemetry ());
+      histogram.save ();
+      gears.print (stderr);
+
+      if (overlay)
+         overlay->cost ().print (stderr, "overlay");
+
+      if (motion)
+         motion->print (stderr);
+
+      if (detector)
+         detector->print (stderr);
+
+      if (live)
+      {
+         live->stop ();
+
+         if (!live_writer->sync (SHUTDOWN_DEADLINE_MS))
+            vcos_log_error("%s: live writer did not drain in %u ms", __func__, SHUTDOWN_DEADLINE_MS);
+         live->print (stderr);
+      }
+
+      if (state.verbose)
+         stats.print (stderr);
+      frame_interval.print (stderr, (state.realtime) ? "shield frame interval (realtime)" : "shield frame interval");
+      session.telemetry ().event ("JITTER realtime=%d p50=%u p99=%u max=%u", state.realtime, frame_interval.percentile (0.5), frame_interval.percentile (0.99), frame_interval.max ());
+
+      if (writer->getDropped ())
+         fprintf(stderr, "%s : dropped %llu bytes\n", writer->name (), (unsigned long long)writer->getDropped ());
+
+      fprintf(stderr, "shield queue : dropped %llu frames\n", queue_dropped);
+      session.telemetry ().event ("QUEUE dropped=%llu", queue_dropped);
+
       /* Disable components */
+      if (state.live_encoder_component)
+         mmal_component_disable(state.live_encoder_component);
+
+
       if (state.encoder_component)
          mmal_component_disable(state.encoder_component);
 
       if (state.camera_component)
          mmal_component_disable(state.camera_component);
 
+      destroy_live_components(&state);
       destroy_encoder_component(&state);
       destroy_camera_component(&state);
 
@@ -908,6 +2233,12 @@ error:
    if (status != 0)
       raspicamcontrol_check_configuration(128);
 
+   if (allocation::violations())
+   {
+      fprintf(stderr, "%lu heap allocations in the steady state\n", allocation::violations());
+      return 2;
+   }
+
    return 0;
 }
 
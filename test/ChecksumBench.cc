@@ -0,0 +1,303 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <random>
+#include <vector>
+#include "Protocol.h"
+#include "Shield.h"
+
+/**
+ * The frame check of the shield protocol : the byte sum of v1 against the CRC-8 of v2.
+ *
+ * 1. False accepts. Frames of a simulated ride are encoded as v2, the check byte computed
+ *    both ways, then damaged (one or two bit flips, a burst, a dropped byte, a window
+ *    shifted along the stream). Counts how many of the damaged frames still validate.
+ *
+ * 2. Resync. A v1 and a v2 stream with random byte drops and bit flips go through the
+ *    real parser (Shield) over a pseudo terminal : bytes skipped before each resync (what
+ *    the link summary prints in production), frames lost and false frames let through.
+ *    Out of sync the parser tries every layout, so false v1 (sum) frames show up in the
+ *    v2 stream too.
+ *
+ * Deterministic : the same arguments give the same numbers.
+ */
+using namespace protocol;
+
+typedef std::mt19937 Random;
+
+/// Telemetry of a ride : slow channels, a 1 kHz tick, the odd brake and blinker.
+static Frame rideFrame (unsigned int i, Random &random)
+{
+        double t = i / 1000.0;
+        std::uniform_real_distribution <float> noise (-1, 1);
+        Frame f;
+        f.sequence = uint8_t (i);
+        f.tick = uint16_t (i * 1000 / TICK_US);
+        f.velocity = 60 + 20 * sin (t / 7) + noise (random);
+        f.rpm = f.velocity * 80 + 200 * sin (t * 3) + 20 * noise (random);
+        f.engineTemp = 90;
+        f.airTemp = 20;
+        f.frontBrake = fmod (t, 11) < 1;
+        f.leftTurn = fmod (t, 30) < 3;
+        return f;
+}
+
+template <typename Check> static bool valid (uint8_t const *d)
+{
+        return d[0] == V2::COMMAND && Check::compute (d, 1, V2::SIZE - 1) == d[V2::SIZE - 1];
+}
+
+/*****************************************************************************/
+
+struct Damage {
+        const char *name;
+        unsigned long trials = 0;
+        unsigned long sumAccepts = 0;
+        unsigned long crcAccepts = 0;
+};
+
+static void falseAccepts (unsigned int frames, Random &random)
+{
+        Calibration calibration;
+        std::vector <uint8_t> sumStream, crcStream;
+
+        for (unsigned int i = 0; i < frames; ++i) {
+                uint8_t d[V2::SIZE];
+                V2::encode (rideFrame (i, random), d, calibration);
+                crcStream.insert (crcStream.end (), d, d + V2::SIZE);
+                d[V2::SIZE - 1] = Sum8::compute (d, 1, V2::SIZE - 1);
+                sumStream.insert (sumStream.end (), d, d + V2::SIZE);
+        }
+
+        enum { ONE_BIT, TWO_BITS, BURST, DROP, SHIFT, DAMAGES };
+        Damage damages[DAMAGES];
+        damages[ONE_BIT].name = "1 bit flipped";
+        damages[TWO_BITS].name = "2 bits flipped";
+        damages[BURST].name = "3 byte burst";
+        damages[DROP].name = "byte dropped";
+        damages[SHIFT].name = "shifted window";
+
+        std::uniform_int_distribution <unsigned int> byte (0, 255);
+        std::uniform_int_distribution <unsigned int> bit (8, (V2::SIZE - 1) * 8 - 1); // Not the start byte.
+
+        for (unsigned int i = 0; i + 1 < frames; ++i) {
+                for (unsigned int k = 0; k < DAMAGES; ++k) {
+                        uint8_t sum[V2::SIZE + 1], crc[V2::SIZE + 1];
+                        size_t at = size_t (i) * V2::SIZE;
+                        memcpy (sum, &sumStream[at], V2::SIZE + 1);
+                        memcpy (crc, &crcStream[at], V2::SIZE + 1);
+
+                        // The same damage to both.
+                        auto flip = [&sum, &crc] (unsigned int b) { sum[b / 8] ^= 1 << (b % 8); crc[b / 8] ^= 1 << (b % 8); };
+
+                        if (k == ONE_BIT || k == TWO_BITS) {
+                                unsigned int first = bit (random);
+                                unsigned int second = first;
+
+                                while (k == TWO_BITS && second == first) {
+                                        second = bit (random);
+                                }
+
+                                flip (first);
+
+                                if (k == TWO_BITS) {
+                                        flip (second);
+                                }
+                        }
+                        else if (k == BURST) {
+                                unsigned int first = 1 + byte (random) % (V2::SIZE - 3);
+
+                                for (unsigned int j = first; j < first + 3; ++j) {
+                                        sum[j] = crc[j] = uint8_t (byte (random));
+                                }
+                        }
+                        else if (k == DROP) {
+                                unsigned int lost = 1 + byte (random) % (V2::SIZE - 1);
+                                memmove (sum + lost, sum + lost + 1, V2::SIZE - lost);
+                                memmove (crc + lost, crc + lost + 1, V2::SIZE - lost);
+                        }
+                        else {
+                                // Every window starting inside the frame which looks like a frame start.
+                                for (unsigned int s = 1; s < V2::SIZE; ++s) {
+                                        if (sumStream[at + s] == V2::COMMAND) {
+                                                ++damages[k].trials;
+                                                damages[k].sumAccepts += valid <Sum8> (&sumStream[at + s]);
+                                                damages[k].crcAccepts += valid <Crc8> (&crcStream[at + s]);
+                                        }
+                                }
+
+                                continue;
+                        }
+
+                        ++damages[k].trials;
+                        damages[k].sumAccepts += valid <Sum8> (sum);
+                        damages[k].crcAccepts += valid <Crc8> (crc);
+                }
+        }
+
+        printf ("False accepts, %u byte frames of a simulated ride :\n", V2::SIZE);
+        printf ("  %-16s %10s %12s %12s\n", "damage", "trials", "sum", "crc-8");
+
+        for (Damage const &d : damages) {
+                printf ("  %-16s %10lu %11.4f%% %11.4f%%\n", d.name, d.trials, (d.trials) ? 100.0 * d.sumAccepts / d.trials : 0.0,
+                        (d.trials) ? 100.0 * d.crcAccepts / d.trials : 0.0);
+        }
+}
+
+/*****************************************************************************/
+
+struct Sent {
+        std::vector <uint8_t> bytes;
+        std::vector <Frame> frames; // As decoded from the undamaged bytes.
+};
+
+template <typename Layout> static Sent encodeStream (unsigned int frames, Random &random)
+{
+        Calibration calibration;
+        Sent sent;
+
+        for (unsigned int i = 0; i < frames; ++i) {
+                uint8_t d[Layout::SIZE];
+                Layout::encode (rideFrame (i, random), d, calibration);
+                sent.bytes.insert (sent.bytes.end (), d, d + Layout::SIZE);
+                Frame f;
+                Layout::decode (d, f, calibration);
+                sent.frames.push_back (f);
+        }
+
+        return sent;
+}
+
+static bool same (Frame const &a, Frame const &b, bool v2)
+{
+        return a.velocity == b.velocity && a.rpm == b.rpm && a.engineTemp == b.engineTemp && a.airTemp == b.airTemp &&
+               a.frontBrake == b.frontBrake && a.rearBrake == b.rearBrake && a.leftTurn == b.leftTurn && a.rightTurn == b.rightTurn &&
+               a.parkingLight == b.parkingLight && (!v2 || (a.sequence == b.sequence && a.tick == b.tick));
+}
+
+/**
+ * Pushes the damaged stream through a Shield on a pty. Received frames are matched in order
+ * against the sent ones, anything which matches none of the next few is a false accept.
+ */
+static bool resync (const char *name, Sent const &sent, bool v2, double drop, double flipRate, Random &random)
+{
+        int master = posix_openpt (O_RDWR | O_NOCTTY);
+
+        if (master < 0 || grantpt (master) < 0 || unlockpt (master) < 0) {
+                perror ("posix_openpt");
+                return false;
+        }
+
+        Shield shield (ptsname (master));
+
+        if (!shield.isOpen ()) {
+                fprintf (stderr, "Unable to open %s\n", ptsname (master));
+                close (master);
+                return false;
+        }
+
+        std::vector <uint8_t> damaged;
+        std::uniform_real_distribution <double> uniform (0, 1);
+        std::uniform_int_distribution <unsigned int> bit (0, 7);
+
+        for (uint8_t b : sent.bytes) {
+                if (uniform (random) < drop) {
+                        continue;
+                }
+
+                if (uniform (random) < flipRate) {
+                        b ^= 1 << bit (random);
+                }
+
+                damaged.push_back (b);
+        }
+
+        static const size_t CHUNK = 256; // Well below the pty buffer.
+        static const size_t LOOKAHEAD = 8;
+        size_t next = 0;
+        unsigned long received = 0, falseAccepts[3] = {};
+
+        for (size_t at = 0; at < damaged.size (); at += CHUNK) {
+                size_t n = std::min (CHUNK, damaged.size () - at);
+
+                if (write (master, &damaged[at], n) != ssize_t (n)) {
+                        perror ("write");
+                        close (master);
+                        return false;
+                }
+
+                while (shield.getStats ().bytes < at + n) {
+                        struct pollfd p = { shield.fd (), POLLIN, 0 };
+
+                        if (poll (&p, 1, 1000) <= 0) {
+                                fprintf (stderr, "%s : the pty went quiet\n", name);
+                                close (master);
+                                return false;
+                        }
+
+                        Frame frame;
+
+                        while (shield.read (frame)) {
+                                ++received;
+                                size_t j = next;
+
+                                while (j < sent.frames.size () && j < next + LOOKAHEAD && !same (frame, sent.frames[j], v2)) {
+                                        ++j;
+                                }
+
+                                if (j < sent.frames.size () && j < next + LOOKAHEAD) {
+                                        next = j + 1;
+                                }
+                                else {
+                                        ++falseAccepts[frame.version];
+                                }
+                        }
+                }
+        }
+
+        LatencyStats const &r = shield.getResyncBytes ();
+        LinkStats const &s = shield.getStats ();
+        printf ("  %-8s %8zu %8lu %8lu %8lu %10llu %6u %6u %6u %6u\n", name, sent.frames.size (), received - falseAccepts[1] - falseAccepts[2],
+                falseAccepts[1], falseAccepts[2],
+                (unsigned long long)s.checksumErrors, r.count (), r.percentile (0.5), r.percentile (0.99), r.max ());
+
+        close (master);
+        return true;
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+        if (argc > 1 && !strcmp (argv[1], "-h")) {
+                fprintf (stderr, "Usage : %s [frames (200000)] [byte drop rate (0.003)] [bit flip rate (0.003)] [seed (1)]\n", argv[0]);
+                return 1;
+        }
+
+        unsigned int frames = (argc > 1) ? atoi (argv[1]) : 200000;
+        double drop = (argc > 2) ? atof (argv[2]) : 0.003;
+        double flip = (argc > 3) ? atof (argv[3]) : 0.003;
+        Random random ((argc > 4) ? atoi (argv[4]) : 1);
+
+        falseAccepts (frames, random);
+
+        printf ("\nResync through Shield, %.2f%% bytes dropped, %.2f%% bytes with a bit flipped :\n", drop * 100, flip * 100);
+        printf ("  %-8s %8s %8s %8s %8s %10s %6s %6s %6s %6s\n", "", "sent", "good", "false v1", "false v2", "cksum err", "resync", "p50", "p99",
+                "max");
+
+        bool ok = resync ("v1 sum", encodeStream <V1> (frames, random), false, drop, flip, random);
+        ok = resync ("v2 crc-8", encodeStream <V2> (frames, random), true, drop, flip, random) && ok;
+        return (ok) ? 0 : 1;
+}
@@ -0,0 +1,299 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <random>
+#include <vector>
+#include "Decimator.h"
+#include "Clock.h"
+
+/**
+ * Decimator on synthetic shield streams at the given input rate, down to the output rate :
+ *
+ * 1. reference : a ride (velocity and rpm with some noise) against the same filter chain
+ *    in double precision (boxcar CIC, half-band taps from std::sin). Also the cost,
+ *
+ * 2. DC gain, a step (rise time, overshoot, where the delay corrected output crosses the
+ *    middle), a tone in the pass band and one which would alias (0.75 of the output rate) :
+ *    at least 50 dB down with the half-band (even factors), 25 dB with the CIC alone,
+ *
+ * 3. warmup : the input rate halves half way through, on a constant input. Nothing which
+ *    comes out may be off the constant, and time may not go backwards.
+ *
+ * Deterministic, apart from the cost.
+ */
+typedef std::function <double (double)> Signal; // Of time in seconds.
+
+struct Output {
+        size_t input; // Index of the input sample which produced it.
+        Frame frame;
+};
+
+static const double DC_TOLERANCE = 2.0 / 256; // Q8 truncation on the way in, rounding on the way out.
+
+/// Pushes seconds of the signal (velocity, and rpm = 100 × it) at hz, from start on.
+static void feed (Decimator &decimator, Signal const &signal, unsigned int hz, double seconds, uint64_t &time, std::vector <double> &input,
+                  std::vector <Output> &outputs, uint64_t *costNs = nullptr)
+{
+        size_t n = size_t (seconds * hz);
+        size_t base = input.size ();
+        std::vector <Frame> frames (n);
+
+        // Generated up front, so the cost is the filters' alone.
+        for (size_t i = 0; i < n; ++i, time += 1000000 / hz) {
+                double v = signal (time / 1e6);
+                frames[i].timestamp = frames[i].sampleTime = time;
+                frames[i].version = 2;
+                frames[i].velocity = float (v);
+                frames[i].rpm = float (v * 100);
+                input.push_back (frames[i].velocity);
+        }
+
+        outputs.reserve (outputs.size () + n);
+        uint64_t start = monotonicNs ();
+
+        for (size_t i = 0; i < n; ++i) {
+                Frame out;
+
+                if (decimator.push (frames[i], out)) {
+                        outputs.push_back ({ base + i, out });
+                }
+        }
+
+        if (costNs) {
+                *costNs += monotonicNs () - start;
+        }
+}
+
+/// Impulse response of the whole chain for factor m, per input sample, in double precision.
+static std::vector <double> reference (unsigned int m)
+{
+        static const unsigned int ORDER = 3;
+        static const unsigned int TAPS = 15;
+        bool firStage = (m % 2 == 0);
+        unsigned int r = (firStage) ? m / 2 : m;
+
+        // CIC : boxcar of r, ORDER times over, normalized.
+        std::vector <double> cic (1, 1.0);
+
+        for (unsigned int k = 0; k < ORDER; ++k) {
+                std::vector <double> next (cic.size () + r - 1, 0.0);
+
+                for (size_t i = 0; i < cic.size (); ++i) {
+                        for (unsigned int j = 0; j < r; ++j) {
+                                next[i + j] += cic[i] / r;
+                        }
+                }
+
+                cic.swap (next);
+        }
+
+        if (!firStage) {
+                return cic;
+        }
+
+        double h[TAPS], sum = 0;
+
+        for (unsigned int i = 0; i < TAPS; ++i) {
+                int k = int (i) - int (TAPS / 2);
+                double ideal = (k == 0) ? 0.5 : sin (dsp::PI * k / 2) / (dsp::PI * k);
+                h[i] = ideal * (0.54 - 0.46 * cos (2 * dsp::PI * i / (TAPS - 1)));
+                sum += h[i];
+        }
+
+        std::vector <double> g (cic.size () + (TAPS - 1) * r, 0.0);
+
+        for (unsigned int j = 0; j < TAPS; ++j) {
+                for (size_t k = 0; k < cic.size (); ++k) {
+                        g[j * r + k] += h[j] / sum * cic[k];
+                }
+        }
+
+        return g;
+}
+
+static double convolve (std::vector <double> const &g, std::vector <double> const &x, size_t n)
+{
+        double y = 0;
+
+        for (size_t k = 0; k < g.size () && k <= n; ++k) {
+                y += g[k] * x[n - k];
+        }
+
+        return y;
+}
+
+/// Peak deviation of the velocity from mean, over the outputs from first on.
+static double amplitude (std::vector <Output> const &outputs, size_t first)
+{
+        double mean = 0, peak = 0;
+
+        for (size_t i = first; i < outputs.size (); ++i) {
+                mean += outputs[i].frame.velocity;
+        }
+
+        mean /= outputs.size () - first;
+
+        for (size_t i = first; i < outputs.size (); ++i) {
+                peak = std::max (peak, fabs (outputs[i].frame.velocity - mean));
+        }
+
+        return peak;
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+        if (argc > 1 && !strcmp (argv[1], "-h")) {
+                fprintf (stderr, "Usage : %s [input Hz (1000)] [output Hz (100)] [seconds (600)]\n", argv[0]);
+                return 1;
+        }
+
+        unsigned int inputHz = (argc > 1) ? atoi (argv[1]) : 1000;
+        unsigned int outputHz = (argc > 2) ? atoi (argv[2]) : 100;
+        double seconds = (argc > 3) ? atof (argv[3]) : 600;
+        bool ok = true;
+
+        // Below that the halved rate of 3. would be passed through, nothing to check.
+        if (!outputHz || inputHz < 3 * outputHz) {
+                fprintf (stderr, "The input rate has to be at least 3 times the output rate\n");
+                return 1;
+        }
+
+        // 1. Against the reference.
+        {
+                std::mt19937 random (1);
+                std::normal_distribution <double> noise (0, 0.3);
+                Decimator decimator (outputHz);
+                std::vector <double> input;
+                std::vector <Output> outputs;
+                uint64_t time = 1000000, costNs = 0;
+                Signal ride = [&noise, &random] (double t) { return 60 + 20 * sin (t / 7) + 5 * sin (t * 3) + noise (random); };
+                feed (decimator, ride, inputHz, seconds, time, input, outputs, &costNs);
+
+                std::vector <double> g = reference (decimator.getFactor ());
+                double velocityError = 0, rpmError = 0;
+
+                for (Output const &o : outputs) {
+                        // Before that : passed through while the input rate was not known yet.
+                        if (o.input + 1 < g.size ()) {
+                                continue;
+                        }
+
+                        double y = convolve (g, input, o.input);
+                        velocityError = std::max (velocityError, fabs (o.frame.velocity - y));
+                        rpmError = std::max (rpmError, fabs (o.frame.rpm - 100 * y));
+                }
+
+                // Q15 taps : a relative error of a few 1e-4 on top of the Q8 rounding.
+                bool good = !outputs.empty () && velocityError < 0.05 && rpmError < 5;
+                ok = ok && good;
+                printf ("%u Hz -> %u Hz, factor %u, %zu outputs : max error against the reference velocity %.4f, rpm %.3f%s\n", inputHz, outputHz,
+                        decimator.getFactor (), outputs.size (), velocityError, rpmError, (good) ? "" : "  FAILED");
+
+                LatencyStats const &cost = decimator.cost ();
+                printf ("  cost : %.0f ns per input sample on average, sampled p50 %u ns, p99 %u ns, max %u ns\n", double (costNs) / input.size (),
+                        cost.percentile (0.5), cost.percentile (0.99), cost.max ());
+        }
+
+        double outputPeriod = 1.0 / outputHz;
+
+        // 2. DC, step, tones.
+        {
+                Decimator decimator (outputHz);
+                std::vector <double> input;
+                std::vector <Output> outputs;
+                uint64_t time = 1000000;
+                feed (decimator, [] (double) { return 42.5; }, inputHz, 2, time, input, outputs);
+                double dc = 0;
+
+                for (Output const &o : outputs) {
+                        dc = std::max (dc, fabs (o.frame.velocity - 42.5));
+                }
+
+                bool good = !outputs.empty () && dc <= DC_TOLERANCE;
+                ok = ok && good;
+                printf ("DC : max deviation %.4f%s\n", dc, (good) ? "" : "  FAILED");
+
+                // Step from 20 to 80 a second later.
+                double stepAt = time / 1e6 + 1;
+                size_t first = outputs.size ();
+                feed (decimator, [stepAt] (double t) { return (t < stepAt) ? 20.0 : 80.0; }, inputHz, 2, time, input, outputs);
+                double t10 = 0, t50 = 0, t90 = 0, peak = 0;
+
+                for (size_t i = first + 1; i < outputs.size (); ++i) {
+                        double y0 = outputs[i - 1].frame.velocity, y1 = outputs[i].frame.velocity;
+                        double s0 = outputs[i - 1].frame.sampleTime / 1e6, s1 = outputs[i].frame.sampleTime / 1e6;
+                        auto cross = [=] (double level, double &at) { if (!at && y0 < level && y1 >= level) at = s0 + (s1 - s0) * (level - y0) / (y1 - y0); };
+                        cross (26, t10);
+                        cross (50, t50);
+                        cross (74, t90);
+                        peak = std::max (peak, double (y1));
+                }
+
+                // The Hamming windowed half-band rings a little : about 5%.
+                double overshoot = (peak - 80) / 60 * 100;
+                good = t50 && fabs (t50 - stepAt) <= outputPeriod / 2 && overshoot < 7;
+                ok = ok && good;
+                printf ("Step : 10-90%% rise %.1f ms, overshoot %.2f%%, middle crossed %+.2f ms from the step%s\n", (t90 - t10) * 1000, overshoot,
+                        (t50 - stepAt) * 1000, (good) ? "" : "  FAILED");
+
+                // Tones : well inside the pass band, and where the output would alias them.
+                for (double fraction : { 0.1, 0.75 }) {
+                        Decimator d (outputHz);
+                        std::vector <double> in;
+                        std::vector <Output> out;
+                        uint64_t t = 1000000;
+                        double f = fraction * outputHz;
+                        feed (d, [f] (double s) { return 50 + 10 * sin (2 * dsp::PI * f * s); }, inputHz, 4, t, in, out);
+                        double gain = 20 * log10 (std::max (amplitude (out, out.size () / 4) / 10, 1e-9));
+
+                        // Odd factors have the CIC only : its first side lobe is all the rejection there is.
+                        good = (fraction < 0.5) ? gain > -1 : gain < ((d.getFactor () % 2) ? -25 : -50);
+                        ok = ok && good;
+                        printf ("Tone %.0f Hz (%.2f of the output rate) : %+.1f dB%s\n", f, fraction, gain, (good) ? "" : "  FAILED");
+                }
+        }
+
+        // 3. Warmup after the input rate changes.
+        {
+                Decimator decimator (outputHz);
+                std::vector <double> input;
+                std::vector <Output> outputs;
+                uint64_t time = 1000000;
+                Signal dc = [] (double) { return 42.5; };
+                feed (decimator, dc, inputHz, 2, time, input, outputs);
+                unsigned int before = decimator.getFactor ();
+                size_t first = outputs.size ();
+                feed (decimator, dc, inputHz / 2, 2, time, input, outputs);
+                double worst = 0;
+                uint64_t gap = 0;
+                unsigned int backwards = 0;
+
+                for (size_t i = 1; i < outputs.size (); ++i) {
+                        worst = std::max (worst, fabs (outputs[i].frame.velocity - 42.5));
+                        backwards += outputs[i].frame.sampleTime <= outputs[i - 1].frame.sampleTime;
+
+                        if (i >= first) {
+                                gap = std::max (gap, outputs[i].frame.timestamp - outputs[i - 1].frame.timestamp);
+                        }
+                }
+
+                bool good = decimator.getFactor () != before && worst <= DC_TOLERANCE && !backwards;
+                ok = ok && good;
+                printf ("Rate %u -> %u Hz, factor %u -> %u : outputs held back for %.0f ms, max deviation %.4f, time went backwards %u times%s\n",
+                        inputHz, inputHz / 2, before, decimator.getFactor (), gap / 1000.0, worst, backwards, (good) ? "" : "  FAILED");
+        }
+
+        return (ok) ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <vector>
+#include "MotionDetector.h"
+
+/**
+ * MotionDetector on synthetic preview frames of the given size (the Y plane of what the
+ * ISP gives with -surveil : a textured scene and sensor noise), one every INTERVAL_US :
+ *
+ * 1. the scene alone, noise only : must not trigger,
+ * 2. the light goes up by a third at once (a street light) : must not trigger,
+ * 3. someone walks through the picture : must trigger, how many frames it takes.
+ *
+ * Prints the cost per processed frame. Deterministic.
+ */
+static const unsigned int ALIGN_WIDTH = 32;
+static const unsigned int QUIET_FRAMES = 200;
+static const unsigned int LIGHT_FRAMES = 60;
+static const unsigned int WALK_FRAMES = 60;
+
+class Scene {
+public:
+
+        Scene (unsigned int width, unsigned int height, unsigned int stride) : width (width), height (height), stride (stride), plane (stride * height)
+        {
+                // Gradient and a few edges, like a wall and a pavement.
+                base.resize (width * height);
+
+                for (unsigned int y = 0; y < height; ++y) {
+                        for (unsigned int x = 0; x < width; ++x) {
+                                base[y * width + x] = 60 + 80 * y / height + (((x / 16) + (y / 12)) % 3) * 15;
+                        }
+                }
+        }
+
+        /// light : multiplier of the scene, walker : its left edge in percent of the width (< 0 : nobody).
+        uint8_t const *render (float light, int walker)
+        {
+                std::normal_distribution <float> noise (0, 3);
+                unsigned int x0 = (walker >= 0) ? walker * width / 100 : width;
+                unsigned int x1 = std::min (width, x0 + width / 10);
+                unsigned int y0 = height / 3;
+
+                for (unsigned int y = 0; y < height; ++y) {
+                        for (unsigned int x = 0; x < width; ++x) {
+                                float v = base[y * width + x] * light + noise (random);
+
+                                if (x >= x0 && x < x1 && y >= y0) {
+                                        v = 30 + noise (random); // Dark clothes.
+                                }
+
+                                plane[y * stride + x] = uint8_t (std::min (std::max (v, 0.0f), 255.0f));
+                        }
+                }
+
+                return plane.data ();
+        }
+
+private:
+
+        unsigned int width;
+        unsigned int height;
+        unsigned int stride;
+        std::vector <uint8_t> base;
+        std::vector <uint8_t> plane;
+        std::mt19937 random;
+};
+
+int main (int argc, char **argv)
+{
+        if (argc > 1 && !strcmp (argv[1], "-h")) {
+                fprintf (stderr, "Usage : %s [preview width (240)] [preview height (135)]\n", argv[0]);
+                return 1;
+        }
+
+        unsigned int width = (argc > 1) ? atoi (argv[1]) : 240;
+        unsigned int height = (argc > 2) ? atoi (argv[2]) : 135;
+        unsigned int stride = (width + ALIGN_WIDTH - 1) / ALIGN_WIDTH * ALIGN_WIDTH;
+
+        Scene scene (width, height, stride);
+        MotionDetector detector (width, height, stride, {});
+        uint64_t now = 1000000;
+        unsigned int quietTriggers = 0, lightTriggers = 0;
+        int detectedAfter = -1;
+
+        for (unsigned int i = 0; i < QUIET_FRAMES; ++i, now += MotionDetector::INTERVAL_US) {
+                quietTriggers += detector.process (scene.render (1, -1), now);
+        }
+
+        for (unsigned int i = 0; i < LIGHT_FRAMES; ++i, now += MotionDetector::INTERVAL_US) {
+                lightTriggers += detector.process (scene.render (1.33f, -1), now);
+        }
+
+        for (unsigned int i = 0; i < WALK_FRAMES && detectedAfter < 0; ++i, now += MotionDetector::INTERVAL_US) {
+                if (detector.process (scene.render (1.33f, i * 90 / WALK_FRAMES), now)) {
+                        detectedAfter = i;
+                }
+        }
+
+        printf ("%ux%u : %u triggers on noise, %u on the light change, walker detected after %d frames (%d ms)\n", width, height,
+                quietTriggers, lightTriggers, detectedAfter, (detectedAfter < 0) ? -1 : int (detectedAfter * MotionDetector::INTERVAL_US / 1000));
+        detector.cost ().print (stdout, "  per frame");
+        return (quietTriggers || lightTriggers || detectedAfter < 0) ? 1 : 0;
+}
@@ -0,0 +1,100 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "Overlay.h"
+
+/**
+ * Overlay::apply () on synthetic I420 frames of the given size, padded like main.cc pads
+ * them for the encoder. Two runs :
+ *
+ * - steady : the values change every 10th frame (100 Hz telemetry at 30 fps shows a few
+ *   digits changing now and then), so mostly just the blend,
+ * - changing : every cell differs from the previous frame, so all of them are rendered
+ *   again on top of the blend. The worst case.
+ *
+ * Prints the cost next to the frame period, and checks that only the strip under the
+ * line was touched.
+ */
+static const unsigned int ALIGN_WIDTH = 32;
+static const unsigned int ALIGN_HEIGHT = 16;
+
+static unsigned int alignUp (unsigned int v, unsigned int a) { return (v + a - 1) / a * a; }
+
+static Frame values (unsigned int i, bool changing)
+{
+        Frame f;
+        unsigned int k = (changing) ? i : i / 10;
+        f.velocity = 40 + k % 111 + ((changing) ? 0.0f : 0.5f * sinf (k));
+        f.rpm = 1000 + (k * 1237) % 11000;
+        f.engineTemp = 80 + k % 30;
+        f.airTemp = 10 + k % 20;
+        f.gear = 1 + k % 6;
+        f.leftTurn = (changing) ? k % 2 : (k / 30) % 2;
+        f.frontBrake = (changing) ? (k + 1) % 2 : (k / 17) % 2;
+        return f;
+}
+
+int main (int argc, char **argv)
+{
+        if (argc > 1 && !strcmp (argv[1], "-h")) {
+                fprintf (stderr, "Usage : %s [width (1920)] [height (1080)] [frames (900)] [fps (30)]\n", argv[0]);
+                return 1;
+        }
+
+        unsigned int width = (argc > 1) ? atoi (argv[1]) : 1920;
+        unsigned int height = (argc > 2) ? atoi (argv[2]) : 1080;
+        unsigned int frames = (argc > 3) ? atoi (argv[3]) : 900;
+        unsigned int fps = (argc > 4) ? atoi (argv[4]) : 30;
+        unsigned int stride = alignUp (width, ALIGN_WIDTH);
+        unsigned int rows = alignUp (height, ALIGN_HEIGHT);
+        size_t size = size_t (stride) * rows * 3 / 2;
+
+        // A few frames in turn, like the camera pool : the data is not in the cache already.
+        std::vector <std::vector <uint8_t>> pool (4, std::vector <uint8_t> (size));
+
+        for (std::vector <uint8_t> &frame : pool) {
+                for (size_t i = 0; i < size; ++i) {
+                        frame[i] = uint8_t (i * 7 + i / stride * 13);
+                }
+        }
+
+        std::vector <uint8_t> reference (pool[0]);
+        bool ok = true;
+
+        for (bool changing : { false, true }) {
+                Overlay overlay (width, height, stride, rows);
+
+                for (unsigned int i = 0; i < frames; ++i) {
+                        overlay.setFrame (values (i, changing));
+                        overlay.apply (pool[i % pool.size ()].data ());
+                }
+
+                LatencyStats const &cost = overlay.cost ();
+                printf ("%ux%u %s : %u frames, mean %u us, p50 %u us, p99 %u us, max %u us, %.2f%% of the %u us frame period\n", width, height,
+                        (changing) ? "changing" : "steady", cost.count (), cost.mean (), cost.percentile (0.5), cost.percentile (0.99), cost.max (),
+                        100.0 * cost.mean () * fps / 1e6, 1000000 / fps);
+        }
+
+        // The top half of the luma plane is never under the line.
+        if (memcmp (pool[0].data (), reference.data (), size_t (stride) * (height / 2))) {
+                fprintf (stderr, "apply () wrote outside the strip\n");
+                ok = false;
+        }
+
+        if (!memcmp (pool[0].data (), reference.data (), size)) {
+                fprintf (stderr, "apply () left the frame unchanged\n");
+                ok = false;
+        }
+
+        return (ok) ? 0 : 1;
+}
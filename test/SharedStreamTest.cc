@@ -0,0 +1,157 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+#include "SharedStream.h"
+
+/**
+ * SharedStream under a writer which never waits : a thread writes a known pattern in
+ * chunks of random size as fast as it can, while a reader in the main thread maps the
+ * segment on its own (like a live view process would) and follows the protocol from
+ * SharedStream.h. The capacity is small, so the writer laps the reader all the time.
+ *
+ * Every copy the protocol accepts is compared against the pattern : any difference is a
+ * torn read and fails the test. Prints how many copies were accepted, dropped by the
+ * check, and how often the reader was lapped before it could even start.
+ */
+static const size_t CAPACITY = 64 * 1024;
+static const size_t MAX_CHUNK = 8 * 1024;
+static const size_t COPY_SLICE = 4 * 1024;
+
+/// Stream byte n. Differs from byte n - CAPACITY, so data of the previous lap shows.
+static uint8_t pattern (uint32_t n) { return uint8_t (n + n / CAPACITY * 37); }
+
+int main (int argc, char **argv)
+{
+        if (argc > 1 && !strcmp (argv[1], "-h")) {
+                fprintf (stderr, "Usage : %s [megabytes (256)]\n", argv[0]);
+                return 1;
+        }
+
+        uint64_t total = uint64_t ((argc > 1) ? atoi (argv[1]) : 256) << 20;
+        char name[64];
+        snprintf (name, sizeof (name), "/moto-shared-test-%d", int (getpid ()));
+
+        SharedStream stream;
+
+        if (!stream.open (name, CAPACITY)) {
+                return 1;
+        }
+
+        int fd = shm_open (name, O_RDONLY, 0);
+        size_t mapped = sizeof (SharedStream::Header) + CAPACITY;
+        void *p = (fd < 0) ? MAP_FAILED : mmap (nullptr, mapped, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (fd >= 0) {
+                close (fd);
+        }
+
+        if (p == MAP_FAILED) {
+                perror ("shm_open / mmap");
+                return 1;
+        }
+
+        SharedStream::Header const *header = static_cast <SharedStream::Header const *> (p);
+        uint8_t const *data = static_cast <uint8_t const *> (p) + sizeof (SharedStream::Header);
+
+        if (header->magic != SharedStream::MAGIC || header->capacity != CAPACITY) {
+                fprintf (stderr, "Bad header\n");
+                return 1;
+        }
+
+        std::atomic <bool> done (false);
+
+        std::thread writer ([&stream, &done, total] {
+                std::vector <uint8_t> chunk (MAX_CHUNK);
+                std::mt19937 random (1);
+                std::uniform_int_distribution <size_t> size (1, MAX_CHUNK);
+                uint32_t n = 0;
+
+                for (uint64_t sent = 0; sent < total;) {
+                        size_t length = size (random);
+
+                        for (size_t i = 0; i < length; ++i) {
+                                chunk[i] = pattern (n + i);
+                        }
+
+                        stream.write (chunk.data (), length, false);
+                        n += length;
+                        sent += length;
+                        std::this_thread::yield ();
+                }
+
+                done = true;
+        });
+
+        std::vector <uint8_t> copy (CAPACITY);
+        unsigned long accepted = 0, dropped = 0, lapped = 0, torn = 0;
+        uint64_t checked = 0;
+        uint32_t position = 0;
+
+        while (!done) {
+                uint32_t written = header->written.load (std::memory_order_acquire);
+                uint32_t length = written - position;
+
+                if (!length) {
+                        continue;
+                }
+
+                if (length > CAPACITY) {
+                        // Lapped before even starting : catch up.
+                        ++lapped;
+                        position = written - CAPACITY / 2;
+                        continue;
+                }
+
+                // A slow reader, preempted now and then : the writer gets in the middle of the copy.
+                for (uint32_t i = 0; i < length; ++i) {
+                        copy[i] = data[(position + i) % CAPACITY];
+
+                        if (i % COPY_SLICE == COPY_SLICE - 1) {
+                                std::this_thread::yield ();
+                        }
+                }
+
+                std::atomic_thread_fence (std::memory_order_acquire);
+
+                if (header->writing.load (std::memory_order_relaxed) - position > CAPACITY) {
+                        ++dropped;
+                        position = written;
+                        continue;
+                }
+
+                ++accepted;
+                checked += length;
+
+                for (uint32_t i = 0; i < length; ++i) {
+                        if (copy[i] != pattern (position + i)) {
+                                ++torn;
+                                break;
+                        }
+                }
+
+                position = written;
+        }
+
+        writer.join ();
+        munmap (p, mapped);
+        stream.close ();
+
+        printf ("%llu MB written : %lu copies accepted (%llu bytes), %lu dropped, %lu lapped, %lu torn\n", (unsigned long long)(total >> 20), accepted,
+                (unsigned long long)checked, dropped, lapped, torn);
+        return (torn || !accepted) ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/lockfree/spsc_queue.hpp>
+#include "AllocationTracker.h"
+#include "Decimator.h"
+#include "DerivedMetrics.h"
+#include "GearEstimator.h"
+#include "LoadHistogram.h"
+#include "ParkingMonitor.h"
+#include "RollingStats.h"
+#include "RuleEngine.h"
+#include "Session.h"
+
+/**
+ * The steady state of the recording pipeline, without the camera : shield frames through
+ * the ingest path (Decimator, DerivedMetrics, GearEstimator, LoadHistogram) into the
+ * queue, and encoder sized buffers through the encoder callback path (segment rotation,
+ * Session, the writer, then everything consumeFrames does). After the same warm-up as main.cc the allocation
+ * tracker is armed, and any heap allocation fails the test.
+ *
+ * Built with MOTO_ALLOC_TRACKING. Run for both writers : buffered and direct.
+ */
+typedef boost::lockfree::spsc_queue <Frame, boost::lockfree::capacity <1024>> Queue;
+
+static const unsigned int WARMUP_BUFFERS = 300;
+static const unsigned int FRAMES_PER_FILE = 90;
+static const unsigned int FPS = 30;
+static const unsigned int SHIELD_HZ = 1000;
+static const uint64_t STATS_INTERVAL_US = 60000000;
+
+int main (int argc, char **argv)
+{
+        if (argc < 2 || !strcmp (argv[1], "-h")) {
+                fprintf (stderr, "Usage : %s buffered|direct [seconds of video (150)]\n", argv[0]);
+                return 1;
+        }
+
+        unsigned int seconds = (argc > 2) ? atoi (argv[2]) : 150;
+
+        if (!allocation::isTracking ()) {
+                fprintf (stderr, "Built without MOTO_ALLOC_TRACKING\n");
+                return 1;
+        }
+
+        char base[] = "/tmp/moto-steady-XXXXXX";
+
+        if (!mkdtemp (base)) {
+                perror ("mkdtemp");
+                return 1;
+        }
+
+        std::unique_ptr <SegmentWriter> writer (SegmentWriter::create (argv[1]));
+
+        if (!writer) {
+                fprintf (stderr, "Unknown writer %s\n", argv[1]);
+                return 1;
+        }
+
+        Session session (base, writer.get ());
+        session.subtitles ().setFormat (Subtitles::SRT);
+
+        if (!session.start () || !session.openSegment ()) {
+                return 1;
+        }
+
+        RuleEngine rules (session.telemetry ());
+
+        if (!rules.compile (RuleEngine::DEFAULT_RULES, "built in rules")) {
+                return 1;
+        }
+
+        Queue queue;
+        Decimator decimator (100);
+        DerivedMetrics metrics;
+        GearEstimator gears;
+        LoadHistogram histogram;
+        ParkingMonitor parking (180000000);
+        RollingStats stats ({ { "velocity", &Frame::velocity }, { "rpm", &Frame::rpm }, { "engine", &Frame::engineTemp } }, { 1000, 10000, 60000 }, 200);
+        LatencyStats frameInterval;
+        size_t frameSize = 17000000 / 8 / FPS;
+        std::vector <uint8_t> buffer (frameSize * 4);
+        uint64_t time = 1000000;
+        uint64_t lastStats = 0;
+        uint64_t lastFrame = 0;
+
+        for (unsigned int i = 0; i < seconds * FPS; ++i) {
+                if (i == WARMUP_BUFFERS) {
+                        allocation::arm ();
+                }
+
+                // Ingest : a riding bike, shield at 1 kHz.
+                for (unsigned int s = 0; s < SHIELD_HZ / FPS; ++s) {
+                        time += 1000000 / SHIELD_HZ;
+                        double t = time / 1e6;
+                        Frame in, out;
+                        in.timestamp = in.sampleTime = time;
+                        in.version = 2;
+                        in.velocity = 60 + 20 * sin (t / 7);
+                        in.rpm = in.velocity * 80 + 200 * sin (t * 3);
+                        in.engineTemp = 90;
+                        in.frontBrake = fmod (t, 11) < 1;
+
+                        if (decimator.push (in, out)) {
+                                metrics.update (out);
+                                gears.update (out);
+                                histogram.add (out);
+                                queue.push (out);
+                        }
+                }
+
+                // Encoder callback : what rotateFiles, encoder_buffer_callback and consumeFrames do.
+                bool keyframe = (i % FPS == 0);
+
+                if ((!session.isOpen () || session.getBuffersInSegment () > FRAMES_PER_FILE) && !session.openSegment ()) {
+                        return 1;
+                }
+
+                if (!session.write (buffer.data (), (keyframe) ? frameSize * 4 : frameSize, int64_t (i) * 1000000 / FPS, keyframe)) {
+                        return 1;
+                }
+
+                Frame frame;
+
+                while (queue.pop (frame)) {
+                        session.telemetry ().log (frame);
+
+                        if (lastFrame) {
+                                frameInterval.add (frame.timestamp - lastFrame);
+                        }
+
+                        lastFrame = frame.timestamp;
+                        stats.push (frame);
+                        rules.update (frame);
+                        session.subtitles ().add (frame);
+
+                        if (frame.sampleTime - lastStats >= STATS_INTERVAL_US) {
+                                if (lastStats) {
+                                        stats.report (session.telemetry ());
+                                }
+
+                                lastStats = frame.sampleTime;
+                        }
+
+                        parking.update (frame);
+                }
+        }
+
+        allocation::disarm ();
+        session.closeSegment ();
+        writer->sync (10000);
+
+        unsigned long violations = allocation::violations ();
+        printf ("%s : %u buffers, %u segments, %lu heap allocations in the steady state\n", writer->name (), seconds * FPS,
+                session.getSegment () + 1, violations);
+
+        std::string command = std::string ("rm -rf ") + base;
+
+        if (system (command.c_str ()) != 0) {
+                fprintf (stderr, "Unable to remove %s\n", base);
+        }
+
+        return (violations) ? 1 : 0;
+}
@@ -0,0 +1,178 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "SegmentWriter.h"
+#include "Clock.h"
+
+/**
+ * Segment writer backends on the card they are meant for : encoder sized buffers at the
+ * given bitrate, 30 fps, a key frame (5 times bigger) every 30 frames, 90 buffers per
+ * segment like rotateFiles. Unpaced first (how fast can the backend go), then paced at
+ * the bitrate (how long does the encoder callback wait, how much gets dropped).
+ *
+ * Checks that every segment holds whole buffers only : each buffer starts with a start
+ * code and its index, so a cut one shows up.
+ */
+static const unsigned int FPS = 30;
+static const unsigned int GOP = 30;
+static const unsigned int FRAMES_PER_FILE = 90;
+
+struct Result {
+        double seconds = 0;
+        uint64_t bytes = 0;
+        LatencyStats call;
+        uint64_t dropped = 0;
+};
+
+/*****************************************************************************/
+
+static bool run (SegmentWriter *writer, std::string const &dir, unsigned int bitrate, unsigned int seconds, bool paced, Result *result,
+                 std::vector <std::string> *files)
+{
+        size_t frame = bitrate / 8 / FPS;
+        std::vector <uint8_t> buffer (frame * 5);
+        unsigned int frames = seconds * FPS;
+        uint64_t droppedBefore = writer->getDropped ();
+        uint64_t start = monotonicUs ();
+
+        for (unsigned int i = 0; i < frames; ++i) {
+                if (i % FRAMES_PER_FILE == 0) {
+                        char path[256];
+                        snprintf (path, sizeof (path), "%s/bench%05u.h264", dir.c_str (), unsigned (files->size ()));
+                        files->push_back (path);
+
+                        if (!writer->open (path)) {
+                                return false;
+                        }
+                }
+
+                bool keyframe = (i % GOP == 0);
+                size_t length = (keyframe) ? frame * 5 : frame;
+                buffer[0] = buffer[1] = buffer[2] = 0;
+                buffer[3] = 1;
+                memcpy (&buffer[4], &i, sizeof (i));
+
+                uint64_t before = monotonicUs ();
+
+                if (!writer->write (buffer.data (), length, keyframe)) {
+                        return false;
+                }
+
+                result->call.add (monotonicUs () - before);
+                result->bytes += length;
+
+                if (paced) {
+                        uint64_t due = start + uint64_t (i + 1) * 1000000 / FPS;
+                        uint64_t now = monotonicUs ();
+
+                        if (due > now) {
+                                usleep (due - now);
+                        }
+                }
+        }
+
+        writer->close ();
+        writer->sync (10000);
+        result->seconds = (monotonicUs () - start) / 1e6;
+        result->dropped = writer->getDropped () - droppedBefore;
+        return true;
+}
+
+/*****************************************************************************/
+
+static bool verify (std::vector <std::string> const &files, unsigned int bitrate, uint64_t expected)
+{
+        size_t frame = bitrate / 8 / FPS;
+        uint64_t total = 0;
+        std::vector <uint8_t> data;
+
+        for (std::string const &name : files) {
+                FILE *f = fopen (name.c_str (), "rb");
+
+                if (!f) {
+                        perror (name.c_str ());
+                        return false;
+                }
+
+                fseek (f, 0, SEEK_END);
+                data.resize (ftell (f));
+                fseek (f, 0, SEEK_SET);
+                size_t n = fread (data.data (), 1, data.size (), f);
+                fclose (f);
+                unlink (name.c_str ());
+
+                for (size_t at = 0; at < n;) {
+                        unsigned int i;
+
+                        if (n - at < 8 || data[at] || data[at + 1] || data[at + 2] || data[at + 3] != 1) {
+                                fprintf (stderr, "%s : cut buffer at %zu\n", name.c_str (), at);
+                                return false;
+                        }
+
+                        memcpy (&i, &data[at + 4], sizeof (i));
+                        at += (i % GOP == 0) ? frame * 5 : frame;
+                }
+
+                total += n;
+        }
+
+        if (total != expected) {
+                fprintf (stderr, "%llu bytes in the files, %llu expected\n", (unsigned long long)total, (unsigned long long)expected);
+                return false;
+        }
+
+        return true;
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+        if (argc < 3 || !strcmp (argv[1], "-h")) {
+                fprintf (stderr, "Usage : %s buffered|direct directory [bitrate (17000000)] [seconds (20)]\n", argv[0]);
+                return 1;
+        }
+
+        std::string dir = argv[2];
+        unsigned int bitrate = (argc > 3) ? atoi (argv[3]) : 17000000;
+        unsigned int seconds = (argc > 4) ? atoi (argv[4]) : 20;
+        bool ok = true;
+
+        for (bool paced : { false, true }) {
+                std::unique_ptr <SegmentWriter> writer (SegmentWriter::create (argv[1]));
+
+                if (!writer) {
+                        fprintf (stderr, "Unknown writer %s\n", argv[1]);
+                        return 1;
+                }
+
+                Result result;
+                std::vector <std::string> files;
+
+                if (!run (writer.get (), dir, bitrate, seconds, paced, &result, &files)) {
+                        fprintf (stderr, "%s : write failed\n", writer->name ());
+                        return 1;
+                }
+
+                printf ("%s %s : %.1f MB in %.2f s, %.1f MB/s, dropped %llu bytes\n", writer->name (), (paced) ? "paced" : "unpaced",
+                        result.bytes / 1e6, result.seconds, result.bytes / 1e6 / result.seconds, (unsigned long long)result.dropped);
+                result.call.print (stdout, "  write call");
+                writer->latency ().print (stdout, "  syscall");
+
+                ok = verify (files, bitrate, result.bytes - result.dropped) && ok;
+        }
+
+        return (ok) ? 0 : 1;
+}